@@ -2,6 +2,7 @@
 
 #include "./interval.hpp"
 #include "./ray.hpp"
+#include "./stats.hpp"
 #include "./vec3.hpp"
 
 class aabb
@@ -41,6 +42,7 @@ public:
 
   bool hit(const ray &r, Interval ray_t) const
   {
+    stats::add(stats::box_tests);
     const point3 &ray_orig = r.origin();
     const vec3 &ray_dir = r.direction();
 
@@ -82,6 +84,16 @@ public:
       return y.size() > z.size() ? 1 : 2;
   }
 
+  point3 centroid() const { return point3(0.5 * (x.min + x.max), 0.5 * (y.min + y.max), 0.5 * (z.min + z.max)); }
+
+  double surface_area() const
+  {
+    auto dx = x.size(), dy = y.size(), dz = z.size();
+    if (dx < 0 || dy < 0 || dz < 0)
+      return 0;
+    return 2 * (dx * dy + dy * dz + dz * dx);
+  }
+
   static const aabb empty, universe;
 };
 
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// A bump allocator. Memory comes from large blocks handed out front to back, so objects made one
+// after another sit next to each other, and everything is released at once when the arena goes
+// away. Objects with non-trivial destructors are remembered and destroyed in reverse order of
+// construction; plain data costs nothing to free.
+//
+// Not thread-safe: callers that allocate from several threads must serialize access.
+class Arena
+{
+public:
+  explicit Arena(size_t block_size = 64 * 1024) : block_size(block_size) {}
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  ~Arena() { clear(); }
+
+  void *allocate(size_t size, size_t alignment = alignof(std::max_align_t))
+  {
+    uintptr_t aligned = (cursor + alignment - 1) & ~uintptr_t(alignment - 1);
+    if (cursor == 0 || aligned + size > limit)
+    {
+      add_block(size + alignment);
+      aligned = (cursor + alignment - 1) & ~uintptr_t(alignment - 1);
+    }
+    cursor = aligned + size;
+    bytes_used += size;
+    return reinterpret_cast<void *>(aligned);
+  }
+
+  // Constructs a T in the arena. It lives until the arena is cleared or destroyed.
+  template <typename T, typename... Args>
+  T *make(Args &&...args)
+  {
+    void *memory = allocate(sizeof(T), alignof(T));
+    T *object = new (memory) T(std::forward<Args>(args)...);
+    if constexpr (!std::is_trivially_destructible_v<T>)
+      destructors.push_back({object, [](void *p) { static_cast<T *>(p)->~T(); }});
+    return object;
+  }
+
+  // Destroys every object and frees all blocks.
+  void clear()
+  {
+    for (auto it = destructors.rbegin(); it != destructors.rend(); ++it)
+      it->destroy(it->object);
+    destructors.clear();
+    blocks.clear();
+    cursor = limit = 0;
+    bytes_used = 0;
+  }
+
+  size_t used() const { return bytes_used; }  // Bytes handed out, not counting alignment padding
+
+private:
+  struct Destructor
+  {
+    void *object;
+    void (*destroy)(void *);
+  };
+
+  size_t block_size;
+  std::vector<std::unique_ptr<unsigned char[]>> blocks;
+  std::vector<Destructor> destructors;
+  uintptr_t cursor = 0;
+  uintptr_t limit = 0;
+  size_t bytes_used = 0;
+
+  // Oversized requests get a block of their own; the rest of the current block is abandoned.
+  void add_block(size_t min_size)
+  {
+    size_t size = std::max(block_size, min_size);
+    blocks.emplace_back(new unsigned char[size]);
+    cursor = reinterpret_cast<uintptr_t>(blocks.back().get());
+    limit = cursor + size;
+  }
+};
@@ -0,0 +1,660 @@
+// Benchmark suite. Renders a fixed set of scenes, built in code with fixed seeds, and prints a
+// JSON report: BVH build time, primary-ray and full-path throughput, peak memory, and the error
+// of each image against a stored high-sample reference. Options select the BVH width, integrator
+// and packet tracing, so acceleration structures and integrators can be compared on equal terms.
+//
+// Each scene runs in a child process (this binary with --only), so peak memory is per scene.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "./camera.hpp"
+#include "./image_io.hpp"
+#include "./material.hpp"
+#include "./scene.hpp"
+#include "./sphere.hpp"
+#include "./sphere_set.hpp"
+#include "./texture.hpp"
+#include "./triangle_mesh.hpp"
+
+#ifndef RT_BENCH_VERSION
+#define RT_BENCH_VERSION "unknown"
+#endif
+
+namespace
+{
+  using clock_type = std::chrono::steady_clock;
+
+  double seconds_since(clock_type::time_point start)
+  {
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+  }
+
+  struct Bench_options
+  {
+    int width = 160;  // The height follows from a 16:9 aspect ratio
+    size_t spp = 16;
+    size_t depth = 10;
+    size_t threads = 0;
+    int bvh_width = 0;
+    Bvh_split bvh_split = Bvh_split::sah;
+    Integrator integrator = Integrator::recursive;
+    bool roulette = true;  // Iterative integrator only
+    size_t roulette_min_depth = 3;
+    Sampler_type sampler = Sampler_type::sobol;
+    bool packets = false;
+    double adaptive = 0;  // Adaptive sampling tolerance, 0 for off
+    size_t reference_spp = 1024;
+    std::string references = "bench/references";
+  };
+
+  const char *integrator_name(Integrator integrator)
+  {
+    switch (integrator)
+    {
+      case Integrator::wavefront:
+        return "wavefront";
+      case Integrator::iterative:
+        return "iterative";
+      default:
+        return "recursive";
+    }
+  }
+
+  const char *sampler_name(Sampler_type sampler)
+  {
+    switch (sampler)
+    {
+      case Sampler_type::independent:
+        return "independent";
+      case Sampler_type::stratified:
+        return "stratified";
+      case Sampler_type::halton:
+        return "halton";
+      default:
+        return "sobol";
+    }
+  }
+
+  // Rays traced by threads that have exited, and the running count of the current thread. Each
+  // thread counts into its own slot and folds it into the total when it exits, so the hot path
+  // touches no shared cache line.
+  std::atomic<uint64_t> finished_rays{0};
+
+  struct Ray_tally
+  {
+    uint64_t rays = 0;
+    ~Ray_tally() { finished_rays += rays; }
+  };
+  thread_local Ray_tally ray_tally;
+
+  // Counts the rays traced through it. Read rays() after the render's pool has been torn down.
+  class Ray_counter : public Shape
+  {
+    const Shape &inner;
+
+  public:
+    explicit Ray_counter(const Shape &inner) : inner(inner) {}
+
+    bool hit(const ray &r, Interval ray_t, hit_record &rec) const override
+    {
+      ray_tally.rays++;
+      return inner.hit(r, ray_t, rec);
+    }
+
+    int hit8(RayPacket8 &packet, hit_record *records) const override
+    {
+      ray_tally.rays += uint64_t(__builtin_popcount(unsigned(packet.active)));
+      return inner.hit8(packet, records);
+    }
+
+    aabb bounding_box() const override { return inner.bounding_box(); }
+
+    static void reset()
+    {
+      finished_rays = 0;
+      ray_tally.rays = 0;
+    }
+
+    static uint64_t rays() { return finished_rays + ray_tally.rays; }
+  };
+
+  // Scene builders. Each adds its shapes to the scene, points the camera, and returns the time
+  // spent building acceleration structures.
+
+  double build_spheres(Scene &scene, Camera &cam, const Bvh_build_options &bvh, size_t count)
+  {
+    Rng rng(0x5eed, count);
+    auto random = [&rng](double min, double max) { return min + (max - min) * rng.next_double(); };
+
+    auto set = scene.make<SphereSet>();
+    auto checker = scene.make<Checker_texture>(0.32, scene.make<solid_color>(color(.2, .3, .1)),
+                                               scene.make<solid_color>(color(.9, .9, .9)));
+    set->add(point3(0, -1000, 0), 1000, set->add_material(scene.make<Lambertian>(checker)));
+
+    // A fixed palette, so materials stay few as the sphere count grows.
+    std::vector<uint32_t> palette;
+    for (int k = 0; k < 48; k++)
+    {
+      auto albedo = color(random(0, 1), random(0, 1), random(0, 1));
+      const material *mat;
+      if (k < 32)
+        mat = scene.make<Lambertian>(scene.make<solid_color>(albedo * albedo));
+      else if (k < 44)
+        mat = scene.make<metal>(0.5 * (albedo + color(1, 1, 1)), random(0, 0.5));
+      else
+        mat = scene.make<dielectric>(1.5);
+      palette.push_back(set->add_material(mat));
+    }
+
+    // One sphere per unit of area, on a square around the origin.
+    double half = 0.5 * std::sqrt(double(count));
+    for (size_t k = 0; k < count; k++)
+    {
+      point3 center(random(-half, half), 0.2, random(-half, half));
+      set->add(center, 0.2, palette[size_t(random(0, double(palette.size())))]);
+    }
+
+    auto start = clock_type::now();
+    set->build(bvh);
+    double seconds = seconds_since(start);
+    scene.world.add(set);
+
+    cam.vfov = 20;
+    cam.lookfrom = point3(13, 2, 3);
+    cam.lookat = point3(0, 0, 0);
+    cam.defocus_angle = 0.6;
+    cam.focus_dist = 10;
+    return seconds;
+  }
+
+  double build_globe(Scene &scene, Camera &cam, const Bvh_build_options &)
+  {
+    auto surface = scene.make<Lambertian>(scene.make<Image_texture>("nebular.jpg"));
+    scene.world.add(scene.make<Sphere>(point3(0, 0, 0), 2, surface));
+    cam.vfov = 20;
+    cam.lookfrom = point3(0, 0, 12);
+    cam.lookat = point3(0, 0, 0);
+    return 0;
+  }
+
+  double build_perlin(Scene &scene, Camera &cam, const Bvh_build_options &)
+  {
+    auto marble = scene.make<Lambertian>(scene.make<Noise_texture>());
+    scene.world.add(scene.make<Sphere>(point3(0, -1000, 0), 1000, marble));
+    scene.world.add(scene.make<Sphere>(point3(0, 2, 0), 2, marble));
+    cam.vfov = 20;
+    cam.lookfrom = point3(13, 2, 3);
+    cam.lookat = point3(0, 0, 0);
+    return 0;
+  }
+
+  // A torus tessellated into 2 * rings * segments triangles with smooth normals, on a ground.
+  double build_mesh(Scene &scene, Camera &cam, const Bvh_build_options &bvh)
+  {
+    const uint32_t rings = 1024, segments = 256;
+    const double major = 2, minor = 0.7;
+
+    auto mesh = scene.make<TriangleMesh>(scene.make<metal>(color(0.8, 0.6, 0.4), 0.2));
+    for (uint32_t r = 0; r < rings; r++)
+    {
+      double a = 2 * pi * r / rings;
+      for (uint32_t s = 0; s < segments; s++)
+      {
+        double b = 2 * pi * s / segments;
+        vec3 normal(std::cos(a) * std::cos(b), std::sin(b), std::sin(a) * std::cos(b));
+        mesh->positions.push_back(point3(major * std::cos(a), 0, major * std::sin(a)) + minor * normal);
+        mesh->normals.push_back(normal);
+      }
+    }
+    for (uint32_t r = 0; r < rings; r++)
+    {
+      for (uint32_t s = 0; s < segments; s++)
+      {
+        uint32_t v00 = r * segments + s;
+        uint32_t v01 = r * segments + (s + 1) % segments;
+        uint32_t v10 = (r + 1) % rings * segments + s;
+        uint32_t v11 = (r + 1) % rings * segments + (s + 1) % segments;
+        for (auto corners : {std::array<uint32_t, 3>{v00, v01, v11}, std::array<uint32_t, 3>{v00, v11, v10}})
+        {
+          Mesh_triangle triangle;
+          for (int c = 0; c < 3; c++)
+          {
+            triangle.position[c] = triangle.normal[c] = corners[c];
+            triangle.texcoord[c] = TriangleMesh::no_index;
+          }
+          mesh->triangles.push_back(triangle);
+        }
+      }
+    }
+
+    auto start = clock_type::now();
+    mesh->build(bvh);
+    double seconds = seconds_since(start);
+    scene.world.add(mesh);
+
+    auto ground = scene.make<Lambertian>(scene.make<solid_color>(color(0.5, 0.5, 0.5)));
+    scene.world.add(scene.make<Sphere>(point3(0, -1000.7, 0), 1000, ground));
+    cam.vfov = 30;
+    cam.lookfrom = point3(0, 5, 9);
+    cam.lookat = point3(0, 0, 0);
+    return seconds;
+  }
+
+  struct Bench_scene
+  {
+    const char *name;
+    double (*build)(Scene &, Camera &, const Bvh_build_options &);
+  };
+
+  const Bench_scene scenes[] = {
+      {"spheres_1k", [](Scene &s, Camera &c, const Bvh_build_options &o) { return build_spheres(s, c, o, 1000); }},
+      {"spheres_10k", [](Scene &s, Camera &c, const Bvh_build_options &o) { return build_spheres(s, c, o, 10000); }},
+      {"spheres_100k", [](Scene &s, Camera &c, const Bvh_build_options &o) { return build_spheres(s, c, o, 100000); }},
+      {"globe", build_globe},
+      {"perlin", build_perlin},
+      {"torus_mesh", build_mesh},
+  };
+
+  const Bench_scene *find_scene(const std::string &name)
+  {
+    for (const auto &scene : scenes)
+      if (name == scene.name)
+        return &scene;
+    return nullptr;
+  }
+
+  std::string reference_path(const Bench_options &options, const char *name)
+  {
+    return options.references + "/" + name + ".pfm";
+  }
+
+  // Camera shared by every scene; the builders only aim it.
+  void configure(Camera &cam, const Bench_options &options)
+  {
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = options.width;
+    cam.samples_per_pixel = options.spp;
+    cam.max_depth = options.depth;
+    cam.thread_count = options.threads;
+    cam.integrator = options.integrator;
+    cam.russian_roulette = options.roulette;
+    cam.roulette_min_depth = options.roulette_min_depth;
+    cam.sampler = options.sampler;
+    cam.use_packets = options.packets;
+    cam.adaptive_sampling = options.adaptive > 0;
+    cam.adaptive_tolerance = options.adaptive;
+  }
+
+  size_t peak_memory_kb()
+  {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return size_t(usage.ru_maxrss) / 1024;
+#else
+    return size_t(usage.ru_maxrss);
+#endif
+  }
+
+  void json_number(std::ostream &out, double value)
+  {
+    if (std::isfinite(value))
+      out << value;
+    else
+      out << "null";
+  }
+
+  // Runs one scene and prints its JSON object on one line.
+  int run_scene(const Bench_scene &bench, const Bench_options &options)
+  {
+    seed_random(0, 0);  // Fixed generator state for anything drawn while building (Perlin tables)
+
+    Scene scene;
+    Camera cam;
+    configure(cam, options);
+    Bvh_build_options bvh;
+    bvh.width = options.bvh_width;
+    bvh.split = options.bvh_split;
+    bvh.thread_count = options.threads;
+    double build_seconds = bench.build(scene, cam, bvh);
+    Ray_counter counter(scene.world);
+
+    // Primary rays only: with one bounce allowed, no path is continued past its first hit.
+    Framebuffer image;
+    cam.max_depth = 1;
+    Ray_counter::reset();
+    auto start = clock_type::now();
+    cam.render(counter, image);
+    double primary_seconds = seconds_since(start);
+    uint64_t primary_rays = Ray_counter::rays();
+
+    cam.max_depth = options.depth;
+    Ray_counter::reset();
+    start = clock_type::now();
+    cam.render(counter, image);
+    double render_seconds = seconds_since(start);
+    uint64_t rays = Ray_counter::rays();
+
+    double rmse = NAN, psnr = NAN;
+    Framebuffer reference;
+    std::string path = reference_path(options, bench.name);
+    if (read_pfm(path, reference) && reference.width() == image.width() && reference.height() == image.height())
+    {
+      // Over display values: linear, clamped to [0, 1].
+      double sum = 0;
+      for (int j = 0; j < image.height(); j++)
+        for (int i = 0; i < image.width(); i++)
+          for (int c = 0; c < 3; c++)
+          {
+            double d = std::clamp(image.at(i, j)[c], 0.0, 1.0) - std::clamp(reference.at(i, j)[c], 0.0, 1.0);
+            sum += d * d;
+          }
+      double mse = sum / (3.0 * image.width() * image.height());
+      rmse = std::sqrt(mse);
+      psnr = mse > 0 ? 10 * std::log10(1 / mse) : INFINITY;
+    }
+
+    std::ostringstream out;
+    out.precision(6);
+    out << "{\"name\": \"" << bench.name << "\", \"width\": " << image.width() << ", \"height\": " << image.height()
+        << ", \"bvh_build_seconds\": " << build_seconds << ", \"primary_rays\": " << primary_rays
+        << ", \"primary_seconds\": " << primary_seconds << ", \"primary_mrays_per_second\": ";
+    json_number(out, primary_rays / primary_seconds * 1e-6);
+    out << ", \"rays\": " << rays << ", \"render_seconds\": " << render_seconds << ", \"mrays_per_second\": ";
+    json_number(out, rays / render_seconds * 1e-6);
+    out << ", \"peak_memory_kb\": " << peak_memory_kb() << ", \"rmse\": ";
+    json_number(out, rmse);
+    out << ", \"psnr_db\": ";
+    json_number(out, psnr);
+    out << "}";
+    std::cout << out.str() << std::endl;
+    return 0;
+  }
+
+  // Renders the scene's reference image: the recursive integrator, binary BVH and no packets,
+  // at reference_spp samples per pixel.
+  int write_reference(const Bench_scene &bench, const Bench_options &options)
+  {
+    seed_random(0, 0);
+    Scene scene;
+    Camera cam;
+    Bench_options neutral = options;
+    neutral.spp = options.reference_spp;
+    neutral.integrator = Integrator::recursive;
+    neutral.packets = false;
+    configure(cam, neutral);
+    Bvh_build_options binary;
+    binary.width = 2;
+    bench.build(scene, cam, binary);
+
+    Framebuffer image;
+    cam.render(scene.world, image);
+    std::string path = reference_path(options, bench.name);
+    if (!write_image(image, path))
+      return 1;
+    std::clog << "Wrote " << path << ".\n";
+    return 0;
+  }
+
+  // Value of a top-level number in one of run_scene's lines, or 0.
+  double field(const std::string &json, const char *key)
+  {
+    std::string pattern = std::string("\"") + key + "\": ";
+    auto at = json.find(pattern);
+    if (at == std::string::npos)
+      return 0;
+    double value = 0;
+    const char *begin = json.data() + at + pattern.size();
+    std::from_chars(begin, json.data() + json.size(), value);
+    return value;
+  }
+
+  void usage()
+  {
+    std::cerr << "Usage: bench [options]\n"
+                 "  --width N             image width (default 160)\n"
+                 "  --spp N               samples per pixel (default 16)\n"
+                 "  --depth N             maximum bounces (default 10)\n"
+                 "  --threads N           render and build threads, 0 for all (default)\n"
+                 "  --bvh-width N         2, 4 or 8 children per BVH node, 0 picks by CPU (default)\n"
+                 "  --bvh-split NAME      sah (default) or median\n"
+                 "  --integrator NAME     recursive (default), iterative or wavefront\n"
+                 "  --roulette-min-depth N  bounces before Russian roulette (iterative, default 3)\n"
+                 "  --no-roulette         trace every iterative path to --depth\n"
+                 "  --sampler NAME        sobol (default), halton, stratified or independent\n"
+                 "  --packets             trace primary rays in packets of 8\n"
+                 "  --adaptive TOL        adaptive sampling to a 95% luminance error of TOL, --spp at most\n"
+                 "  --only NAME           run one scene and print its result\n"
+                 "  --references DIR      reference images (default bench/references)\n"
+                 "  --update-references   render the reference images instead of benchmarking\n"
+                 "  --reference-spp N     samples per pixel for references (default 1024)\n"
+                 "Scenes:";
+    for (const auto &scene : scenes)
+      std::cerr << ' ' << scene.name;
+    std::cerr << '\n';
+  }
+}  // namespace
+
+int main(int argc, char **argv)
+{
+  Bench_options options;
+  std::string only;
+  bool update_references = false;
+  std::string forwarded;  // Options passed on to the per-scene child processes
+
+  for (int k = 1; k < argc; k++)
+  {
+    std::string arg = argv[k];
+    auto number = [&](auto &value)
+    {
+      long parsed = -1;
+      if (k + 1 < argc)
+      {
+        const char *text = argv[++k];
+        auto result = std::from_chars(text, text + std::strlen(text), parsed);
+        if (result.ec != std::errc() || *result.ptr != '\0')
+          parsed = -1;
+      }
+      if (parsed < 0)
+      {
+        std::cerr << "ERROR: " << arg << " needs a non-negative number.\n";
+        std::exit(1);
+      }
+      value = decltype(value + 0)(parsed);
+      forwarded += " " + arg + " " + std::to_string(parsed);
+    };
+
+    if (arg == "--width")
+      number(options.width);
+    else if (arg == "--spp")
+      number(options.spp);
+    else if (arg == "--depth")
+      number(options.depth);
+    else if (arg == "--threads")
+      number(options.threads);
+    else if (arg == "--bvh-width")
+    {
+      number(options.bvh_width);
+      if (options.bvh_width != 0 && options.bvh_width != 2 && options.bvh_width != 4 && options.bvh_width != 8)
+      {
+        std::cerr << "ERROR: --bvh-width must be 0, 2, 4 or 8.\n";
+        return 1;
+      }
+    }
+    else if (arg == "--reference-spp")
+      number(options.reference_spp);
+    else if (arg == "--roulette-min-depth")
+      number(options.roulette_min_depth);
+    else if (arg == "--no-roulette")
+    {
+      options.roulette = false;
+      forwarded += " --no-roulette";
+    }
+    else if (arg == "--packets")
+    {
+      options.packets = true;
+      forwarded += " --packets";
+    }
+    else if (arg == "--integrator" && k + 1 < argc)
+    {
+      std::string name = argv[++k];
+      if (name == "recursive")
+        options.integrator = Integrator::recursive;
+      else if (name == "iterative")
+        options.integrator = Integrator::iterative;
+      else if (name == "wavefront")
+        options.integrator = Integrator::wavefront;
+      else
+      {
+        std::cerr << "ERROR: Unknown integrator '" << name << "'.\n";
+        return 1;
+      }
+      forwarded += " --integrator " + name;
+    }
+    else if (arg == "--adaptive")
+    {
+      double parsed = -1;
+      if (k + 1 < argc)
+      {
+        const char *text = argv[++k];
+        auto result = std::from_chars(text, text + std::strlen(text), parsed);
+        if (result.ec != std::errc() || *result.ptr != '\0')
+          parsed = -1;
+      }
+      if (!(parsed >= 0))
+      {
+        std::cerr << "ERROR: " << arg << " needs a non-negative number.\n";
+        return 1;
+      }
+      options.adaptive = parsed;
+      forwarded += " --adaptive " + std::string(argv[k]);
+    }
+    else if (arg == "--bvh-split" && k + 1 < argc)
+    {
+      std::string name = argv[++k];
+      if (name == "sah")
+        options.bvh_split = Bvh_split::sah;
+      else if (name == "median")
+        options.bvh_split = Bvh_split::median;
+      else
+      {
+        std::cerr << "ERROR: Unknown BVH split '" << name << "'.\n";
+        return 1;
+      }
+      forwarded += " --bvh-split " + name;
+    }
+    else if (arg == "--sampler" && k + 1 < argc)
+    {
+      std::string name = argv[++k];
+      if (name == "sobol")
+        options.sampler = Sampler_type::sobol;
+      else if (name == "halton")
+        options.sampler = Sampler_type::halton;
+      else if (name == "stratified")
+        options.sampler = Sampler_type::stratified;
+      else if (name == "independent")
+        options.sampler = Sampler_type::independent;
+      else
+      {
+        std::cerr << "ERROR: Unknown sampler '" << name << "'.\n";
+        return 1;
+      }
+      forwarded += " --sampler " + name;
+    }
+    else if (arg == "--references" && k + 1 < argc)
+    {
+      options.references = argv[++k];
+      forwarded += " --references '" + options.references + "'";
+    }
+    else if (arg == "--only" && k + 1 < argc)
+      only = argv[++k];
+    else if (arg == "--update-references")
+      update_references = true;
+    else if (arg == "--help" || arg == "-h")
+    {
+      usage();
+      return 0;
+    }
+    else
+    {
+      std::cerr << "ERROR: Unknown option '" << arg << "'.\n";
+      usage();
+      return 1;
+    }
+  }
+
+  if (!only.empty())
+  {
+    const Bench_scene *scene = find_scene(only);
+    if (!scene)
+    {
+      std::cerr << "ERROR: Unknown scene '" << only << "'.\n";
+      return 1;
+    }
+    return update_references ? write_reference(*scene, options) : run_scene(*scene, options);
+  }
+
+  if (update_references)
+  {
+    for (const auto &scene : scenes)
+      if (write_reference(scene, options) != 0)
+        return 1;
+    return 0;
+  }
+
+  std::cout << "{\n  \"version\": \"" << RT_BENCH_VERSION << "\",\n  \"options\": {\"width\": " << options.width
+            << ", \"spp\": " << options.spp << ", \"depth\": " << options.depth << ", \"threads\": " << options.threads
+            << ", \"bvh_width\": " << options.bvh_width
+            << ", \"bvh_split\": \"" << (options.bvh_split == Bvh_split::median ? "median" : "sah")
+            << "\", \"integrator\": \"" << integrator_name(options.integrator) << "\", \"roulette\": " << (options.roulette ? "true" : "false")
+            << ", \"roulette_min_depth\": " << options.roulette_min_depth << ", \"sampler\": \"" << sampler_name(options.sampler) << "\", \"packets\": " << (options.packets ? "true" : "false")
+            << ", \"adaptive\": " << options.adaptive << "},\n  \"scenes\": [";
+
+  double rays = 0, seconds = 0;
+  bool first = true, ok = true;
+  for (const auto &scene : scenes)
+  {
+    std::string command = std::string("'") + argv[0] + "' --only " + scene.name + forwarded;
+    std::string line;
+    if (FILE *child = popen(command.c_str(), "r"))
+    {
+      char buffer[4096];
+      while (std::fgets(buffer, sizeof(buffer), child))
+        line += buffer;
+      if (pclose(child) != 0)
+        line.clear();
+    }
+    while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+      line.pop_back();
+    if (line.empty())
+    {
+      std::cerr << "ERROR: Scene '" << scene.name << "' failed.\n";
+      line = std::string("{\"name\": \"") + scene.name + "\", \"error\": true}";
+      ok = false;
+    }
+
+    rays += field(line, "rays");
+    seconds += field(line, "render_seconds");
+    std::cout << (first ? "\n    " : ",\n    ") << line << std::flush;
+    first = false;
+  }
+
+  std::cout << "\n  ],\n  \"total\": {\"rays\": " << uint64_t(rays) << ", \"render_seconds\": " << seconds
+            << ", \"mrays_per_second\": ";
+  json_number(std::cout, rays / seconds * 1e-6);
+  std::cout << "}\n}\n";
+  return ok ? 0 : 1;
+}
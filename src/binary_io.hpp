@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Plain binary streams for on-disk caches. Values are written in host byte order and arrays
+// start on 8-byte boundaries, so a reader over a memory-mapped file can copy each array with one
+// memcpy. These files are caches, not interchange formats: they are only read back on the
+// machine (and build) that wrote them.
+
+class Binary_writer
+{
+public:
+  explicit Binary_writer(std::ostream &out) : out(out) {}
+
+  template <typename T>
+  void value(const T &v)
+  {
+    static_assert(std::is_trivially_copyable_v<T>, "Only plain data can be written raw");
+    out.write(reinterpret_cast<const char *>(&v), sizeof(T));
+    offset += sizeof(T);
+  }
+
+  template <typename T>
+  void array(const std::vector<T> &values)
+  {
+    static_assert(std::is_trivially_copyable_v<T>, "Only plain data can be written raw");
+    value(uint64_t(values.size()));
+    align();
+    out.write(reinterpret_cast<const char *>(values.data()), std::streamsize(values.size() * sizeof(T)));
+    offset += values.size() * sizeof(T);
+    align();
+  }
+
+  void string(const std::string &s)
+  {
+    value(uint64_t(s.size()));
+    out.write(s.data(), std::streamsize(s.size()));
+    offset += s.size();
+    align();
+  }
+
+  bool good() const { return bool(out); }
+
+private:
+  std::ostream &out;
+  size_t offset = 0;
+
+  void align()
+  {
+    static const char zeros[8] = {};
+    size_t pad = (8 - offset % 8) % 8;
+    out.write(zeros, std::streamsize(pad));
+    offset += pad;
+  }
+};
+
+// Reads what a Binary_writer wrote, from a block of memory. Any overrun sets good() to false and
+// leaves outputs untouched, so callers check once at the end.
+class Binary_reader
+{
+public:
+  Binary_reader(const char *begin, const char *end) : start(begin), p(begin), end(end) {}
+
+  template <typename T>
+  bool value(T &v)
+  {
+    if (!ok || size_t(end - p) < sizeof(T))
+      return ok = false;
+    std::memcpy(&v, p, sizeof(T));
+    p += sizeof(T);
+    return true;
+  }
+
+  template <typename T>
+  bool array(std::vector<T> &values)
+  {
+    uint64_t count;
+    if (!value(count))
+      return false;
+    align();
+    if (!ok || count > uint64_t(end - p) / sizeof(T))
+      return ok = false;
+    values.resize(size_t(count));
+    std::memcpy(values.data(), p, size_t(count) * sizeof(T));
+    p += count * sizeof(T);
+    align();
+    return true;
+  }
+
+  bool string(std::string &s)
+  {
+    uint64_t length;
+    if (!value(length))
+      return false;
+    if (length > uint64_t(end - p))
+      return ok = false;
+    s.assign(p, size_t(length));
+    p += length;
+    align();
+    return true;
+  }
+
+  bool good() const { return ok; }
+
+private:
+  const char *start;
+  const char *p;
+  const char *end;
+  bool ok = true;
+
+  void align()
+  {
+    size_t pad = (8 - size_t(p - start) % 8) % 8;
+    if (size_t(end - p) < pad)
+    {
+      ok = false;
+      return;
+    }
+    p += pad;
+  }
+};
@@ -1,83 +1,160 @@
 #pragma once
 
 #include <algorithm>
+#include <vector>
 
 #include "./aabb.hpp"
+#include "./linear_bvh.hpp"
 #include "./shape.hpp"
+#include "./stats.hpp"
 #include "./utils.hpp"
+#include "./wide_bvh.hpp"
 #include "./world.hpp"
 
+// Bounding volume hierarchy over a list of shapes. The tree is flattened into a Linear_bvh and
+// the shapes are packed in leaf order, so a leaf is a contiguous run of `primitives`. Unless a
+// binary tree is requested, the tree is then collapsed into a 4- or 8-wide Wide_bvh.
 class bvh_node : public Shape
 {
-  shared_ptr<Shape> left;
-  shared_ptr<Shape> right;
+  std::vector<const Shape *> primitives;
+  Linear_bvh bvh;
+  Wide_bvh wide;
   aabb bbox;
 
 public:
-  bvh_node(hittable_list list) : bvh_node(list.objects, 0, list.objects.size())
-  {
-    // There's a C++ subtlety here. This constructor (without span indices) creates an
-    // implicit copy of the hittable list, which we will modify. The lifetime of the copied
-    // list only extends until this constructor exits. That's OK, because we only need to
-    // persist the resulting bounding volume hierarchy.
-  }
+  bvh_node(const hittable_list &list, const Bvh_build_options &options = Bvh_build_options()) : bvh_node(list.objects, options) {}
 
-  bvh_node(std::vector<shared_ptr<Shape>> &objects, size_t start, size_t end)
+  bvh_node(const std::vector<const Shape *> &objects, const Bvh_build_options &options = Bvh_build_options())
   {
-    bbox = aabb::empty;
-    for (size_t object_index = start; object_index < end; object_index++)
-      bbox = aabb(bbox, objects[object_index]->bounding_box());
-
-    int axis = bbox.longest_axis();
+    std::vector<aabb> bounds;
+    bounds.reserve(objects.size());
+    for (const auto &object : objects)
+      bounds.push_back(object->bounding_box());
 
-    auto comparator = (axis == 0) ? box_x_compare : (axis == 1) ? box_y_compare : box_z_compare;
+    bvh.build(bounds, options);
+    if (options.width != 2)
+      wide = Wide_bvh(bvh, options.width);
 
-    size_t object_span = end - start;
+    primitives.reserve(objects.size());
+    for (auto index : bvh.primitive_order())
+      primitives.push_back(objects[index]);
 
-    if (object_span == 1)
-    {
-      left = right = objects[start];
-    }
-    else if (object_span == 2)
-    {
-      left = objects[start];
-      right = objects[start + 1];
-    }
-    else
-    {
-      std::sort(std::begin(objects) + start, std::begin(objects) + end, comparator);
-
-      auto mid = start + object_span / 2;
-      left = make_shared<bvh_node>(objects, start, mid);
-      right = make_shared<bvh_node>(objects, mid, end);
-    }
-
-    bbox = aabb(left->bounding_box(), right->bounding_box());
+    bbox = aabb::empty;
+    for (const auto &box : bounds)
+      bbox = aabb(bbox, box);
   }
 
-  static bool box_compare(const shared_ptr<Shape> a, const shared_ptr<Shape> b, int axis_index)
+  bool hit(const ray &r, Interval ray_t, hit_record &rec) const override
   {
-    auto a_axis_interval = a->bounding_box().axis_interval(axis_index);
-    auto b_axis_interval = b->bounding_box().axis_interval(axis_index);
-    return a_axis_interval.min < b_axis_interval.min;
+    return find_hit<false>(r, ray_t, rec, nullptr);
   }
 
-  static bool box_x_compare(const shared_ptr<Shape> a, const shared_ptr<Shape> b) { return box_compare(a, b, 0); }
-
-  static bool box_y_compare(const shared_ptr<Shape> a, const shared_ptr<Shape> b) { return box_compare(a, b, 1); }
-
-  static bool box_z_compare(const shared_ptr<Shape> a, const shared_ptr<Shape> b) { return box_compare(a, b, 2); }
+  bool hit_counted(const ray &r, Interval ray_t, hit_record &rec, stats::Traversal_cost &cost) const override
+  {
+    return find_hit<true>(r, ray_t, rec, &cost);
+  }
 
-  bool hit(const ray &r, Interval ray_t, hit_record &rec) const override
+  // Packet traversal of the binary tree. Each stack entry carries the lanes still active in that
+  // subtree; a node is first tested against the whole packet's interval bounds, then per lane.
+  int hit8(RayPacket8 &packet, hit_record *records) const override
   {
-    if (!bbox.hit(r, ray_t))
-      return false;
+    const auto &nodes = bvh.node_array();
+    if (nodes.empty() || packet.active == 0)
+      return 0;
 
-    bool hit_left = left->hit(r, ray_t, rec);
-    bool hit_right = right->hit(r, Interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+    struct Entry
+    {
+      uint32_t node;
+      int active;
+    };
+
+    Packet_slabs slabs(packet);
+    const int packet_active = packet.active;
+    int lead = 0;  // Children are ordered by the direction of the first active ray
+    while (!(packet_active & (1 << lead)))
+      lead++;
+
+    Entry stack[128];
+    int stack_size = 0;
+    stack[stack_size++] = {0, packet_active};
+    int hits = 0;
+    uint64_t visited = 0;
+
+    while (stack_size > 0)
+    {
+      Entry entry = stack[--stack_size];
+      const Linear_bvh_node &node = nodes[entry.node];
+      visited++;
+      const double box_min[3] = {node.bounds_min[0], node.bounds_min[1], node.bounds_min[2]};
+      const double box_max[3] = {node.bounds_max[0], node.bounds_max[1], node.bounds_max[2]};
+
+      // The interval test only pays off while several rays are still together.
+      if (entry.active & (entry.active - 1))
+      {
+        double t_max_any = -infinity;
+        for (int lane = 0; lane < RayPacket8::size; lane++)
+          if (entry.active & (1 << lane))
+            t_max_any = std::max(t_max_any, packet.t_max[lane]);
+        if (!slabs.packet_may_hit(box_min, box_max, packet.t_min, t_max_any))
+          continue;
+      }
+
+      int active = slabs.hit_lanes(box_min, box_max, packet, entry.active);
+      if (active == 0)
+        continue;
+
+      if (node.is_leaf())
+      {
+        packet.active = active;
+        for (size_t i = node.offset; i < size_t(node.offset) + node.primitive_count; i++)
+          hits |= primitives[i]->hit8(packet, records);
+        packet.active = packet_active;
+      }
+      else if (packet.dir[node.axis][lead] < 0)
+      {
+        stack[stack_size++] = {entry.node + 1, active};
+        stack[stack_size++] = {node.offset, active};
+      }
+      else
+      {
+        stack[stack_size++] = {node.offset, active};
+        stack[stack_size++] = {entry.node + 1, active};
+      }
+    }
 
-    return hit_left || hit_right;
+    // Counted once per packet, not per lane.
+    stats::add(stats::bvh_nodes, visited);
+    stats::add(stats::box_tests, visited);
+    return hits;
   }
 
   aabb bounding_box() const override { return bbox; }
+
+private:
+  template <bool Counted>
+  bool find_hit(const ray &r, Interval ray_t, hit_record &rec, stats::Traversal_cost *cost) const
+  {
+    auto hit_leaf = [&](size_t first, size_t count, Interval &t)
+    {
+      bool hit_anything = false;
+      for (size_t i = first; i < first + count; i++)
+      {
+        bool hit;
+        if constexpr (Counted)
+          hit = primitives[i]->hit_counted(r, t, rec, *cost);
+        else
+          hit = primitives[i]->hit(r, t, rec);
+        if (hit)
+        {
+          hit_anything = true;
+          t.max = rec.t;
+        }
+      }
+      return hit_anything;
+    };
+
+    if (!wide.empty())
+      return wide.traverse<Counted>(r, ray_t, hit_leaf, cost);
+    return bvh.traverse<Counted>(r, ray_t, hit_leaf, cost);
+  }
 };
@@ -1,15 +1,50 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstddef>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <typeindex>
+#include <typeinfo>
+#include <vector>
 
 #include "./color.hpp"
+#include "./framebuffer.hpp"
+#include "./binary_io.hpp"
+#include "./image_io.hpp"
+#include "./environment.hpp"
+#include "./light.hpp"
+#include "./mapped_file.hpp"
 #include "./material.hpp"
 #include "./ray.hpp"
+#include "./sampler.hpp"
 #include "./shape.hpp"
+#include "./stats.hpp"
+#include "./thread_pool.hpp"
 #include "./utils.hpp"
 
 const double min_interval = 0.00001;
 
+enum class Integrator
+{
+  recursive,  // One path at a time, one recursive call per bounce
+  wavefront,  // Whole batches of paths advance one bounce at a time
+  iterative,  // One path at a time, carrying its throughput through a loop
+};
+
+// Debug render modes that draw what each pixel costs instead of the image, in false color.
+enum class Heatmap
+{
+  none,
+  bvh_cost,     // BVH nodes visited plus primitives tested by a primary ray
+  pixel_time,   // Wall-clock nanoseconds spent rendering the pixel
+  path_length,  // Rays traced per path
+};
+
 class Camera
 {
   int image_height;            // Rendered image height
@@ -34,49 +69,954 @@ public:
   double defocus_angle = 0;           // Variation angle of rays through each pixel
   double focus_dist = 10;             // Distance from camera lookfrom point to plane of perfect focus
 
-  void render(const Shape &world)
+  size_t thread_count = 0;   // Render threads, 0 uses one per hardware thread
+  int tile_size = 32;        // Edge length of the square tiles handed to threads
+  size_t frame = 0;          // Frame index, picks an independent set of random streams
+  bool use_packets = false;  // Trace the primary rays of a pixel in packets of 8
+  Sampler_type sampler = Sampler_type::sobol;  // Where each sample's random numbers come from
+
+  Integrator integrator = Integrator::recursive;
+  size_t wavefront_batch = size_t(1) << 16;  // Paths in flight per tile in wavefront mode
+  bool russian_roulette = true;              // Randomly end low-throughput paths (iterative only)
+  size_t roulette_min_depth = 3;             // Bounces every path gets before roulette applies
+  Heatmap heatmap = Heatmap::none;           // Render a cost heatmap instead of the image
+
+  // Next-event estimation: at every surface whose material has a pdf, one of `lights` is sampled
+  // and a shadow ray traced toward it, and that estimate is combined with the scattered ray's by
+  // multiple importance sampling. Set lights from Scene::lights.
+  const Light_list *lights = nullptr;
+  bool sample_lights = true;                // false leaves lights to be found by scattering alone
+  bool use_sky = true;                      // Escaping rays see the sky gradient...
+  color background_color = color(0, 0, 0);  // ...or, without the sky, this color
+  const Environment_light *environment = nullptr;  // ...unless this is set; add it to lights too
+
+  // Adaptive sampling: every pixel takes adaptive_min_samples, then keeps sampling in batches
+  // until the 95% confidence interval of its mean luminance is narrower than
+  // +/- adaptive_tolerance, or it reaches samples_per_pixel. Not used by the wavefront integrator.
+  bool adaptive_sampling = false;
+  size_t adaptive_min_samples = 16;
+  double adaptive_tolerance = 0.01;
+  std::string sample_count_file;  // If set, render() also writes the per-pixel sample counts here
+
+  // Progressive rendering: the image is built up in passes of pass_samples samples per pixel,
+  // summed into a floating-point accumulation buffer. It stops when samples_per_pixel is reached,
+  // when the next pass would overrun time_limit seconds, or when the mean 95% error of the
+  // pixels' luminance falls to noise_target. Given an output_file, the image so far replaces it
+  // every snapshot_passes passes and every snapshot_seconds seconds. Each sample is seeded as in
+  // a one-shot render, so a progressive render that runs to samples_per_pixel takes the same
+  // samples. With adaptive sampling, pixels that have met adaptive_tolerance sit out later passes.
+  bool progressive = false;
+  size_t pass_samples = 4;      // Samples per pixel added by each pass
+  size_t snapshot_passes = 0;   // 0 for no snapshots by pass count
+  double snapshot_seconds = 0;  // 0 for no snapshots by time
+  double time_limit = 0;        // 0 for no time limit
+  double noise_target = 0;      // 0 to ignore noise
+
+  // Checkpoints of a progressive render: its accumulation buffer, per-pixel sample counts and
+  // pass count go to checkpoint_file every checkpoint_passes passes, every checkpoint_seconds
+  // seconds, and when it stops. A render that finds the file already there resumes from it.
+  // Samples are seeded by (pixel, sample, frame), so the per-pixel sample counts are also the
+  // positions of the random streams, and a resumed render ends with the same image as one that
+  // never stopped. A checkpoint made for another scene or other sample settings is refused.
+  std::string checkpoint_file;
+  size_t checkpoint_passes = 0;   // 0 for no checkpoints by pass count
+  double checkpoint_seconds = 0;  // 0 for no checkpoints by time
+  uint64_t scene_hash = 0;        // Identifies the scene in checkpoints; set it from Scene::hash
+
+  // Where render() writes the image; the extension picks the format (.ppm, .png or .pfm). When
+  // empty, a binary PPM goes to standard output.
+  std::string output_file;
+
+  struct Tile
+  {
+    int x0, y0, x1, y1;
+
+    int width() const { return x1 - x0; }
+    size_t pixels() const { return size_t(x1 - x0) * (y1 - y0); }
+  };
+
+  // Renders and writes the image. Returns false if the image could not be written or a
+  // checkpoint could not be resumed.
+  bool render(const Shape &world)
+  {
+    Framebuffer image;
+    {
+      stats::Scoped_timer timer(stats::render);
+      if (progressive)
+      {
+        if (!render_progressive(world, image))
+          return false;
+      }
+      else
+      {
+        render(world, image);
+      }
+    }
+
+    return write_output(image);
+  }
+
+  // Writes a rendered image to output_file (or standard output), and the sample counts of the
+  // last local render to sample_count_file if set.
+  bool write_output(const Framebuffer &image) const
+  {
+    stats::Scoped_timer timer(stats::output);
+    bool ok = true;
+    if (output_file.empty())
+      write_ppm(image, std::cout);
+    else
+      ok = write_image(image, output_file);
+
+    if (!sample_count_file.empty() && !sample_counts.empty())
+      ok = write_image(sample_count_image(), sample_count_file) && ok;
+    return ok;
+  }
+
+  void render(const Shape &world, Framebuffer &image)
   {
+    if (heatmap != Heatmap::none)
+    {
+      render_heatmap(world, image);
+      return;
+    }
+
     initialize();
+    image = Framebuffer(image_width, image_height);
+    sample_counts.assign(size_t(image_width) * image_height, uint32_t(samples_per_pixel));
 
-    std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+    std::vector<Tile> tiles = make_tiles();
+    std::atomic<size_t> tiles_done{0};
+    std::mutex progress_mutex;
+    auto render_one = [&](size_t index)
+    {
+      const Tile &tile = tiles[index];
+      std::vector<color> pixels(tile.pixels());
+      std::vector<uint32_t> counts(tile.pixels());
+      render_tile(world, tile, pixels.data(), counts.data());
+      for (size_t local = 0; local < pixels.size(); local++)
+      {
+        int i = tile.x0 + int(local % tile.width());
+        int j = tile.y0 + int(local / tile.width());
+        image.at(i, j) = pixels[local];
+        sample_counts[size_t(j) * image_width + i] = counts[local];
+      }
 
+      auto done = ++tiles_done;
+      std::lock_guard<std::mutex> lock(progress_mutex);
+      std::clog << "\rTiles remaining: " << (tiles.size() - done) << ' ' << std::flush;
+    };
+
+    run_tiles(tiles.size(), render_one);
+    std::clog << "\rDone.                 \n";
+  }
+
+  // For distributed rendering: a coordinator hands out the tiles of tiles(), and workers with
+  // the same scene and settings render them with render_tile(). tiles() also sets the camera
+  // up, so call it before the others.
+  std::vector<Tile> tiles()
+  {
+    initialize();
+    return make_tiles();
+  }
+
+  int height() const { return image_height; }  // Valid after tiles() or render()
+
+  // Renders one tile exactly as render() would, leaving its pixels in `pixels` row by row.
+  // Safe to call from several threads at once.
+  void render_tile(const Shape &world, const Tile &tile, std::vector<color> &pixels) const
+  {
+    std::vector<uint32_t> counts(tile.pixels());
+    pixels.resize(tile.pixels());
+    render_tile(world, tile, pixels.data(), counts.data());
+  }
+
+  bool render_progressive(const Shape &world, Framebuffer &image)
+  {
+    using clock = std::chrono::steady_clock;
+    auto seconds_since = [](clock::time_point t) { return std::chrono::duration<double>(clock::now() - t).count(); };
+
+    initialize();
+    Accumulation_buffer accum(image_width, image_height);
+    std::vector<Tile> tiles = make_tiles();
+    const size_t per_pass = std::max<size_t>(1, pass_samples);
+
+    auto start = clock::now();
+    auto last_snapshot = start;
+    auto last_checkpoint = start;
+    Progress progress;
+    if (!checkpoint_file.empty() && !resume(accum, progress))
+      return false;
+    size_t &taken = progress.taken;
+    size_t &pass = progress.pass;
+    const char *reason = "sample budget reached";
+
+    while (taken < samples_per_pixel)
+    {
+      auto pass_start = clock::now();
+      size_t count = std::min(per_pass, samples_per_pixel - taken);
+      run_tiles(tiles.size(), [&](size_t index) { render_tile_pass(tiles[index], world, taken, count, accum); });
+      taken += count;
+      pass++;
+
+      double elapsed = progress.previous_seconds + seconds_since(start);
+      double noise = accum.noise();
+      std::clog << "\rPass " << pass << ": " << taken << " samples per pixel, noise " << noise << ", " << elapsed
+                << " s    " << std::flush;
+
+      if (taken >= samples_per_pixel)
+        break;
+      if (noise_target > 0 && noise <= noise_target)
+      {
+        reason = "noise target met";
+        break;
+      }
+      if (time_limit > 0 && elapsed + seconds_since(pass_start) > time_limit)
+      {
+        reason = "time limit reached";
+        break;
+      }
+
+      bool snapshot = (snapshot_passes > 0 && pass % snapshot_passes == 0) ||
+                      (snapshot_seconds > 0 && seconds_since(last_snapshot) >= snapshot_seconds);
+      if (snapshot && !output_file.empty())
+      {
+        replace_image(accum.resolve(), output_file);
+        last_snapshot = clock::now();
+      }
+
+      bool checkpoint = (checkpoint_passes > 0 && pass % checkpoint_passes == 0) ||
+                        (checkpoint_seconds > 0 && seconds_since(last_checkpoint) >= checkpoint_seconds);
+      if (checkpoint && !checkpoint_file.empty())
+      {
+        progress.seconds = progress.previous_seconds + seconds_since(start);
+        save_checkpoint(accum, progress);
+        last_checkpoint = clock::now();
+      }
+    }
+
+    std::clog << "\nDone after " << pass << " passes: " << reason << ".\n";
+    if (!checkpoint_file.empty())
+    {
+      progress.seconds = progress.previous_seconds + seconds_since(start);
+      save_checkpoint(accum, progress);
+    }
+    image = accum.resolve();
+    sample_counts = accum.sample_counts();
+    return true;
+  }
+
+  // Samples taken by each pixel in the last render, as a grey image scaled so that
+  // samples_per_pixel is white.
+  Framebuffer sample_count_image() const
+  {
+    Framebuffer counts(image_width, image_height);
+    double scale = 1.0 / std::max<size_t>(1, samples_per_pixel);
+    // Squared because the 8-bit writers apply gamma 2.
     for (int j = 0; j < image_height; j++)
     {
-      std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
       for (int i = 0; i < image_width; i++)
       {
-        auto pixel_center = pixel00_loc + (i * pixel_delta_u) + (j * pixel_delta_v);
-        auto ray_direction = pixel_center - center;
-        ray r(center, ray_direction);
+        double level = scale * sample_counts[size_t(j) * image_width + i];
+        counts.at(i, j) = color(level, level, level) * level;
+      }
+    }
+    return counts;
+  }
+
+  const std::vector<uint32_t> &pixel_sample_counts() const { return sample_counts; }
+
+  // Hash of every setting that changes which samples are taken or how they are summed. It leaves
+  // out samples_per_pixel, so a finished progressive render can be resumed with a larger budget,
+  // unless the sampler spreads its strata over that many samples.
+  uint64_t settings_hash() const
+  {
+    const double settings[] = {
+        double(image_width),        double(image_height),       aspect_ratio,
+        vfov,                       defocus_angle,              focus_dist,
+        lookfrom.x(),               lookfrom.y(),               lookfrom.z(),
+        lookat.x(),                 lookat.y(),                 lookat.z(),
+        vup.x(),                    vup.y(),                    vup.z(),
+        double(max_depth),          double(frame),              double(int(integrator)),
+        double(use_packets),        double(russian_roulette),   double(roulette_min_depth),
+        double(tile_size),          double(wavefront_batch),    double(adaptive_sampling),
+        double(adaptive_min_samples), adaptive_tolerance,       double(std::max<size_t>(1, pass_samples)),
+        double(sample_lights),      double(int(sampler)),       double(strata_samples()),
+    };
+    return hash_bytes(settings, sizeof(settings));
+  }
+
+private:
+  std::vector<uint32_t> sample_counts;  // Samples taken per pixel in the last render
+
+  // Samples per pixel the sampler lays its strata out for, or 0 if its points do not depend on it.
+  size_t strata_samples() const
+  {
+    bool fixed = sampler == Sampler_type::stratified || sampler == Sampler_type::halton;
+    return fixed ? std::max<size_t>(1, samples_per_pixel) : 0;
+  }
+
+  static constexpr uint32_t checkpoint_magic = 0x50435452;  // "RTCP"
+  static constexpr uint32_t checkpoint_version = 1;
+
+  // Where a progressive render is, besides its accumulation buffer.
+  struct Progress
+  {
+    size_t pass = 0;
+    size_t taken = 0;  // Samples per pixel after the last pass, for pixels still sampling
+    double previous_seconds = 0;  // Render time before this run, from the checkpoint
+    double seconds = 0;           // Render time at the checkpoint being written
+  };
+
+  // Layout: magic, version, scene hash, settings hash, progress, then the accumulation buffer.
+  void save_checkpoint(const Accumulation_buffer &accum, const Progress &progress) const
+  {
+    std::string temporary = checkpoint_file + ".tmp";
+    {
+      std::ofstream file(temporary, std::ios::binary);
+      Binary_writer out(file);
+      out.value(checkpoint_magic);
+      out.value(checkpoint_version);
+      out.value(scene_hash);
+      out.value(settings_hash());
+      out.value(uint64_t(progress.pass));
+      out.value(uint64_t(progress.taken));
+      out.value(progress.seconds);
+      accum.save(out);
+      if (!file || !out.good())
+      {
+        std::cerr << "ERROR: Could not write checkpoint '" << temporary << "'.\n";
+        std::remove(temporary.c_str());
+        return;
+      }
+    }
+    if (std::rename(temporary.c_str(), checkpoint_file.c_str()) != 0)
+      std::cerr << "ERROR: Could not replace checkpoint '" << checkpoint_file << "'.\n";
+  }
+
+  // Loads checkpoint_file if it exists. Returns false if it exists but cannot be used.
+  bool resume(Accumulation_buffer &accum, Progress &progress) const
+  {
+    Mapped_file file(checkpoint_file);
+    if (!file.good())
+      return true;
+
+    Binary_reader in(file.begin(), file.end());
+    uint32_t magic = 0, version = 0;
+    uint64_t scene = 0, settings = 0, pass = 0, taken = 0;
+    double seconds = 0;
+    in.value(magic);
+    in.value(version);
+    if (!in.good() || magic != checkpoint_magic || version != checkpoint_version)
+    {
+      std::cerr << "ERROR: '" << checkpoint_file << "' is not a checkpoint.\n";
+      return false;
+    }
+    in.value(scene);
+    in.value(settings);
+    if (scene != scene_hash || settings != settings_hash())
+    {
+      std::cerr << "ERROR: Checkpoint '" << checkpoint_file << "' was made for another scene or other settings"
+                << (strata_samples() ? " (samples per pixel too, with this sampler)" : "")
+                << "; delete it to start over.\n";
+      return false;
+    }
+    in.value(pass);
+    in.value(taken);
+    in.value(seconds);
+    if (!in.good() || !accum.load(in) || accum.width() != image_width || accum.height() != image_height)
+    {
+      std::cerr << "ERROR: Checkpoint '" << checkpoint_file << "' is damaged.\n";
+      return false;
+    }
+
+    progress.pass = size_t(pass);
+    progress.taken = size_t(taken);
+    progress.previous_seconds = seconds;
+    std::clog << "Resuming from '" << checkpoint_file << "' after pass " << pass << " (" << taken
+              << " samples per pixel).\n";
+    return true;
+  }
+
+  // Splits the image into tiles in scanline order. Each tile writes only its own pixels of the
+  // framebuffer, so tiles need no synchronization among themselves.
+  std::vector<Tile> make_tiles() const
+  {
+    std::vector<Tile> tiles;
+    int edge = std::max(1, tile_size);
+    for (int y = 0; y < image_height; y += edge)
+      for (int x = 0; x < image_width; x += edge)
+        tiles.push_back({x, y, std::min(x + edge, image_width), std::min(y + edge, image_height)});
+    return tiles;
+  }
+
+  template <typename Function>
+  void run_tiles(size_t count, Function &&render_tile) const
+  {
+    size_t threads = thread_count == 0 ? Thread_pool::default_thread_count() : thread_count;
+    if (threads <= 1)
+    {
+      for (size_t t = 0; t < count; t++)
+        render_tile(t);
+    }
+    else
+    {
+      Thread_pool pool(std::min(threads, count));
+      pool.parallel_for(count, render_tile);
+    }
+  }
+
+  // Renders a tile's pixels and their sample counts into tile-local arrays, row by row.
+  void render_tile(const Shape &world, const Tile &tile, color *pixels, uint32_t *counts) const
+  {
+    if (integrator == Integrator::wavefront)
+    {
+      std::vector<color> sums;
+      std::vector<double> luminance_squares;
+      render_tile_wavefront(tile, world, 0, samples_per_pixel, sums, luminance_squares);
+      for (size_t local = 0; local < sums.size(); local++)
+      {
+        pixels[local] = pixel_samples_scale * sums[local];
+        counts[local] = uint32_t(samples_per_pixel);
+      }
+      return;
+    }
+
+    size_t local = 0;
+    for (int j = tile.y0; j < tile.y1; j++)
+      for (int i = tile.x0; i < tile.x1; i++, local++)
+        pixels[local] = render_pixel(i, j, world, counts[local]);
+  }
 
-        color pixel_color(0, 0, 0);
-        for (int sample = 0; sample < (int)samples_per_pixel; sample++)
+  // One progressive pass over a tile: adds samples [first, first + count) of every pixel.
+  void render_tile_pass(const Tile &tile, const Shape &world, size_t first, size_t count, Accumulation_buffer &accum) const
+  {
+    if (integrator == Integrator::wavefront)
+    {
+      std::vector<color> sums;
+      std::vector<double> luminance_squares;
+      render_tile_wavefront(tile, world, first, count, sums, luminance_squares);
+      for (size_t local = 0; local < sums.size(); local++)
+        accum.add(tile.x0 + int(local % tile.width()), tile.y0 + int(local / tile.width()), sums[local],
+                  luminance_squares[local], uint32_t(count));
+      return;
+    }
+
+    color samples[RayPacket8::size];
+    for (int j = tile.y0; j < tile.y1; j++)
+    {
+      for (int i = tile.x0; i < tile.x1; i++)
+      {
+        if (adaptive_sampling && accum.samples(i, j) >= adaptive_min_samples && accum.error(i, j) <= adaptive_tolerance)
+          continue;
+
+        color sum(0, 0, 0);
+        double luminance_square = 0;
+        for (size_t k = 0; k < count; k += RayPacket8::size)
         {
-          ray r = get_aliasing_ray(i, j);
-          pixel_color += ray_color(r, max_depth, world);
+          size_t batch = std::min<size_t>(RayPacket8::size, count - k);
+          trace_samples(i, j, first + k, batch, world, samples);
+          for (size_t s = 0; s < batch; s++)
+          {
+            sum += samples[s];
+            luminance_square += luminance(samples[s]) * luminance(samples[s]);
+          }
         }
-        write_color(std::cout, pixel_samples_scale * pixel_color);
+        accum.add(i, j, sum, luminance_square, uint32_t(count));
       }
     }
+  }
 
-    std::clog << "\rDone.                 \n";
+  // Fills `image` with the chosen heatmap. Each pixel's value is averaged over samples_per_pixel
+  // samples, seeded as in a normal render, and colored on a scale from 0 (dark blue) to the 99th
+  // percentile of all pixels (red), so a few outliers don't flatten the rest. Pixel times come
+  // from the per-pixel integrators even when the wavefront one is selected.
+  void render_heatmap(const Shape &world, Framebuffer &image)
+  {
+    initialize();
+    image = Framebuffer(image_width, image_height);
+    sample_counts.clear();
+
+    std::vector<double> values(size_t(image_width) * image_height);
+    std::vector<Tile> tiles = make_tiles();
+    run_tiles(tiles.size(),
+              [&](size_t index)
+              {
+                const Tile &tile = tiles[index];
+                for (int j = tile.y0; j < tile.y1; j++)
+                  for (int i = tile.x0; i < tile.x1; i++)
+                    values[size_t(j) * image_width + i] = heatmap_value(i, j, world);
+              });
+
+    std::vector<double> sorted = values;
+    auto top = sorted.begin() + (sorted.size() - 1) * 99 / 100;
+    std::nth_element(sorted.begin(), top, sorted.end());
+    double scale = *top > 0 ? 1 / *top : 0;
+    for (int j = 0; j < image_height; j++)
+      for (int i = 0; i < image_width; i++)
+        image.at(i, j) = false_color(scale * values[size_t(j) * image_width + i]);
+
+    const char *unit = heatmap == Heatmap::bvh_cost     ? " nodes and primitives per primary ray"
+                       : heatmap == Heatmap::pixel_time ? " ns per pixel"
+                                                        : " rays per path";
+    std::clog << "Heatmap: red is " << *top << unit << ".\n";
   }
 
-private:
-  color ray_color(const ray &r, size_t depth, const Shape &world) const
+  double heatmap_value(int i, int j, const Shape &world) const
+  {
+    if (heatmap == Heatmap::pixel_time)
+    {
+      using clock = std::chrono::steady_clock;
+      auto start = clock::now();
+      uint32_t samples_taken;
+      render_pixel(i, j, world, samples_taken);
+      return std::chrono::duration<double, std::nano>(clock::now() - start).count();
+    }
+
+    size_t pixel = size_t(j) * image_width + i;
+    size_t samples = std::max<size_t>(1, samples_per_pixel);
+    double total = 0;
+    for (size_t s = 0; s < samples; s++)
+    {
+      start_sample(pixel, s);
+      ray r = get_aliasing_ray(i, j);
+      if (heatmap == Heatmap::bvh_cost)
+      {
+        stats::Traversal_cost cost;
+        hit_record rec;
+        world.hit_counted(r, Interval(min_interval, infinity), rec, cost);
+        total += double(cost.nodes + cost.primitives);
+      }
+      else
+      {
+        total += double(path_length(r, world));
+      }
+    }
+    return total / samples;
+  }
+
+  // Rays a path starting with r traces before it ends, by the rules of the chosen integrator.
+  size_t path_length(ray r, const Shape &world) const
+  {
+    color throughput(1, 1, 1);
+    for (size_t depth = 0; depth < max_depth; depth++)
+    {
+      hit_record rec;
+      ray scattered;
+      color attenuation;
+      thread_sampler.start_bounce(depth);
+      if (!world.hit(r, Interval(min_interval, infinity), rec) || !rec.mat->scatter(r, rec, attenuation, scattered))
+        return depth + 1;
+
+      throughput = throughput * attenuation;
+      if (!survives_roulette(throughput, depth + 1))
+        return depth + 1;
+      r = scattered;
+    }
+    return max_depth;
+  }
+
+  // State of one path in wavefront mode. The path's random stream travels with it, so it draws
+  // the same numbers as the recursive integrator would.
+  struct Wavefront_path
+  {
+    ray r;
+    color throughput;
+    color radiance;   // Gathered so far
+    double bsdf_pdf;  // As passed to ray_color
+    uint32_t pixel;   // Index within the tile
+    Sampler sampler;
+  };
+
+  // Traces samples [first, first + count) of every pixel in a tile by advancing batches of paths
+  // one bounce at a time: intersect every path, retire the misses, group the hits by material,
+  // scatter each group in bulk, and compact the survivors for the next bounce. Leaves each
+  // pixel's radiance sum and sum of squared sample luminance in `sums` and `luminance_squares`,
+  // indexed within the tile.
+  void render_tile_wavefront(const Tile &tile, const Shape &world, size_t first, size_t count, std::vector<color> &sums,
+                             std::vector<double> &luminance_squares) const
+  {
+    const int tile_width = tile.width();
+    const size_t tile_pixels = tile.pixels();
+    const size_t total_paths = tile_pixels * count;
+    const size_t batch = std::max<size_t>(1, wavefront_batch);
+
+    sums.assign(tile_pixels, color(0, 0, 0));
+    luminance_squares.assign(tile_pixels, 0);
+    std::vector<Wavefront_path> paths, survivors;
+    std::vector<hit_record> records;
+    std::vector<uint32_t> hits;
+
+    // A path's radiance is its sample's whole value once it ends.
+    auto retire = [&](const Wavefront_path &path)
+    {
+      sums[path.pixel] += path.radiance;
+      luminance_squares[path.pixel] += luminance(path.radiance) * luminance(path.radiance);
+    };
+
+    for (size_t begin = 0; begin < total_paths; begin += batch)
+    {
+      size_t end = std::min(total_paths, begin + batch);
+
+      // Camera rays, one per (pixel, sample).
+      paths.clear();
+      for (size_t index = begin; index < end; index++)
+      {
+        auto local = uint32_t(index / count);
+        auto sample = first + index % count;
+        int i = tile.x0 + int(local % tile_width);
+        int j = tile.y0 + int(local / tile_width);
+
+        start_sample(size_t(j) * image_width + i, sample);
+        ray r = get_aliasing_ray(i, j);
+        paths.push_back({r, color(1, 1, 1), color(0, 0, 0), 0, local, thread_sampler});
+      }
+
+      for (size_t depth = 0; depth < max_depth && !paths.empty(); depth++)
+      {
+        // Intersect the whole batch; misses pick up the sky and leave.
+        records.resize(paths.size());
+        hits.clear();
+        stats::add(stats::rays, paths.size());
+        for (size_t k = 0; k < paths.size(); k++)
+        {
+          if (world.hit(paths[k].r, Interval(min_interval, infinity), records[k]))
+            hits.push_back(uint32_t(k));
+          else
+          {
+            stats::path_ended(depth + 1);
+            paths[k].radiance += paths[k].throughput * escaped(paths[k].r, paths[k].bsdf_pdf);
+            retire(paths[k]);
+          }
+        }
+
+        // Group by material type, then by material, so each scatter loop runs one code path over
+        // one material's data.
+        std::sort(hits.begin(), hits.end(),
+                  [&](uint32_t a, uint32_t b)
+                  {
+                    const material *ma = records[a].mat;
+                    const material *mb = records[b].mat;
+                    std::type_index ta(typeid(*ma)), tb(typeid(*mb));
+                    return ta != tb ? ta < tb : ma < mb;
+                  });
+
+        survivors.clear();
+        for (auto k : hits)
+        {
+          Wavefront_path &path = paths[k];
+          const hit_record &rec = records[k];
+          thread_sampler = path.sampler;
+          thread_sampler.start_bounce(depth);
+          path.radiance += path.throughput * emitted(path.r, rec, path.bsdf_pdf);
+          bool lit = samples_lights(rec);
+          if (lit)
+            path.radiance += path.throughput * direct_light(path.r, rec, world);
+
+          ray scattered;
+          color attenuation;
+          if (!scatter(path.r, rec, attenuation, scattered))
+          {
+            stats::path_ended(depth + 1);
+            retire(path);
+            continue;
+          }
+
+          color throughput = path.throughput * attenuation;
+          double bsdf_pdf = lit ? rec.mat->pdf(path.r, rec, scattered.direction()) : 0;
+          if (survives_roulette(throughput, depth + 1))
+            survivors.push_back({scattered, throughput, path.radiance, bsdf_pdf, path.pixel, thread_sampler});
+          else
+          {
+            stats::path_ended(depth + 1);
+            retire(path);
+          }
+        }
+        std::swap(paths, survivors);
+      }
+      // Paths still alive here ran out of depth; as in ray_color, they gather nothing more.
+      stats::path_ended(max_depth, paths.size());
+      for (const auto &path : paths)
+        retire(path);
+    }
+  }
+
+  color render_pixel(int i, int j, const Shape &world, uint32_t &samples_taken) const
+  {
+    color pixel_color(0, 0, 0);
+    color samples[RayPacket8::size];
+
+    if (!adaptive_sampling)
+    {
+      for (size_t first = 0; first < samples_per_pixel; first += RayPacket8::size)
+      {
+        size_t count = std::min<size_t>(RayPacket8::size, samples_per_pixel - first);
+        trace_samples(i, j, first, count, world, samples);
+        for (size_t k = 0; k < count; k++)
+          pixel_color += samples[k];
+      }
+      samples_taken = uint32_t(samples_per_pixel);
+      return pixel_samples_scale * pixel_color;
+    }
+
+    // Welford's running mean and sum of squared deviations of the samples' luminance.
+    size_t max_samples = std::max<size_t>(1, samples_per_pixel);
+    size_t min_samples = std::min(max_samples, std::max<size_t>(2, adaptive_min_samples));
+    size_t n = 0;
+    double mean = 0;
+    double m2 = 0;
+
+    while (n < max_samples)
+    {
+      if (n >= min_samples)
+      {
+        double variance = m2 / (n - 1);
+        double half_width = 1.96 * std::sqrt(variance / n);
+        if (half_width <= adaptive_tolerance)
+          break;
+      }
+
+      size_t count = std::min<size_t>(RayPacket8::size, max_samples - n);
+      trace_samples(i, j, n, count, world, samples);
+      for (size_t k = 0; k < count; k++)
+      {
+        pixel_color += samples[k];
+        n++;
+        double x = luminance(samples[k]);
+        double delta = x - mean;
+        mean += delta / n;
+        m2 += delta * (x - mean);
+      }
+    }
+
+    samples_taken = uint32_t(n);
+    return pixel_color / double(n);
+  }
+
+  // Points the calling thread's sampler at sample s of a pixel.
+  void start_sample(size_t pixel, size_t s) const { seed_random(pixel, s, frame, sampler, samples_per_pixel); }
+
+  // Radiance of samples [first, first + count) of pixel (i, j), count at most 8.
+  void trace_samples(int i, int j, size_t first, size_t count, const Shape &world, color *out) const
+  {
+    size_t pixel = size_t(j) * image_width + i;
+
+    if (use_packets)
+    {
+      // Generate the camera rays of up to 8 samples, remembering each sample's sampler so
+      // its path continues exactly as it would have without packets.
+      RayPacket8 packet;
+      Sampler streams[RayPacket8::size];
+      hit_record records[RayPacket8::size];
+      int lanes = int(count);
+      for (int lane = 0; lane < lanes; lane++)
+      {
+        start_sample(pixel, first + lane);
+        packet.set(lane, get_aliasing_ray(i, j), Interval(min_interval, infinity));
+        streams[lane] = thread_sampler;
+      }
+
+      int hits = max_depth > 0 ? world.hit8(packet, records) : 0;
+      stats::add(stats::rays, max_depth > 0 ? lanes : 0);
+      for (int lane = 0; lane < lanes; lane++)
+      {
+        out[lane] = color(0, 0, 0);
+        if (max_depth == 0)
+        {
+          stats::path_ended(0);
+          continue;
+        }
+
+        thread_sampler = streams[lane];
+        ray r = packet.lane_ray(lane);
+        bool hit = hits & (1 << lane);
+        if (integrator == Integrator::iterative)
+          out[lane] = continue_path(r, hit, records[lane], world);
+        else
+          out[lane] = hit ? shade(r, records[lane], max_depth, world) : background(r);
+      }
+      return;
+    }
+
+    for (size_t k = 0; k < count; k++)
+    {
+      start_sample(pixel, first + k);
+      ray r = get_aliasing_ray(i, j);
+      out[k] = integrator == Integrator::iterative ? trace_path(r, world) : ray_color(r, max_depth, world);
+    }
+  }
+
+  color trace_path(const ray &r, const Shape &world) const
   {
-    if (depth <= 0)
-      return color(0, 0, 0);
     hit_record rec;
+    stats::add(stats::rays, max_depth > 0 ? 1 : 0);
+    bool hit = max_depth > 0 && world.hit(r, Interval(min_interval, infinity), rec);
+    return continue_path(r, hit, rec, world);
+  }
 
-    if (world.hit(r, Interval(min_interval, infinity), rec))
+  // Iterative form of ray_color, given the outcome of the first intersection. The product of the
+  // attenuations so far is carried forward instead of being applied on the way back up.
+  color continue_path(ray r, bool hit, hit_record rec, const Shape &world) const
+  {
+    color throughput(1, 1, 1);
+    color radiance(0, 0, 0);
+    double bsdf_pdf = 0;
+    for (size_t depth = 0; depth < max_depth; depth++)
     {
+      if (depth > 0)
+      {
+        stats::add(stats::rays);
+        hit = world.hit(r, Interval(min_interval, infinity), rec);
+      }
+      if (!hit)
+      {
+        stats::path_ended(depth + 1);
+        return radiance + throughput * escaped(r, bsdf_pdf);
+      }
+
+      thread_sampler.start_bounce(depth);
+      radiance += throughput * emitted(r, rec, bsdf_pdf);
+      bool lit = samples_lights(rec);
+      if (lit)
+        radiance += throughput * direct_light(r, rec, world);
+
       ray scattered;
       color attenuation;
-      if (rec.mat->scatter(r, rec, attenuation, scattered))
-        return attenuation * ray_color(scattered, depth - 1, world);
+      if (!scatter(r, rec, attenuation, scattered))
+      {
+        stats::path_ended(depth + 1);
+        return radiance;
+      }
+
+      bsdf_pdf = lit ? rec.mat->pdf(r, rec, scattered.direction()) : 0;
+      throughput = throughput * attenuation;
+      if (!survives_roulette(throughput, depth + 1))
+      {
+        stats::path_ended(depth + 1);
+        return radiance;
+      }
+      r = scattered;
+    }
+    stats::path_ended(max_depth);
+    return radiance;
+  }
+
+  // Russian roulette: past roulette_min_depth bounces a path continues with probability equal to
+  // its largest throughput component, and survivors are scaled up by the inverse of that
+  // probability. Dim paths end early, yet the expected value of every path is unchanged. Only
+  // the iterative integrator plays it, so the recursive and wavefront ones trace the same paths.
+  bool survives_roulette(color &throughput, size_t depth) const
+  {
+    if (integrator != Integrator::iterative || !russian_roulette || depth < roulette_min_depth)
+      return true;
+
+    double p = std::min(1.0, std::max({throughput.x(), throughput.y(), throughput.z()}));
+    if (p <= 0 || random_double() >= p)
+      return false;
+    throughput /= p;
+    return true;
+  }
+
+  // bsdf_pdf is the density with which the previous surface scattered r if that surface also
+  // sampled the lights, and 0 otherwise.
+  color ray_color(const ray &r, size_t depth, const Shape &world, double bsdf_pdf = 0) const
+  {
+    if (depth <= 0)
+    {
+      stats::path_ended(max_depth);
       return color(0, 0, 0);
     }
+    hit_record rec;
+
+    stats::add(stats::rays);
+    if (world.hit(r, Interval(min_interval, infinity), rec))
+      return shade(r, rec, depth, world, bsdf_pdf);
+
+    stats::path_ended(max_depth - depth + 1);
+    return escaped(r, bsdf_pdf);
+  }
+
+  // Radiance leaving a surface hit back along r.
+  color shade(const ray &r, const hit_record &rec, size_t depth, const Shape &world, double bsdf_pdf = 0) const
+  {
+    thread_sampler.start_bounce(max_depth - depth);
+    color radiance = emitted(r, rec, bsdf_pdf);
+    bool lit = samples_lights(rec);
+    if (lit)
+      radiance += direct_light(r, rec, world);
+
+    ray scattered;
+    color attenuation;
+    if (scatter(r, rec, attenuation, scattered))
+    {
+      double next_pdf = lit ? rec.mat->pdf(r, rec, scattered.direction()) : 0;
+      return radiance + attenuation * ray_color(scattered, depth - 1, world, next_pdf);
+    }
+    stats::path_ended(max_depth - depth + 1);
+    return radiance;
+  }
+
+  bool samples_lights(const hit_record &rec) const
+  {
+    return sample_lights && lights && !lights->empty() && rec.mat->has_pdf();
+  }
+
+  // Light the surface at rec itself sends back along r. Past a surface that sampled the lights
+  // (bsdf_pdf > 0), it is weighted against the chance that that light sample found this point;
+  // emitters that are not lights could only have been found by scattering.
+  color emitted(const ray &r, const hit_record &rec, double bsdf_pdf) const
+  {
+    color emission = rec.mat->emitted(r, rec);
+    if (bsdf_pdf > 0 && rec.light && (emission.x() > 0 || emission.y() > 0 || emission.z() > 0))
+      emission *= power_heuristic(bsdf_pdf, lights->pdf(rec.light, r.origin(), r.direction()));
+    return emission;
+  }
+
+  // Light reaching a ray that hit nothing, weighted as emitted() weights surfaces when the
+  // environment is one of the lights.
+  color escaped(const ray &r, double bsdf_pdf) const
+  {
+    color sky = background(r);
+    if (bsdf_pdf > 0 && environment)
+      sky *= power_heuristic(bsdf_pdf, lights->pdf(environment, r.origin(), r.direction()));
+    return sky;
+  }
+
+  // Next-event estimation: light reaching rec straight from a point picked on one of the lights,
+  // weighted against the chance that scattering would have found the same point.
+  color direct_light(const ray &r, const hit_record &rec, const Shape &world) const
+  {
+    Light_sample sample;
+    if (!lights->sample(rec.point, sample))
+      return color(0, 0, 0);
+    color f = rec.mat->eval(r, rec, sample.direction);
+    if (!(f.x() > 0 || f.y() > 0 || f.z() > 0))
+      return color(0, 0, 0);
+
+    // The light point sits at t = 1, or at infinity for a distant light; stop just short of it
+    // so it does not shadow itself.
+    hit_record blocker;
+    stats::add(stats::rays);
+    double reach = sample.distant ? infinity : 1 - 1e-4;
+    if (world.hit(ray(rec.point, sample.direction, r.time()), Interval(min_interval, reach), blocker))
+      return color(0, 0, 0);
+
+    double weight = power_heuristic(sample.pdf, rec.mat->pdf(r, rec, sample.direction));
+    return (weight / sample.pdf) * f * sample.radiance;
+  }
+
+  // Every integrator scatters through here, so the statistics see each call.
+  static bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered)
+  {
+    stats::scatter(*rec.mat);
+    return rec.mat->scatter(r_in, rec, attenuation, scattered);
+  }
+
+  color background(const ray &r) const
+  {
+    if (environment)
+      return environment->radiance(r.direction());
+    if (!use_sky)
+      return background_color;
 
     // Sky
     color base_white = color(1.0, 1.0, 1.0);
@@ -147,6 +1087,8 @@ private:
   vec3 sample_square() const
   {
     // Returns the vector to a random point in the [-.5,-.5]-[+.5,+.5] unit square.
-    return vec3(random_double() - 0.5, random_double() - 0.5, 0);
+    double x, y;
+    random_pair(x, y);
+    return vec3(x - 0.5, y - 0.5, 0);
   }
 };
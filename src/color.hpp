@@ -1,5 +1,7 @@
 #pragma once
+#include <algorithm>
 #include <iostream>
+#include <iterator>
 
 #include "./interval.hpp"
 #include "./vec3.hpp"
@@ -13,6 +15,22 @@ inline double linear_to_gamma(double linear_component)
   return 0;
 }
 
+// Relative luminance of a linear Rec. 709 color.
+inline double luminance(const color &c) { return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z(); }
+
+// Heatmap color for t in [0,1]: dark blue through cyan, green and yellow to red. Returned squared,
+// so it shows as listed after the gamma 2 of the 8-bit image writers.
+inline color false_color(double t)
+{
+  static const color stops[] = {color(0.05, 0.0, 0.35), color(0.0, 0.45, 1.0), color(0.1, 0.9, 0.4),
+                                color(1.0, 0.85, 0.0), color(0.9, 0.05, 0.0)};
+  const int last = int(std::size(stops)) - 1;
+  double x = std::clamp(t, 0.0, 1.0) * last;
+  int k = std::min(int(x), last - 1);
+  color c = stops[k] + (x - k) * (stops[k + 1] - stops[k]);
+  return c * c;
+}
+
 void write_color(std::ostream &out, const color &pixel_color)
 {
   auto r = pixel_color.x();
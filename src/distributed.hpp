@@ -0,0 +1,433 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./binary_io.hpp"
+#include "./camera.hpp"
+#include "./framebuffer.hpp"
+#include "./net.hpp"
+#include "./shape.hpp"
+#include "./thread_pool.hpp"
+
+// Rendering one frame across processes over TCP. A coordinator splits the frame into the
+// camera's tiles and hands them to workers, which have loaded the same scene and render each
+// tile exactly as a single process would. Tiles come back as double-precision pixels and are
+// placed by index, so the merged image is identical to a local render whichever worker rendered
+// which tile, and however often.
+//
+// Workers may join at any time. Each holds one tile per thread plus one, so it never waits for
+// its next tile. When a worker's connection drops, its unfinished tiles go back to the front of
+// the queue. Once the queue is empty, idle workers also get second copies of tiles still out
+// elsewhere, so a hung or slow machine cannot hold up the end of the frame; the first copy to
+// arrive is used.
+//
+// Every message is a header (type and payload size) and a payload written with Binary_writer.
+// Like the scene cache, the format assumes every process runs the same build.
+
+namespace distributed_detail
+{
+  enum class Message : uint32_t
+  {
+    hello = 1,  // Worker: thread count, scene hash
+    job,        // Coordinator: image width, samples per pixel, max depth, settings hash
+    tile,       // Coordinator: tile index
+    result,     // Worker: tile index, pixels
+    done,       // Coordinator: the frame is complete
+  };
+
+  struct Header
+  {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t size;
+  };
+
+  const uint64_t max_payload = uint64_t(1) << 30;
+
+  template <typename Write>
+  std::string encode(Write &&write)
+  {
+    std::ostringstream out;
+    Binary_writer writer(out);
+    write(writer);
+    return out.str();
+  }
+
+  inline bool send_message(const Socket &socket, Message type, const std::string &payload = std::string())
+  {
+    Header header{uint32_t(type), 0, payload.size()};
+    std::string frame(sizeof(header), '\0');
+    std::memcpy(&frame[0], &header, sizeof(header));
+    frame += payload;
+    return socket.send_all(frame.data(), frame.size());
+  }
+
+  // Takes the first complete message out of `inbox`. False if none has fully arrived; sets
+  // `bad` if the inbox does not start with a sane header.
+  inline bool pop_message(std::string &inbox, Message &type, std::string &payload, bool &bad)
+  {
+    Header header;
+    if (inbox.size() < sizeof(header))
+      return false;
+    std::memcpy(&header, inbox.data(), sizeof(header));
+    if (header.size > max_payload)
+    {
+      bad = true;
+      return false;
+    }
+    if (inbox.size() < sizeof(header) + header.size)
+      return false;
+    type = Message(header.type);
+    payload.assign(inbox, sizeof(header), size_t(header.size));
+    inbox.erase(0, sizeof(header) + size_t(header.size));
+    return true;
+  }
+
+  inline bool receive_message(const Socket &socket, Message &type, std::string &payload)
+  {
+    Header header;
+    if (!socket.receive_all(&header, sizeof(header)) || header.size > max_payload)
+      return false;
+    type = Message(header.type);
+    payload.resize(size_t(header.size));
+    return socket.receive_all(&payload[0], payload.size());
+  }
+}  // namespace distributed_detail
+
+class Render_coordinator
+{
+public:
+  Render_coordinator(Camera &cam, uint64_t scene_hash) : cam(cam), scene_hash(scene_hash) {}
+
+  // Serves the frame on `port` until every tile is back, then tells the workers to stop.
+  // Returns false if the port cannot be opened.
+  bool render(uint16_t port, Framebuffer &image)
+  {
+    Socket listener = Socket::listen(port);
+    if (!listener.valid())
+    {
+      std::cerr << "ERROR: Could not listen on port " << port << ".\n";
+      return false;
+    }
+
+    tiles = cam.tiles();
+    settings_hash = cam.settings_hash();
+    image = Framebuffer(cam.image_width, cam.height());
+    done.assign(tiles.size(), 0);
+    holders.assign(tiles.size(), 0);
+    queue.clear();
+    for (uint32_t t = 0; t < tiles.size(); t++)
+      queue.push_back(t);
+    remaining = tiles.size();
+
+    std::clog << "Waiting for workers on port " << port << ".\n";
+    std::vector<const Socket *> sockets;
+    std::vector<char> ready;
+    while (remaining > 0)
+    {
+      sockets.assign(1, &listener);
+      for (const auto &worker : workers)
+        sockets.push_back(&worker->socket);
+      if (!wait_readable(sockets, ready, 1000))
+      {
+        std::cerr << "ERROR: Waiting on the worker connections failed.\n";
+        return false;
+      }
+
+      // Workers first: the listener may append to the list.
+      for (size_t k = 1; k < ready.size(); k++)
+        if (ready[k])
+          service(*workers[k - 1], image);
+      if (ready[0])
+        accept(listener);
+
+      workers.erase(std::remove_if(workers.begin(), workers.end(), [](const auto &w) { return !w->socket.valid(); }),
+                    workers.end());
+      for (auto &worker : workers)
+        assign(*worker);
+
+      std::clog << "\rTiles remaining: " << remaining << ", workers: " << workers.size() << "    " << std::flush;
+    }
+
+    for (auto &worker : workers)
+      distributed_detail::send_message(worker->socket, distributed_detail::Message::done);
+    std::clog << "\rDone.                              \n";
+    return true;
+  }
+
+private:
+  using Message = distributed_detail::Message;
+
+  struct Worker
+  {
+    Socket socket;
+    std::string inbox;
+    std::vector<uint32_t> tiles;  // Handed out and not yet returned
+    size_t capacity = 0;          // Tiles it may hold; 0 until its hello arrives
+  };
+
+  Camera &cam;
+  uint64_t scene_hash;
+  uint64_t settings_hash = 0;
+  std::vector<Camera::Tile> tiles;
+  std::vector<char> done;
+  std::vector<uint32_t> holders;  // Workers currently holding each tile
+  std::deque<uint32_t> queue;     // Tiles nobody holds
+  size_t remaining = 0;
+  std::vector<std::unique_ptr<Worker>> workers;
+
+  void accept(const Socket &listener)
+  {
+    Socket socket = listener.accept();
+    if (!socket.valid())
+      return;
+    auto worker = std::make_unique<Worker>();
+    worker->socket = std::move(socket);
+    workers.push_back(std::move(worker));
+  }
+
+  void service(Worker &worker, Framebuffer &image)
+  {
+    bool open = worker.socket.read_available(worker.inbox);
+
+    Message type;
+    std::string payload;
+    bool bad = false;
+    while (worker.socket.valid() && distributed_detail::pop_message(worker.inbox, type, payload, bad))
+    {
+      Binary_reader in(payload.data(), payload.data() + payload.size());
+      if (type == Message::hello)
+        hello(worker, in);
+      else if (type == Message::result)
+        result(worker, in, image);
+      else
+        drop(worker, "sent an unexpected message");
+    }
+
+    if (bad)
+      drop(worker, "sent a malformed message");
+    else if (!open)
+      drop(worker, "disconnected");
+  }
+
+  void hello(Worker &worker, Binary_reader &in)
+  {
+    uint32_t threads = 0;
+    uint64_t hash = 0;
+    if (!in.value(threads) || !in.value(hash))
+      return drop(worker, "sent a malformed hello");
+    if (hash != scene_hash)
+      return drop(worker, "loaded a different scene");
+
+    std::string job = distributed_detail::encode(
+        [&](Binary_writer &out)
+        {
+          out.value(int32_t(cam.image_width));
+          out.value(uint64_t(cam.samples_per_pixel));
+          out.value(uint64_t(cam.max_depth));
+          out.value(settings_hash);
+        });
+    if (!distributed_detail::send_message(worker.socket, Message::job, job))
+      return drop(worker, "disconnected");
+    worker.capacity = std::max<uint32_t>(1, threads) + 1;
+  }
+
+  void result(Worker &worker, Binary_reader &in, Framebuffer &image)
+  {
+    uint32_t index = 0;
+    std::vector<color> pixels;
+    if (!in.value(index) || !in.array(pixels))
+      return drop(worker, "sent a malformed tile");
+    auto held = std::find(worker.tiles.begin(), worker.tiles.end(), index);
+    if (held == worker.tiles.end() || pixels.size() != tiles[index].pixels())
+      return drop(worker, "sent a tile it was not given");
+
+    worker.tiles.erase(held);
+    holders[index]--;
+    if (done[index])
+      return;
+
+    const Camera::Tile &tile = tiles[index];
+    for (size_t local = 0; local < pixels.size(); local++)
+      image.at(tile.x0 + int(local % tile.width()), tile.y0 + int(local / tile.width())) = pixels[local];
+    done[index] = 1;
+    remaining--;
+  }
+
+  // Closes the connection and puts the tiles only this worker held back in the queue.
+  void drop(Worker &worker, const char *why)
+  {
+    if (!worker.socket.valid())
+      return;
+    std::clog << "\nA worker " << why;
+    if (!worker.tiles.empty())
+      std::clog << "; the " << worker.tiles.size() << " tiles it held are back in play";
+    std::clog << ".\n";
+    for (auto index : worker.tiles)
+    {
+      holders[index]--;
+      if (!done[index] && holders[index] == 0)
+        queue.push_front(index);
+    }
+    worker.tiles.clear();
+    worker.socket.close();
+  }
+
+  void assign(Worker &worker)
+  {
+    while (worker.socket.valid() && worker.tiles.size() < worker.capacity)
+    {
+      uint32_t index;
+      if (!next_tile(worker, index))
+        return;
+
+      std::string payload = distributed_detail::encode([&](Binary_writer &out) { out.value(index); });
+      if (!distributed_detail::send_message(worker.socket, Message::tile, payload))
+        return drop(worker, "disconnected");
+      worker.tiles.push_back(index);
+      holders[index]++;
+    }
+  }
+
+  // A queued tile, or else a second copy of one that is out with exactly one other worker.
+  bool next_tile(const Worker &worker, uint32_t &index)
+  {
+    while (!queue.empty())
+    {
+      index = queue.front();
+      queue.pop_front();
+      if (!done[index] && holders[index] == 0)
+        return true;
+    }
+
+    for (uint32_t t = 0; t < tiles.size(); t++)
+    {
+      if (!done[t] && holders[t] == 1 && std::find(worker.tiles.begin(), worker.tiles.end(), t) == worker.tiles.end())
+      {
+        index = t;
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+// Connects to the coordinator at host:port and renders the tiles it hands out until it reports
+// the frame done. The connection is retried for a while, so workers can start before the
+// coordinator. The job's image width, samples per pixel and depth override the camera's; any
+// other difference in settings is an error.
+inline bool run_worker(const std::string &host, uint16_t port, Camera &cam, const Shape &world, uint64_t scene_hash)
+{
+  using distributed_detail::Message;
+  const int connect_attempts = 30;
+
+  Socket socket;
+  for (int attempt = 1; !socket.valid(); attempt++)
+  {
+    socket = Socket::connect(host, port);
+    if (socket.valid())
+      break;
+    if (attempt == connect_attempts)
+    {
+      std::cerr << "ERROR: Could not connect to " << host << ':' << port << ".\n";
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+  }
+
+  size_t threads = cam.thread_count == 0 ? Thread_pool::default_thread_count() : cam.thread_count;
+  std::string hello = distributed_detail::encode(
+      [&](Binary_writer &out)
+      {
+        out.value(uint32_t(threads));
+        out.value(scene_hash);
+      });
+  Message type;
+  std::string payload;
+  if (!distributed_detail::send_message(socket, Message::hello, hello) ||
+      !distributed_detail::receive_message(socket, type, payload) || type != Message::job)
+  {
+    std::cerr << "ERROR: The coordinator refused this worker; is it rendering the same scene?\n";
+    return false;
+  }
+
+  Binary_reader job(payload.data(), payload.data() + payload.size());
+  int32_t width = 0;
+  uint64_t spp = 0, depth = 0, settings = 0;
+  job.value(width);
+  job.value(spp);
+  job.value(depth);
+  job.value(settings);
+  cam.image_width = width;
+  cam.samples_per_pixel = size_t(spp);
+  cam.max_depth = size_t(depth);
+  std::vector<Camera::Tile> tiles = cam.tiles();
+  if (!job.good() || settings != cam.settings_hash())
+  {
+    std::cerr << "ERROR: This worker's camera settings differ from the coordinator's.\n";
+    return false;
+  }
+
+  std::clog << "Connected to " << host << ':' << port << "; rendering with " << threads << " threads.\n";
+  std::mutex send_mutex;
+  std::atomic<size_t> rendered{0};
+  std::atomic<bool> stop{false};  // Skip queued tiles once the frame is over or the link is gone
+  bool finished = false;
+  {
+    Thread_pool pool(threads);
+    while (distributed_detail::receive_message(socket, type, payload))
+    {
+      if (type == Message::done)
+      {
+        finished = true;
+        break;
+      }
+
+      Binary_reader in(payload.data(), payload.data() + payload.size());
+      uint32_t index = 0;
+      if (type != Message::tile || !in.value(index) || index >= tiles.size())
+        break;
+
+      pool.submit(
+          [&, index]
+          {
+            if (stop)
+              return;
+            std::vector<color> pixels;
+            cam.render_tile(world, tiles[index], pixels);
+            std::string result = distributed_detail::encode(
+                [&](Binary_writer &out)
+                {
+                  out.value(index);
+                  out.array(pixels);
+                });
+            std::lock_guard<std::mutex> lock(send_mutex);
+            if (distributed_detail::send_message(socket, Message::result, result))
+              rendered++;
+          });
+    }
+    stop = true;
+    socket.shutdown();  // Unblocks a result still being sent, so the pool can drain
+    pool.wait();
+  }
+
+  if (!finished)
+  {
+    std::cerr << "ERROR: Lost the connection to the coordinator.\n";
+    return false;
+  }
+  std::clog << "Frame done; rendered " << rendered << " tiles.\n";
+  return true;
+}
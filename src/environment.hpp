@@ -0,0 +1,200 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#include "./aabb.hpp"
+#include "./color.hpp"
+#include "./light.hpp"
+#include "./rtw_stb_image.hpp"
+#include "./sampler.hpp"
+#include "./utils.hpp"
+
+// A piecewise-constant density on [0, 1) with one step per value, and its inverse CDF.
+class Distribution_1d
+{
+  std::vector<double> values;
+  std::vector<double> cdf;  // cdf[k]: fraction of the integral below step k; cdf.back() is 1
+  double sum = 0;
+
+public:
+  Distribution_1d() {}
+
+  explicit Distribution_1d(std::vector<double> steps) : values(std::move(steps)), cdf(values.size() + 1)
+  {
+    for (size_t k = 0; k < values.size(); k++)
+      cdf[k + 1] = cdf[k] + values[k];
+    sum = cdf.back();
+    // An all-zero function is sampled uniformly.
+    for (size_t k = 1; k < cdf.size(); k++)
+      cdf[k] = sum > 0 ? cdf[k] / sum : double(k) / values.size();
+  }
+
+  size_t size() const { return values.size(); }
+
+  // Mean of the function over [0, 1).
+  double integral() const { return values.empty() ? 0 : sum / values.size(); }
+
+  // Maps a uniform u to a point in [0, 1), setting its density and step.
+  double sample(double u, double &pdf, size_t &step) const
+  {
+    step = size_t(std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+    step = std::min(std::max<size_t>(step, 1), values.size()) - 1;
+    double width = cdf[step + 1] - cdf[step];
+    double offset = width > 0 ? (u - cdf[step]) / width : 0;
+    pdf = density(step);
+    return std::min((step + offset) / values.size(), 1 - 1e-9);
+  }
+
+  double density(size_t step) const { return sum > 0 ? values[step] / integral() : 1; }
+};
+
+// A piecewise-constant density on the unit square: rows are picked by their integrals (the
+// marginal), then a column within the row (the conditional).
+class Distribution_2d
+{
+  std::vector<Distribution_1d> rows;
+  Distribution_1d marginal;
+
+public:
+  Distribution_2d() {}
+
+  // values[j * width + i] is the function in column i of row j.
+  Distribution_2d(const std::vector<double> &values, size_t width, size_t height)
+  {
+    std::vector<double> row_integrals(height);
+    rows.reserve(height);
+    for (size_t j = 0; j < height; j++)
+    {
+      rows.emplace_back(std::vector<double>(values.begin() + j * width, values.begin() + (j + 1) * width));
+      row_integrals[j] = rows.back().integral();
+    }
+    marginal = Distribution_1d(std::move(row_integrals));
+  }
+
+  // Maps two uniforms to a point (u, v) in the unit square and its density.
+  void sample(double a, double b, double &u, double &v, double &pdf) const
+  {
+    double row_pdf, column_pdf;
+    size_t row, column;
+    v = marginal.sample(b, row_pdf, row);
+    u = rows[row].sample(a, column_pdf, column);
+    pdf = row_pdf * column_pdf;
+  }
+
+  double pdf(double u, double v) const
+  {
+    size_t row = std::min(size_t(v * rows.size()), rows.size() - 1);
+    size_t column = std::min(size_t(u * rows[row].size()), rows[row].size() - 1);
+    return marginal.density(row) * rows[row].density(column);
+  }
+};
+
+// Light arriving from infinitely far away, given by an equirectangular image: u runs around +y
+// as in Sphere::get_sphere_uv, and the top row of the image is straight up. It is both the
+// background escaping rays see and a light that sample() picks directions from, in proportion to
+// luminance times the solid angle of each pixel (sin theta), so a small bright sun is found by
+// direct sampling instead of by chance. The distribution is built once, when the image loads.
+class Environment_light : public Light
+{
+  rtw_image image;
+  double scale;
+  double radius = 1;  // Of a sphere around the scene, to rate the power
+  Distribution_2d distribution;
+  double mean_luminance = 0;  // Over the sphere of directions
+
+public:
+  Environment_light(const char *filename, double scale = 1) : image(filename), scale(scale)
+  {
+    int width = image.width(), height = image.height();
+    if (width <= 0 || height <= 0)
+      return;
+
+    std::vector<double> values(size_t(width) * height);
+    double weights = 0;
+    for (int j = 0; j < height; j++)
+    {
+      double sin_theta = std::sin(pi * (j + 0.5) / height);
+      for (int i = 0; i < width; i++)
+      {
+        double value = luminance(pixel(i, j)) * sin_theta;
+        values[size_t(j) * width + i] = value;
+        mean_luminance += value;
+        weights += sin_theta;
+      }
+    }
+    mean_luminance /= weights;
+    distribution = Distribution_2d(values, size_t(width), size_t(height));
+  }
+
+  bool loaded() const { return image.width() > 0 && image.height() > 0; }
+
+  // The scene's bounds; power() counts the light falling on a sphere around them.
+  void fit(const aabb &bounds)
+  {
+    vec3 diagonal(bounds.x.size(), bounds.y.size(), bounds.z.size());
+    double half = 0.5 * diagonal.length();
+    radius = half > 0 && half < infinity ? half : 1;
+  }
+
+  // Radiance arriving along -direction.
+  color radiance(const vec3 &direction) const
+  {
+    double u, v;
+    to_square(unit_vector(direction), u, v);
+    int i = std::min(int(u * image.width()), image.width() - 1);
+    int j = std::min(int(v * image.height()), image.height() - 1);
+    return pixel(i, j);
+  }
+
+  bool sample(const point3 &, Light_sample &sample) const override
+  {
+    if (!loaded() || !(mean_luminance > 0))
+      return false;
+    double a, b, u, v, square_pdf;
+    random_pair(a, b);
+    distribution.sample(a, b, u, v, square_pdf);
+    double theta = pi * v, phi = 2 * pi * u - pi;
+    double sin_theta = std::sin(theta);
+    if (!(square_pdf > 0) || sin_theta <= 0)
+      return false;
+
+    sample.direction = vec3(sin_theta * std::cos(phi), std::cos(theta), -sin_theta * std::sin(phi));
+    sample.radiance = radiance(sample.direction);
+    sample.pdf = square_pdf / (2 * pi * pi * sin_theta);
+    sample.distant = true;
+    return true;
+  }
+
+  double pdf(const point3 &, const vec3 &direction) const override
+  {
+    if (!loaded() || !(mean_luminance > 0))
+      return 0;
+    double u, v;
+    vec3 unit = unit_vector(direction);
+    to_square(unit, u, v);
+    double sin_theta = std::sqrt(std::fmax(0, 1 - unit.y() * unit.y()));
+    return sin_theta > 0 ? distribution.pdf(u, v) / (2 * pi * pi * sin_theta) : 0;
+  }
+
+  double power() const override { return pi * 4 * pi * radius * radius * mean_luminance; }
+
+  bool distant() const override { return true; }
+
+private:
+  color pixel(int i, int j) const
+  {
+    const float *rgb = image.float_pixel_data(i, j);
+    return scale * color(rgb[0], rgb[1], rgb[2]);
+  }
+
+  static void to_square(const vec3 &unit, double &u, double &v)
+  {
+    u = (std::atan2(-unit.z(), unit.x()) + pi) / (2 * pi);
+    v = std::acos(std::clamp(unit.y(), -1.0, 1.0)) / pi;
+    u = std::min(std::max(u, 0.0), 1 - 1e-9);
+    v = std::min(std::max(v, 0.0), 1 - 1e-9);
+  }
+};
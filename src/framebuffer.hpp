@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "./binary_io.hpp"
+#include "./color.hpp"
+#include "./utils.hpp"
+
+// Linear (pre-gamma) pixel colors for a whole image, stored row by row from the top-left.
+class Framebuffer
+{
+  int image_width = 0;
+  int image_height = 0;
+  std::vector<color> pixels;
+
+public:
+  Framebuffer() {}
+
+  Framebuffer(int width, int height) : image_width(width), image_height(height), pixels(size_t(width) * height) {}
+
+  int width() const { return image_width; }
+  int height() const { return image_height; }
+
+  color &at(int i, int j) { return pixels[size_t(j) * image_width + i]; }
+  const color &at(int i, int j) const { return pixels[size_t(j) * image_width + i]; }
+};
+
+// Running per-pixel sums for progressive rendering: the radiance of every sample taken so far,
+// the sum of the squares of the samples' luminance and the sample count. Sums are kept in double
+// precision so that adding a few samples to thousands loses nothing.
+class Accumulation_buffer
+{
+  int image_width = 0;
+  int image_height = 0;
+  std::vector<color> sums;
+  std::vector<double> luminance_squares;
+  std::vector<uint32_t> counts;
+
+public:
+  Accumulation_buffer() {}
+
+  Accumulation_buffer(int width, int height)
+      : image_width(width), image_height(height), sums(size_t(width) * height, color(0, 0, 0)),
+        luminance_squares(size_t(width) * height, 0), counts(size_t(width) * height, 0)
+  {
+  }
+
+  int width() const { return image_width; }
+  int height() const { return image_height; }
+
+  // Adds `samples` samples whose radiance sums to `sum` and whose squared luminances sum to
+  // `luminance_square`.
+  void add(int i, int j, const color &sum, double luminance_square, uint32_t samples)
+  {
+    size_t index = size_t(j) * image_width + i;
+    sums[index] += sum;
+    luminance_squares[index] += luminance_square;
+    counts[index] += samples;
+  }
+
+  uint32_t samples(int i, int j) const { return counts[size_t(j) * image_width + i]; }
+  const std::vector<uint32_t> &sample_counts() const { return counts; }
+
+  // Half-width of the 95% confidence interval of the pixel's mean luminance, or infinity while
+  // it has fewer than two samples.
+  double error(int i, int j) const
+  {
+    size_t index = size_t(j) * image_width + i;
+    double n = counts[index];
+    if (n < 2)
+      return infinity;
+    double mean = luminance(sums[index]) / n;
+    double variance = std::max(0.0, (luminance_squares[index] - n * mean * mean) / (n - 1));
+    return 1.96 * std::sqrt(variance / n);
+  }
+
+  // Mean of error() over the image.
+  double noise() const
+  {
+    double total = 0;
+    for (int j = 0; j < image_height; j++)
+      for (int i = 0; i < image_width; i++)
+        total += error(i, j);
+    return total / std::max(1.0, double(image_width) * image_height);
+  }
+
+  void save(Binary_writer &out) const
+  {
+    out.value(int32_t(image_width));
+    out.value(int32_t(image_height));
+    out.array(sums);
+    out.array(luminance_squares);
+    out.array(counts);
+  }
+
+  // Reads what save() wrote. Returns false, leaving the buffer in an unspecified state, if the
+  // data is truncated or inconsistent.
+  bool load(Binary_reader &in)
+  {
+    int32_t width = 0, height = 0;
+    if (!in.value(width) || !in.value(height) || !in.array(sums) || !in.array(luminance_squares) || !in.array(counts))
+      return false;
+    image_width = width;
+    image_height = height;
+    size_t pixels = size_t(std::max(0, width)) * size_t(std::max(0, height));
+    return sums.size() == pixels && luminance_squares.size() == pixels && counts.size() == pixels;
+  }
+
+  // The current estimate of the image: each pixel's mean sample.
+  Framebuffer resolve() const
+  {
+    Framebuffer image(image_width, image_height);
+    for (int j = 0; j < image_height; j++)
+    {
+      for (int i = 0; i < image_width; i++)
+      {
+        size_t index = size_t(j) * image_width + i;
+        image.at(i, j) = counts[index] > 0 ? sums[index] / double(counts[index]) : color(0, 0, 0);
+      }
+    }
+    return image;
+  }
+};
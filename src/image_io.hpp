@@ -0,0 +1,486 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "./color.hpp"
+#include "./framebuffer.hpp"
+
+// Image output. Pixels are converted a whole row at a time into a byte (or float) buffer and the
+// buffer is written with one call, so no per-pixel formatting goes through iostreams.
+
+enum class Image_format
+{
+  ppm_ascii,  // P3, the original text format
+  ppm,        // P6, binary 8-bit RGB
+  png,        // 8-bit RGB, deflate-compressed
+  pfm,        // Portable float map: linear 32-bit float RGB, no gamma or clamping
+};
+
+// Picks the format from the file extension; unknown extensions get binary PPM.
+inline Image_format image_format_for(const std::string &path)
+{
+  auto ends_with = [&](const char *suffix)
+  {
+    size_t n = std::strlen(suffix);
+    if (path.size() < n)
+      return false;
+    for (size_t i = 0; i < n; i++)
+      if (std::tolower((unsigned char)path[path.size() - n + i]) != suffix[i])
+        return false;
+    return true;
+  };
+
+  if (ends_with(".png"))
+    return Image_format::png;
+  if (ends_with(".pfm"))
+    return Image_format::pfm;
+  return Image_format::ppm;
+}
+
+// Gamma-encodes and quantizes one row of linear colors to 8-bit RGB, exactly like write_color.
+inline void quantize_row(const color *pixels, int width, unsigned char *out)
+{
+  static const Interval intensity(0.000, 0.999);
+  for (int i = 0; i < width; i++)
+  {
+    for (int c = 0; c < 3; c++)
+      out[3 * i + c] = (unsigned char)(int(256 * intensity.clamp(linear_to_gamma(pixels[i][c]))));
+  }
+}
+
+namespace image_io_detail
+{
+
+inline uint32_t crc32(const unsigned char *data, size_t size, uint32_t crc = 0)
+{
+  static const auto table = []
+  {
+    std::array<uint32_t, 256> t;
+    for (uint32_t n = 0; n < 256; n++)
+    {
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++)
+        c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      t[n] = c;
+    }
+    return t;
+  }();
+
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++)
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+inline uint32_t adler32(const unsigned char *data, size_t size)
+{
+  uint32_t a = 1, b = 0;
+  for (size_t i = 0; i < size;)
+  {
+    size_t block = std::min<size_t>(size - i, 5552);  // Largest run that cannot overflow b
+    for (size_t end = i + block; i < end; i++)
+    {
+      a += data[i];
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return (b << 16) | a;
+}
+
+// LSB-first bit writer, as deflate requires.
+class Bit_writer
+{
+  std::vector<unsigned char> &out;
+  uint32_t buffer = 0;
+  int count = 0;
+
+public:
+  Bit_writer(std::vector<unsigned char> &out) : out(out) {}
+
+  void bits(uint32_t value, int n)
+  {
+    buffer |= value << count;
+    count += n;
+    while (count >= 8)
+    {
+      out.push_back((unsigned char)(buffer & 0xff));
+      buffer >>= 8;
+      count -= 8;
+    }
+  }
+
+  // Huffman codes are defined MSB-first, so they go out reversed.
+  void code(uint32_t value, int n)
+  {
+    uint32_t reversed = 0;
+    for (int i = 0; i < n; i++)
+      reversed |= ((value >> i) & 1) << (n - 1 - i);
+    bits(reversed, n);
+  }
+
+  void flush()
+  {
+    if (count > 0)
+      out.push_back((unsigned char)(buffer & 0xff));
+    buffer = 0;
+    count = 0;
+  }
+};
+
+// zlib stream holding one deflate block with the fixed Huffman codes. Matches are found with
+// hash chains over the 32 KiB window, which is most of what a PNG of a render needs.
+inline std::vector<unsigned char> zlib_compress(const std::vector<unsigned char> &data)
+{
+  static const int length_base[] = {3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+                                    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+  static const int length_extra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+  static const int distance_base[] = {1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,    97,    129,
+                                      193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+  static const int distance_extra[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+  const int window = 32768;
+  const int hash_size = 1 << 15;
+  const int max_chain = 32;
+  const int max_match = 258;
+
+  std::vector<unsigned char> out = {0x78, 0x5e};
+  Bit_writer bw(out);
+  bw.bits(1, 1);  // Final block
+  bw.bits(1, 2);  // Fixed Huffman codes
+
+  auto literal = [&](int symbol)
+  {
+    if (symbol < 144)
+      bw.code(0x30 + symbol, 8);
+    else if (symbol < 256)
+      bw.code(0x190 + symbol - 144, 9);
+    else if (symbol < 280)
+      bw.code(symbol - 256, 7);
+    else
+      bw.code(0xc0 + symbol - 280, 8);
+  };
+
+  std::vector<int> head(hash_size, -1);
+  std::vector<int> prev(window, -1);
+  auto hash = [&](size_t i) { return ((data[i] << 10) ^ (data[i + 1] << 5) ^ data[i + 2]) & (hash_size - 1); };
+
+  const size_t n = data.size();
+  size_t i = 0;
+  while (i < n)
+  {
+    int best_length = 0, best_distance = 0;
+    if (i + 3 <= n)
+    {
+      int h = hash(i);
+      int chain = 0;
+      for (int candidate = head[h]; candidate >= 0 && int(i) - candidate <= window && chain < max_chain;
+           candidate = prev[candidate % window], chain++)
+      {
+        int limit = int(std::min<size_t>(max_match, n - i));
+        int length = 0;
+        while (length < limit && data[candidate + length] == data[i + length])
+          length++;
+        if (length > best_length)
+        {
+          best_length = length;
+          best_distance = int(i) - candidate;
+          if (length == limit)
+            break;
+        }
+      }
+    }
+
+    size_t advance = 1;
+    if (best_length >= 3)
+    {
+      int code = 0;
+      while (code + 1 < 29 && length_base[code + 1] <= best_length)
+        code++;
+      literal(257 + code);
+      bw.bits(best_length - length_base[code], length_extra[code]);
+
+      int dcode = 0;
+      while (dcode + 1 < 30 && distance_base[dcode + 1] <= best_distance)
+        dcode++;
+      bw.code(dcode, 5);
+      bw.bits(best_distance - distance_base[dcode], distance_extra[dcode]);
+      advance = best_length;
+    }
+    else
+    {
+      literal(data[i]);
+    }
+
+    for (size_t k = 0; k < advance; k++, i++)
+    {
+      if (i + 3 <= n)
+      {
+        int h = hash(i);
+        prev[i % window] = head[h];
+        head[h] = int(i);
+      }
+    }
+  }
+
+  literal(256);  // End of block
+  bw.flush();
+
+  uint32_t checksum = adler32(data.data(), data.size());
+  for (int shift = 24; shift >= 0; shift -= 8)
+    out.push_back((unsigned char)(checksum >> shift));
+  return out;
+}
+
+inline void put_u32(std::vector<unsigned char> &out, uint32_t v)
+{
+  for (int shift = 24; shift >= 0; shift -= 8)
+    out.push_back((unsigned char)(v >> shift));
+}
+
+inline void png_chunk(std::ostream &out, const char *type, const std::vector<unsigned char> &payload)
+{
+  std::vector<unsigned char> chunk;
+  put_u32(chunk, uint32_t(payload.size()));
+  chunk.insert(chunk.end(), type, type + 4);
+  chunk.insert(chunk.end(), payload.begin(), payload.end());
+  put_u32(chunk, crc32(chunk.data() + 4, chunk.size() - 4));
+  out.write(reinterpret_cast<const char *>(chunk.data()), std::streamsize(chunk.size()));
+}
+
+inline int paeth(int a, int b, int c)
+{
+  int p = a + b - c;
+  int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+  if (pa <= pb && pa <= pc)
+    return a;
+  return pb <= pc ? b : c;
+}
+
+}  // namespace image_io_detail
+
+inline void write_ppm_ascii(const Framebuffer &image, std::ostream &out)
+{
+  int width = image.width();
+  std::vector<unsigned char> row(size_t(width) * 3);
+  std::string text;
+
+  out << "P3\n" << width << ' ' << image.height() << "\n255\n";
+  for (int j = 0; j < image.height(); j++)
+  {
+    quantize_row(&image.at(0, j), width, row.data());
+    text.clear();
+    for (int i = 0; i < width; i++)
+    {
+      text += std::to_string(row[3 * i]);
+      text += ' ';
+      text += std::to_string(row[3 * i + 1]);
+      text += ' ';
+      text += std::to_string(row[3 * i + 2]);
+      text += '\n';
+    }
+    out.write(text.data(), std::streamsize(text.size()));
+  }
+}
+
+inline void write_ppm(const Framebuffer &image, std::ostream &out)
+{
+  int width = image.width();
+  std::vector<unsigned char> row(size_t(width) * 3);
+
+  out << "P6\n" << width << ' ' << image.height() << "\n255\n";
+  for (int j = 0; j < image.height(); j++)
+  {
+    quantize_row(&image.at(0, j), width, row.data());
+    out.write(reinterpret_cast<const char *>(row.data()), std::streamsize(row.size()));
+  }
+}
+
+inline void write_png(const Framebuffer &image, std::ostream &out)
+{
+  using namespace image_io_detail;
+
+  const int width = image.width();
+  const size_t stride = size_t(width) * 3;
+  std::vector<unsigned char> previous(stride, 0), current(stride), filtered(stride + 1), best(stride + 1);
+  std::vector<unsigned char> raw;
+  raw.reserve((stride + 1) * image.height());
+
+  for (int j = 0; j < image.height(); j++)
+  {
+    quantize_row(&image.at(0, j), width, current.data());
+
+    // Try each PNG filter on the row and keep the one with the smallest sum of absolute
+    // residuals, the usual cheap proxy for how well the row will compress.
+    long best_score = -1;
+    for (int type = 0; type < 5; type++)
+    {
+      filtered[0] = (unsigned char)type;
+      long score = 0;
+      for (size_t k = 0; k < stride; k++)
+      {
+        int a = k >= 3 ? current[k - 3] : 0;
+        int b = previous[k];
+        int c = k >= 3 ? previous[k - 3] : 0;
+        int predictor = type == 0 ? 0 : type == 1 ? a : type == 2 ? b : type == 3 ? (a + b) / 2 : paeth(a, b, c);
+        auto residual = (unsigned char)(current[k] - predictor);
+        filtered[k + 1] = residual;
+        score += residual < 128 ? residual : 256 - residual;
+      }
+      if (best_score < 0 || score < best_score)
+      {
+        best_score = score;
+        best.swap(filtered);
+      }
+    }
+
+    raw.insert(raw.end(), best.begin(), best.end());
+    previous.swap(current);
+  }
+
+  static const unsigned char signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  out.write(reinterpret_cast<const char *>(signature), sizeof(signature));
+
+  std::vector<unsigned char> header;
+  put_u32(header, uint32_t(width));
+  put_u32(header, uint32_t(image.height()));
+  header.insert(header.end(), {8, 2, 0, 0, 0});  // 8 bits per channel, RGB, deflate, no interlace
+  png_chunk(out, "IHDR", header);
+  png_chunk(out, "IDAT", zlib_compress(raw));
+  png_chunk(out, "IEND", {});
+}
+
+// PFM stores rows bottom to top; a negative scale marks little-endian floats.
+inline void write_pfm(const Framebuffer &image, std::ostream &out)
+{
+  int width = image.width();
+  std::vector<float> row(size_t(width) * 3);
+  const uint16_t probe = 1;
+  bool little_endian = *reinterpret_cast<const unsigned char *>(&probe) == 1;
+
+  out << "PF\n" << width << ' ' << image.height() << '\n' << (little_endian ? "-1.0" : "1.0") << '\n';
+  for (int j = image.height() - 1; j >= 0; j--)
+  {
+    const color *pixels = &image.at(0, j);
+    for (int i = 0; i < width; i++)
+      for (int c = 0; c < 3; c++)
+        row[3 * i + c] = float(pixels[i][c]);
+    out.write(reinterpret_cast<const char *>(row.data()), std::streamsize(row.size() * sizeof(float)));
+  }
+}
+
+// Reads a PFM written by write_pfm (or any RGB PFM of either byte order). Returns false, after
+// an ERROR line, if the file cannot be read.
+inline bool read_pfm(const std::string &path, Framebuffer &image)
+{
+  std::ifstream in(path, std::ios::binary);
+  std::string magic;
+  int width = 0, height = 0;
+  double scale = 0;
+  if (!(in >> magic >> width >> height >> scale) || magic != "PF" || width <= 0 || height <= 0)
+  {
+    std::cerr << "ERROR: Could not read PFM image '" << path << "'.\n";
+    return false;
+  }
+  in.get();  // The single whitespace character before the data
+
+  const uint16_t probe = 1;
+  bool little_endian = *reinterpret_cast<const unsigned char *>(&probe) == 1;
+  bool swap = (scale < 0) != little_endian;
+
+  image = Framebuffer(width, height);
+  std::vector<float> row(size_t(width) * 3);
+  for (int j = height - 1; j >= 0; j--)
+  {
+    if (!in.read(reinterpret_cast<char *>(row.data()), std::streamsize(row.size() * sizeof(float))))
+    {
+      std::cerr << "ERROR: PFM image '" << path << "' is truncated.\n";
+      return false;
+    }
+    for (int i = 0; i < width; i++)
+    {
+      for (int c = 0; c < 3; c++)
+      {
+        float v = row[3 * i + c];
+        if (swap)
+        {
+          uint32_t bits;
+          std::memcpy(&bits, &v, 4);
+          bits = (bits >> 24) | ((bits >> 8) & 0xff00) | ((bits << 8) & 0xff0000) | (bits << 24);
+          std::memcpy(&v, &bits, 4);
+        }
+        image.at(i, j)[c] = v;
+      }
+    }
+  }
+  return true;
+}
+
+inline void write_image(const Framebuffer &image, std::ostream &out, Image_format format)
+{
+  switch (format)
+  {
+    case Image_format::ppm_ascii:
+      write_ppm_ascii(image, out);
+      break;
+    case Image_format::ppm:
+      write_ppm(image, out);
+      break;
+    case Image_format::png:
+      write_png(image, out);
+      break;
+    case Image_format::pfm:
+      write_pfm(image, out);
+      break;
+  }
+}
+
+// Writes the image to a file, choosing the format from the extension. Returns false if the file
+// could not be written.
+inline bool write_image(const Framebuffer &image, const std::string &path)
+{
+  std::ofstream out(path, std::ios::binary);
+  if (!out)
+  {
+    std::cerr << "ERROR: Could not open '" << path << "' for writing.\n";
+    return false;
+  }
+  write_image(image, out, image_format_for(path));
+  return bool(out);
+}
+
+// Like write_image, but writes to a temporary file first and renames it over `path`, so a viewer
+// watching the file never sees a half-written image.
+inline bool replace_image(const Framebuffer &image, const std::string &path)
+{
+  std::string temporary = path + ".tmp";
+  {
+    std::ofstream out(temporary, std::ios::binary);
+    if (!out)
+    {
+      std::cerr << "ERROR: Could not open '" << temporary << "' for writing.\n";
+      return false;
+    }
+    write_image(image, out, image_format_for(path));
+    if (!out)
+      return false;
+  }
+  if (std::rename(temporary.c_str(), path.c_str()) != 0)
+  {
+    std::cerr << "ERROR: Could not replace '" << path << "'.\n";
+    std::remove(temporary.c_str());
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "./aabb.hpp"
+#include "./interval.hpp"
+#include "./ray.hpp"
+#include "./shape.hpp"
+#include "./transform.hpp"
+
+// A placed copy of a shared prototype shape (a TriangleMesh, SphereSet, bvh_node, ...). Only the
+// world-to-object transform and a box are stored per copy, so thousands of instances cost one
+// prototype plus a matrix each.
+//
+// Instances form the top level of a two-level hierarchy: put them in a bvh_node, and each ray that
+// reaches an instance is moved into object space and continues down the prototype's own BVH.
+// The prototype must be fully built before an Instance is made from it.
+class Instance : public Shape
+{
+  const Shape *prototype;
+  Transform world_to_object;
+  aabb bbox;
+
+public:
+  Instance(const Shape *prototype, const Transform &object_to_world)
+      : prototype(prototype), world_to_object(object_to_world.inverse()), bbox(object_to_world.box(prototype->bounding_box()))
+  {
+  }
+
+  aabb bounding_box() const override { return bbox; }
+
+  bool hit(const ray &r, Interval ray_t, hit_record &rec) const override
+  {
+    // The direction is transformed but not renormalized, so distances along the ray are the same
+    // in both spaces and ray_t can be passed down unchanged.
+    ray local(world_to_object.point(r.origin()), world_to_object.vector(r.direction()), r.time());
+    if (!prototype->hit(local, ray_t, rec))
+      return false;
+    to_world(r, rec);
+    return true;
+  }
+
+  bool hit_counted(const ray &r, Interval ray_t, hit_record &rec, stats::Traversal_cost &cost) const override
+  {
+    ray local(world_to_object.point(r.origin()), world_to_object.vector(r.direction()), r.time());
+    if (!prototype->hit_counted(local, ray_t, rec, cost))
+      return false;
+    to_world(r, rec);
+    return true;
+  }
+
+private:
+  // Moves a hit found in object space back to the world.
+  void to_world(const ray &r, hit_record &rec) const
+  {
+    rec.point = r.at(rec.t);
+    // Normals go through the inverse transpose of object_to_world, i.e. the transpose of
+    // world_to_object. That keeps dot(normal, direction) signs, so sidedness is unchanged.
+    rec.normal = unit_vector(world_to_object.transpose_vector(rec.normal));
+  }
+};
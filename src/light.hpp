@@ -0,0 +1,240 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include <vector>
+
+#include "./color.hpp"
+#include "./material.hpp"
+#include "./quad.hpp"
+#include "./sampler.hpp"
+#include "./shape.hpp"
+#include "./sphere.hpp"
+#include "./utils.hpp"
+
+// Weight of a sample drawn with density `pdf` when `other_pdf` is the density of the other
+// strategy that could have drawn it (Veach's power heuristic with exponent 2).
+inline double power_heuristic(double pdf, double other_pdf)
+{
+  double a = pdf * pdf, b = other_pdf * other_pdf;
+  return a / (a + b);
+}
+
+// A point on a light, chosen for a shading point.
+struct Light_sample
+{
+  vec3 direction;        // From the shading point to the light point, which lies at t = 1
+  color radiance;        // Emitted from the light point toward the shading point
+  double pdf;            // Solid-angle density of picking `direction`
+  bool distant = false;  // The light is infinitely far along `direction` instead
+};
+
+// An emitting surface that can be sampled directly. The same surface is also placed in the world
+// as a Shape, so that rays scattered off other surfaces can find it too.
+class Light
+{
+public:
+  virtual ~Light() = default;
+
+  // Picks a point on the light as seen from `origin`. False if it sends no light there.
+  virtual bool sample(const point3 &origin, Light_sample &sample) const = 0;
+
+  // Solid-angle density with which sample() picks `direction` from `origin`; 0 where the
+  // direction misses the light or sample() would not pick it.
+  virtual double pdf(const point3 &origin, const vec3 &direction) const = 0;
+
+  // Emitted power, up to a factor shared by every light. Textured lights are rated by their
+  // emission at the middle of the texture.
+  virtual double power() const = 0;
+
+  // True for lights at infinity, which only rays that hit nothing reach.
+  virtual bool distant() const { return false; }
+
+protected:
+  static color emission(const material *mat, const ray &r, const point3 &p, const vec3 &outward_normal, double u, double v)
+  {
+    hit_record rec;
+    rec.point = p;
+    rec.u = u;
+    rec.v = v;
+    rec.mat = mat;
+    rec.light = nullptr;
+    rec.set_face_normal(r, outward_normal);
+    return mat->emitted(r, rec);
+  }
+};
+
+// A Quad with an emitting material, sampled uniformly by area.
+class Quad_light : public Light
+{
+  Quad quad;
+
+public:
+  Quad_light(const Quad &quad) : quad(quad) {}
+
+  bool sample(const point3 &origin, Light_sample &sample) const override
+  {
+    double a, b;
+    random_pair(a, b);
+    point3 p = quad.corner() + a * quad.edge_u() + b * quad.edge_v();
+    vec3 direction = p - origin;
+    double distance_squared = direction.length_squared();
+    double cosine = -dot(quad.front_normal(), direction) / std::sqrt(distance_squared);
+    if (cosine <= 0)
+      return false;  // Behind the emitting face
+
+    sample.direction = direction;
+    sample.radiance = emission(quad.surface(), ray(origin, direction), p, quad.front_normal(), a, b);
+    sample.pdf = distance_squared / (cosine * quad.area());
+    return true;
+  }
+
+  double pdf(const point3 &origin, const vec3 &direction) const override
+  {
+    hit_record rec;
+    if (!quad.hit(ray(origin, direction), Interval(0.001, infinity), rec) || !rec.is_front_facing)
+      return 0;
+    double distance_squared = rec.t * rec.t * direction.length_squared();
+    double cosine = std::fabs(dot(quad.front_normal(), direction)) / direction.length();
+    return distance_squared / (cosine * quad.area());
+  }
+
+  double power() const override
+  {
+    point3 middle = quad.corner() + 0.5 * (quad.edge_u() + quad.edge_v());
+    ray toward(middle + quad.front_normal(), -quad.front_normal());
+    return pi * quad.area() * luminance(emission(quad.surface(), toward, middle, quad.front_normal(), 0.5, 0.5));
+  }
+};
+
+// A stationary Sphere with an emitting material. Seen from outside, a sphere fills a cone of
+// directions; sampling that cone uniformly wastes no samples on its far side.
+class Sphere_light : public Light
+{
+  point3 center;
+  double radius;
+  const material *mat;
+
+public:
+  Sphere_light(const point3 &center, double radius, const material *mat) : center(center), radius(radius), mat(mat) {}
+
+  bool sample(const point3 &origin, Light_sample &sample) const override
+  {
+    double cone = cone_solid_angle(origin);
+    if (cone <= 0)
+      return false;
+
+    // A direction uniformly within the cone, about the axis toward the center.
+    vec3 axis = unit_vector(center - origin);
+    double cos_max = 1 - cone / (2 * pi);
+    double x, y;
+    random_pair(x, y);
+    double z = 1 + x * (cos_max - 1);
+    double phi = 2 * pi * y;
+    double r = std::sqrt(std::fmax(0, 1 - z * z));
+    vec3 a = std::fabs(axis.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+    vec3 side = unit_vector(cross(axis, a));
+    vec3 up = cross(axis, side);
+    vec3 unit = r * std::cos(phi) * side + r * std::sin(phi) * up + z * axis;
+
+    // Near intersection with the sphere; at the rim of the cone it grazes the surface.
+    vec3 oc = center - origin;
+    double h = dot(unit, oc);
+    double t = h - std::sqrt(std::fmax(0, h * h - (oc.length_squared() - radius * radius)));
+    point3 p = origin + t * unit;
+    vec3 outward = (p - center) / radius;
+    double u, v;
+    Sphere::get_sphere_uv(outward, u, v);
+
+    sample.direction = t * unit;
+    sample.radiance = emission(mat, ray(origin, sample.direction), p, outward, u, v);
+    sample.pdf = 1 / cone;
+    return true;
+  }
+
+  double pdf(const point3 &origin, const vec3 &direction) const override
+  {
+    double cone = cone_solid_angle(origin);
+    if (cone <= 0)
+      return 0;
+    // Does the ray pass within the sphere, in front of the origin?
+    vec3 oc = center - origin;
+    double h = dot(direction, oc);
+    double discriminant = h * h - direction.length_squared() * (oc.length_squared() - radius * radius);
+    return h > 0 && discriminant >= 0 ? 1 / cone : 0;
+  }
+
+  double power() const override
+  {
+    vec3 outward(0, 0, 1);
+    ray toward(center + 2 * radius * outward, -outward);
+    return pi * 4 * pi * radius * radius * luminance(emission(mat, toward, center + radius * outward, outward, 0.5, 0.5));
+  }
+
+private:
+  // Solid angle of the sphere seen from `origin`, 0 from inside.
+  double cone_solid_angle(const point3 &origin) const
+  {
+    double distance_squared = (center - origin).length_squared();
+    double ratio = radius * radius / distance_squared;
+    if (ratio >= 1)
+      return 0;
+    // 1 - cos_max without cancellation for small, distant spheres.
+    double cos_max = std::sqrt(1 - ratio);
+    return 2 * pi * ratio / (1 + cos_max);
+  }
+};
+
+// The lights of a scene. One is picked per shading point, with probability proportional to its
+// power, so dim lights cost few samples.
+class Light_list
+{
+  std::vector<const Light *> lights;
+  std::vector<double> cumulative;  // cumulative[k]: power of lights 0..k
+  std::unordered_map<const Light *, size_t> index;
+
+public:
+  // Lights that emit nothing are left out.
+  void add(const Light *light)
+  {
+    double power = light->power();
+    if (!(power > 0))
+      return;
+    index.emplace(light, lights.size());
+    lights.push_back(light);
+    cumulative.push_back((cumulative.empty() ? 0 : cumulative.back()) + power);
+  }
+
+  bool empty() const { return lights.empty(); }
+  size_t size() const { return lights.size(); }
+
+  // Picks a light, then a point on it. The returned pdf includes the chance of picking the light.
+  bool sample(const point3 &origin, Light_sample &sample) const
+  {
+    if (lights.empty())
+      return false;
+    double target = random_double() * cumulative.back();
+    size_t k = size_t(std::upper_bound(cumulative.begin(), cumulative.end(), target) - cumulative.begin());
+    k = std::min(k, lights.size() - 1);
+    if (!lights[k]->sample(origin, sample))
+      return false;
+    sample.pdf *= probability(k);
+    return true;
+  }
+
+  // Density with which sample() picks `direction` from `origin` on `light`, the light that a ray
+  // in that direction reaches first; 0 for a light not in the list.
+  double pdf(const Light *light, const point3 &origin, const vec3 &direction) const
+  {
+    auto found = index.find(light);
+    return found != index.end() ? probability(found->second) * light->pdf(origin, direction) : 0;
+  }
+
+private:
+  double probability(size_t k) const
+  {
+    double below = k > 0 ? cumulative[k - 1] : 0;
+    return (cumulative[k] - below) / cumulative.back();
+  }
+};
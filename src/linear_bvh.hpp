@@ -0,0 +1,506 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "./aabb.hpp"
+#include "./arena.hpp"
+#include "./binary_io.hpp"
+#include "./interval.hpp"
+#include "./ray.hpp"
+#include "./stats.hpp"
+#include "./thread_pool.hpp"
+
+// One node of a flattened BVH. Nodes are stored depth-first, so the first child of an interior
+// node always sits right after it and only the second child needs an explicit offset. Bounds are
+// floats rounded outwards, which keeps the node at 32 bytes: two nodes per cache line.
+struct Linear_bvh_node
+{
+  float bounds_min[3];
+  float bounds_max[3];
+  uint32_t offset;           // Leaf: first primitive. Interior: index of the second child
+  uint16_t primitive_count;  // Zero for interior nodes
+  uint8_t axis;              // Split axis, used to order traversal by ray direction
+  uint8_t pad;
+
+  bool is_leaf() const { return primitive_count > 0; }
+};
+
+static_assert(sizeof(Linear_bvh_node) == 32, "Linear_bvh_node should fill half a cache line");
+
+enum class Bvh_split
+{
+  median,  // Halve the primitives along the longest axis
+  sah,     // Binned surface area heuristic
+};
+
+struct Bvh_build_options
+{
+  Bvh_split split = Bvh_split::sah;
+  int max_leaf_primitives = 4;       // Leaf-size cutoff; larger nodes are always split
+  int sah_bins = 16;                 // Bins per axis; split planes are the bin boundaries
+  double traversal_cost = 0.125;     // Cost of visiting a node, relative to one primitive test
+  size_t parallel_threshold = 4096;  // Subtrees with more primitives are built as separate tasks
+  size_t thread_count = 0;           // Build threads, 0 uses one per hardware thread
+  int width = 0;                     // Children per node: 2 (binary), 4 or 8 (SIMD); 0 picks by CPU
+};
+
+// A ray with its per-axis inverse direction and direction signs, computed once per traversal
+// instead of once per box.
+struct Ray_slabs
+{
+  double orig[3];
+  double inv_dir[3];
+  int dir_is_negative[3];
+
+  Ray_slabs(const ray &r)
+  {
+    for (int axis = 0; axis < 3; axis++)
+    {
+      orig[axis] = r.origin()[axis];
+      inv_dir[axis] = 1.0 / r.direction()[axis];
+      dir_is_negative[axis] = inv_dir[axis] < 0;
+    }
+  }
+};
+
+// Bounding volume hierarchy over an abstract set of primitives, given only by their boxes. The
+// owner builds it, reorders its primitives by primitive_order(), and from then on every leaf
+// refers to the contiguous range [offset, offset + primitive_count) of that packed array.
+class Linear_bvh
+{
+public:
+  Linear_bvh() {}
+
+  Linear_bvh(const std::vector<aabb> &primitive_bounds, const Bvh_build_options &options = Bvh_build_options())
+  {
+    build(primitive_bounds, options);
+  }
+
+  void build(const std::vector<aabb> &primitive_bounds, const Bvh_build_options &options = Bvh_build_options())
+  {
+    nodes.clear();
+    order.resize(primitive_bounds.size());
+    for (size_t i = 0; i < order.size(); i++)
+      order[i] = uint32_t(i);
+    if (order.empty())
+      return;
+
+    stats::Scoped_timer timer(stats::bvh_build);
+    Builder builder(primitive_bounds, order, options);
+    const Build_node &root = builder.build();
+
+    nodes.reserve(builder.node_count);
+    flatten(root);
+  }
+
+  // primitive_order()[k] is the original index of the primitive that belongs in packed slot k.
+  const std::vector<uint32_t> &primitive_order() const { return order; }
+
+  const std::vector<Linear_bvh_node> &node_array() const { return nodes; }
+
+  // Cache support: the flattened nodes and the primitive order, as built.
+  void save(Binary_writer &out) const
+  {
+    out.array(nodes);
+    out.array(order);
+  }
+
+  // Reads what save() wrote for `primitive_count` primitives. Returns false unless every index
+  // in it is in range and the tree fits the traversal stack, so a corrupt cache cannot send a
+  // traversal out of bounds.
+  bool load(Binary_reader &in, size_t primitive_count)
+  {
+    if (!in.array(nodes) || !in.array(order) || order.size() != primitive_count)
+      return false;
+    for (uint32_t index : order)
+      if (index >= primitive_count)
+        return false;
+    if (nodes.empty())
+      return primitive_count == 0;
+
+    // Children always follow their parent, so one pass in order sees every parent first.
+    std::vector<uint8_t> depth(nodes.size(), 0);
+    for (size_t k = 0; k < nodes.size(); k++)
+    {
+      const Linear_bvh_node &node = nodes[k];
+      if (node.is_leaf())
+      {
+        if (size_t(node.offset) + node.primitive_count > primitive_count)
+          return false;
+        continue;
+      }
+      if (node.axis > 2 || node.offset <= k + 1 || node.offset >= nodes.size() || depth[k] >= max_depth)
+        return false;
+      depth[k + 1] = std::max<uint8_t>(depth[k + 1], depth[k] + 1);
+      depth[node.offset] = std::max<uint8_t>(depth[node.offset], depth[k] + 1);
+    }
+    return true;
+  }
+
+  aabb bounds() const
+  {
+    if (nodes.empty())
+      return aabb::empty;
+    const auto &root = nodes[0];
+    return aabb(point3(root.bounds_min[0], root.bounds_min[1], root.bounds_min[2]),
+                point3(root.bounds_max[0], root.bounds_max[1], root.bounds_max[2]));
+  }
+
+  // Walks the hierarchy front to back with an explicit stack. hit_leaf(first, count, ray_t) must
+  // test the packed primitives [first, first + count), shrink ray_t.max to the closest hit it
+  // finds, and return whether it found one. The Counted instantiation also adds the nodes it
+  // visits to cost->nodes.
+  template <bool Counted = false, typename Leaf_hit>
+  bool traverse(const ray &r, Interval ray_t, Leaf_hit &&hit_leaf, stats::Traversal_cost *cost = nullptr) const
+  {
+    if (nodes.empty())
+      return false;
+
+    Ray_slabs slabs(r);
+    uint32_t stack[max_depth];
+    int stack_size = 0;
+    uint32_t current = 0;
+    bool hit_anything = false;
+    uint64_t visited = 0;
+
+    while (true)
+    {
+      const Linear_bvh_node &node = nodes[current];
+      visited++;
+      if (hit_node(node, slabs, ray_t))
+      {
+        if (node.is_leaf())
+        {
+          if (hit_leaf(node.offset, node.primitive_count, ray_t))
+            hit_anything = true;
+        }
+        else
+        {
+          // Visit the child nearer along the split axis first, so hits there cut off the other.
+          if (slabs.dir_is_negative[node.axis])
+          {
+            stack[stack_size++] = current + 1;
+            current = node.offset;
+          }
+          else
+          {
+            stack[stack_size++] = node.offset;
+            current = current + 1;
+          }
+          continue;
+        }
+      }
+
+      if (stack_size == 0)
+        break;
+      current = stack[--stack_size];
+    }
+
+    stats::add(stats::bvh_nodes, visited);
+    stats::add(stats::box_tests, visited);
+    if constexpr (Counted)
+      cost->nodes += visited;
+    return hit_anything;
+  }
+
+  static bool hit_node(const Linear_bvh_node &node, const Ray_slabs &slabs, const Interval &ray_t)
+  {
+    double t_min = ray_t.min;
+    double t_max = ray_t.max;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+      // With a negative direction the ray enters through the max plane and leaves through the min.
+      double near_plane = slabs.dir_is_negative[axis] ? node.bounds_max[axis] : node.bounds_min[axis];
+      double far_plane = slabs.dir_is_negative[axis] ? node.bounds_min[axis] : node.bounds_max[axis];
+
+      double t0 = (near_plane - slabs.orig[axis]) * slabs.inv_dir[axis];
+      double t1 = (far_plane - slabs.orig[axis]) * slabs.inv_dir[axis];
+
+      if (t0 > t_min)
+        t_min = t0;
+      if (t1 < t_max)
+        t_max = t1;
+    }
+
+    return t_min <= t_max;
+  }
+
+private:
+  static const int max_depth = 128;  // Size of the traversal stack, which holds one entry per level
+
+  struct Build_node
+  {
+    aabb bbox;
+    Build_node *children[2] = {nullptr, nullptr};
+    uint32_t first = 0;
+    uint32_t count = 0;  // Zero for interior nodes
+    int axis = 0;
+  };
+
+  // Builds the tree top-down, partitioning `order` in place. Sibling subtrees cover disjoint
+  // ranges of `order`, so big ones can be handed to the thread pool and built concurrently.
+  class Builder
+  {
+    const std::vector<aabb> &bounds;
+    std::vector<uint32_t> &order;
+    Bvh_build_options options;
+    std::vector<point3> centroids;
+    std::unique_ptr<Thread_pool> pool;
+    Arena node_arena{1 << 20};  // Build nodes are only needed until the tree is flattened
+    std::mutex arena_mutex;
+
+  public:
+    std::atomic<size_t> node_count{0};
+
+    Builder(const std::vector<aabb> &bounds, std::vector<uint32_t> &order, const Bvh_build_options &options)
+        : bounds(bounds), order(order), options(options)
+    {
+      this->options.max_leaf_primitives = std::max(1, std::min(options.max_leaf_primitives, 0xffff));
+      this->options.sah_bins = std::max(2, std::min(options.sah_bins, max_bins));
+
+      centroids.reserve(bounds.size());
+      for (const auto &box : bounds)
+        centroids.push_back(box.centroid());
+    }
+
+    // The returned tree lives in this builder's arena.
+    const Build_node &build()
+    {
+      Build_node *root = new_node();
+      size_t threads = options.thread_count == 0 ? Thread_pool::default_thread_count() : options.thread_count;
+      if (threads > 1 && order.size() > options.parallel_threshold)
+        pool = std::make_unique<Thread_pool>(threads);
+
+      build_recursive(*root, 0, order.size(), 0);
+      if (pool)
+        pool->wait();
+      return *root;
+    }
+
+  private:
+    static const int max_bins = 32;
+    static const int sah_depth_limit = 64;  // Past this depth use median splits, which bound the depth
+
+    struct Bin
+    {
+      aabb bbox = aabb::empty;
+      size_t count = 0;
+    };
+
+    void build_recursive(Build_node &node, size_t start, size_t end, int depth)
+    {
+      node_count++;
+
+      aabb bbox = aabb::empty;
+      aabb centroid_bounds = aabb::empty;
+      for (size_t i = start; i < end; i++)
+      {
+        bbox = aabb(bbox, bounds[order[i]]);
+        centroid_bounds = aabb(centroid_bounds, aabb(centroids[order[i]], centroids[order[i]]));
+      }
+      node.bbox = bbox;
+
+      size_t span = end - start;
+      if (span == 1)
+        return make_leaf(node, start, span);
+
+      size_t mid = 0;
+      int axis = 0;
+      bool split = false;
+      if (options.split == Bvh_split::sah && depth < sah_depth_limit)
+      {
+        bool make_leaf_instead = false;
+        split = split_sah(bbox, centroid_bounds, start, end, mid, axis, make_leaf_instead);
+        if (make_leaf_instead)
+          return make_leaf(node, start, span);
+      }
+      else if (span <= size_t(options.max_leaf_primitives))
+      {
+        return make_leaf(node, start, span);
+      }
+
+      if (!split)
+        split_median(bbox, start, end, mid, axis);
+
+      node.axis = axis;
+      node.children[0] = new_node();
+      node.children[1] = new_node();
+      build_child(*node.children[0], start, mid, depth + 1);
+      build_child(*node.children[1], mid, end, depth + 1);
+    }
+
+    void build_child(Build_node &child, size_t start, size_t end, int depth)
+    {
+      if (pool && end - start > options.parallel_threshold)
+        pool->submit([this, &child, start, end, depth] { build_recursive(child, start, end, depth); });
+      else
+        build_recursive(child, start, end, depth);
+    }
+
+    Build_node *new_node()
+    {
+      if (!pool)
+        return node_arena.make<Build_node>();
+      std::lock_guard<std::mutex> lock(arena_mutex);
+      return node_arena.make<Build_node>();
+    }
+
+    static void make_leaf(Build_node &node, size_t start, size_t span)
+    {
+      node.first = uint32_t(start);
+      node.count = uint32_t(span);
+    }
+
+    // Halves the range along the longest axis, ordered by the boxes' minimum on that axis.
+    void split_median(const aabb &bbox, size_t start, size_t end, size_t &mid, int &axis)
+    {
+      axis = bbox.longest_axis();
+      mid = start + (end - start) / 2;
+      std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end, [&](uint32_t a, uint32_t b)
+                       { return bounds[a].axis_interval(axis).min < bounds[b].axis_interval(axis).min; });
+    }
+
+    // Bins primitive centroids on every axis and picks the bin boundary with the lowest expected
+    // cost. Returns false when no useful plane exists (all centroids coincide), and sets
+    // make_leaf_instead when testing every primitive is cheaper than any split.
+    bool split_sah(const aabb &bbox, const aabb &centroid_bounds, size_t start, size_t end, size_t &mid, int &axis,
+                   bool &make_leaf_instead)
+    {
+      const int bin_count = options.sah_bins;
+      const size_t span = end - start;
+      const double parent_area = bbox.surface_area();
+
+      double best_cost = infinity;
+      int best_axis = -1;
+      int best_boundary = 0;
+
+      for (int a = 0; a < 3; a++)
+      {
+        const Interval &extent = centroid_bounds.axis_interval(a);
+        if (!(extent.size() > 0))
+          continue;
+
+        Bin bins[max_bins];
+        double scale = bin_count / extent.size();
+        for (size_t i = start; i < end; i++)
+        {
+          auto &bin = bins[bin_index(centroids[order[i]][a], extent.min, scale, bin_count)];
+          bin.bbox = aabb(bin.bbox, bounds[order[i]]);
+          bin.count++;
+        }
+
+        // Sweep from the right to get the box and count of everything past each boundary.
+        double right_area[max_bins];
+        size_t right_count[max_bins];
+        aabb right_box = aabb::empty;
+        size_t count = 0;
+        for (int b = bin_count - 1; b > 0; b--)
+        {
+          right_box = aabb(right_box, bins[b].bbox);
+          count += bins[b].count;
+          right_area[b] = right_box.surface_area();
+          right_count[b] = count;
+        }
+
+        aabb left_box = aabb::empty;
+        size_t left_count = 0;
+        for (int b = 1; b < bin_count; b++)
+        {
+          left_box = aabb(left_box, bins[b - 1].bbox);
+          left_count += bins[b - 1].count;
+          if (left_count == 0 || right_count[b] == 0)
+            continue;
+
+          double cost = left_box.surface_area() * left_count + right_area[b] * right_count[b];
+          if (cost < best_cost)
+          {
+            best_cost = cost;
+            best_axis = a;
+            best_boundary = b;
+          }
+        }
+      }
+
+      if (best_axis < 0)
+      {
+        make_leaf_instead = span <= size_t(options.max_leaf_primitives);
+        return false;
+      }
+
+      // Costs are in units of one primitive test.
+      double split_cost = options.traversal_cost + (parent_area > 0 ? best_cost / parent_area : double(span));
+      if (span <= size_t(options.max_leaf_primitives) && double(span) <= split_cost)
+      {
+        make_leaf_instead = true;
+        return false;
+      }
+
+      axis = best_axis;
+      const Interval &extent = centroid_bounds.axis_interval(axis);
+      double scale = bin_count / extent.size();
+      auto boundary = std::partition(order.begin() + start, order.begin() + end, [&](uint32_t i)
+                                     { return bin_index(centroids[i][axis], extent.min, scale, bin_count) < best_boundary; });
+      mid = size_t(boundary - order.begin());
+      return mid != start && mid != end;
+    }
+
+    static int bin_index(double x, double min, double scale, int bin_count)
+    {
+      int b = int((x - min) * scale);
+      return b < 0 ? 0 : (b >= bin_count ? bin_count - 1 : b);
+    }
+  };
+
+  std::vector<Linear_bvh_node> nodes;
+  std::vector<uint32_t> order;
+
+  uint32_t flatten(const Build_node &source)
+  {
+    uint32_t index = uint32_t(nodes.size());
+    nodes.push_back(Linear_bvh_node());
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+      const Interval &extent = source.bbox.axis_interval(axis);
+      nodes[index].bounds_min[axis] = round_down(extent.min);
+      nodes[index].bounds_max[axis] = round_up(extent.max);
+    }
+
+    if (source.count > 0)
+    {
+      nodes[index].offset = source.first;
+      nodes[index].primitive_count = uint16_t(source.count);
+      nodes[index].axis = 0;
+    }
+    else
+    {
+      flatten(*source.children[0]);
+      uint32_t second = flatten(*source.children[1]);
+      nodes[index].offset = second;
+      nodes[index].primitive_count = 0;
+      nodes[index].axis = uint8_t(source.axis);
+    }
+    nodes[index].pad = 0;
+    return index;
+  }
+
+  // Float conversions that never shrink a box.
+  static float round_down(double x)
+  {
+    float f = float(x);
+    return double(f) > x ? std::nextafter(f, -INFINITY) : f;
+  }
+
+  static float round_up(double x)
+  {
+    float f = float(x);
+    return double(f) < x ? std::nextafter(f, INFINITY) : f;
+  }
+};
@@ -1,138 +1,300 @@
-#include "./bvh_node.hpp"
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
 #include "./camera.hpp"
-#include "./material.hpp"
-#include "./sphere.hpp"
-#include "./texture.hpp"
-#include "./utils.hpp"
-#include "./vec3.hpp"
-#include "./world.hpp"
+#include "./distributed.hpp"
+#include "./scene.hpp"
+#include "./scene_file.hpp"
+#include "./stats.hpp"
 
-void bouncing_spheres()
+static void usage()
 {
-  hittable_list world;
-  auto checker = make_shared<Checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
-  world.add(make_shared<Sphere>(point3(0, -1000, 0), 1000, make_shared<Lambertian>(checker)));
-
-  for (int a = -11; a < 11; a++)
-  {
-    for (int b = -11; b < 11; b++)
-    {
-      auto choose_mat = random_double();
-      point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
-      if ((center - point3(4, 0.2, 0)).length() > 0.9)
-      {
-        shared_ptr<material> Sphere_material;
-        if (choose_mat < 0.8)
-        {
-          // diffuse
-          auto albedo = color::random() * color::random();
-          Sphere_material = make_shared<Lambertian>(albedo);
-          auto center2 = center + vec3(0, random_double(0, .5), 0);
-          world.add(make_shared<Sphere>(center, center2, 0.2, Sphere_material));
-        }
-        else if (choose_mat < 0.95)
-        {
-          // metal
-          auto albedo = color::random(0.5, 1);
-          auto fuzz = random_double(0, 0.5);
-          Sphere_material = make_shared<metal>(albedo, fuzz);
-          world.add(make_shared<Sphere>(center, 0.2, Sphere_material));
-        }
-        else
-        {
-          // glass
-          Sphere_material = make_shared<dielectric>(1.5);
-          world.add(make_shared<Sphere>(center, 0.2, Sphere_material));
-        }
-      }
-    }
-  }
-
-  auto material1 = make_shared<dielectric>(1.5);
-  world.add(make_shared<Sphere>(point3(0, 1, 0), 1.0, material1));
-  auto material2 = make_shared<Lambertian>(color(0.4, 0.2, 0.1));
-  world.add(make_shared<Sphere>(point3(-4, 1, 0), 1.0, material2));
-  auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-  world.add(make_shared<Sphere>(point3(4, 1, 0), 1.0, material3));
-
-  world = hittable_list(make_shared<bvh_node>(world));
-
-  Camera cam;
-  cam.aspect_ratio = 16.0 / 9.0;
-  cam.image_width = 1200;
-  cam.samples_per_pixel = 100;
-  cam.max_depth = 150;
-  cam.vfov = 20;
-  cam.lookfrom = point3(13, 10, 3);
-  cam.lookat = point3(0, 0, 0);
-  cam.vup = vec3(0, 1, 0);
-  cam.defocus_angle = 0.6;
-  cam.focus_dist = 13.0;
-  cam.render(world);
+  std::cerr << "Usage: raytracer [scene] [options]\n"
+               "  scene             scene description file (default: scenes/perlin_spheres.scene)\n"
+               "  --width N         image width in pixels\n"
+               "  --spp N           samples per pixel\n"
+               "  --depth N         maximum ray bounces\n"
+               "  --threads N       render threads, 0 uses one per hardware thread\n"
+               "  --output FILE     write the image to FILE (.ppm, .png, .pfm) instead of stdout\n"
+               "  --no-cache        ignore and do not write the scene's binary cache\n"
+               "  --bvh-split NAME  BVH split rule: sah (default) or median; median skips the cache\n"
+               "  --no-light-sampling   find lights only by scattering, as with no explicit lights\n"
+               "  --integrator NAME recursive (default), iterative or wavefront\n"
+               "  --roulette-min-depth N  bounces before Russian roulette may end a path (iterative,\n"
+               "                    default 3)\n"
+               "  --no-roulette     trace every iterative path to --depth\n"
+               "  --sampler TYPE    random numbers per sample: sobol (default), halton, stratified or\n"
+               "                    independent\n"
+               "  --adaptive TOL    stop sampling a pixel once the 95% error of its luminance is\n"
+               "                    within +/- TOL (--spp stays the most it takes)\n"
+               "  --adaptive-min N  samples every pixel takes before it may stop (default 16)\n"
+               "  --sample-counts FILE  also write each pixel's sample count as a grayscale image\n"
+               "  --heatmap MODE    draw a false-color cost image instead: bvh-cost (nodes and\n"
+               "                    primitives per primary ray), pixel-time or path-length\n"
+               "  --stats FILE      also write the statistics report to FILE as JSON (builds with STATS=1)\n"
+               "\n"
+               "Progressive rendering (stops at --spp, or earlier on a time or noise limit):\n"
+               "  --progressive N   render in passes of N samples per pixel\n"
+               "  --snapshot-passes K   rewrite --output every K passes\n"
+               "  --snapshot-seconds T  rewrite --output every T seconds\n"
+               "  --time-limit T    stop before a pass would end past T seconds\n"
+               "  --noise-target X  stop once the mean 95% error of pixel luminance is at most X\n"
+               "  --checkpoint FILE save progress to FILE when stopping, and resume from it if it exists\n"
+               "  --checkpoint-passes K    also save it every K passes\n"
+               "  --checkpoint-seconds T   also save it every T seconds\n"
+               "\n"
+               "Distributed rendering (every process loads the same scene):\n"
+               "  --serve PORT      coordinate: hand out tiles to workers and write the image\n"
+               "  --worker HOST:PORT    render tiles for the coordinator at HOST:PORT\n";
 }
 
-void wood()
+static bool parse_count(const char *text, long &value)
 {
-  auto earth_texture = make_shared<Image_texture>("nebular.jpg");
-  auto earth_surface = make_shared<Lambertian>(earth_texture);
-  auto globe = make_shared<Sphere>(point3(0, 0, 0), 2, earth_surface);
-
-  Camera cam;
-
-  cam.aspect_ratio = 16.0 / 9.0;
-  cam.image_width = 400;
-  cam.samples_per_pixel = 100;
-  cam.max_depth = 50;
-
-  cam.vfov = 20;
-  cam.lookfrom = point3(0, 0, 12);
-  cam.lookat = point3(0, 0, 0);
-  cam.vup = vec3(0, 1, 0);
-
-  cam.defocus_angle = 0;
+  const char *end = text + std::strlen(text);
+  auto result = std::from_chars(text, end, value);
+  return result.ec == std::errc() && result.ptr == end && value >= 0;
+}
 
-  cam.render(hittable_list(globe));
+static bool parse_number(const char *text, double &value)
+{
+  const char *end = text + std::strlen(text);
+  auto result = std::from_chars(text, end, value);
+  return result.ec == std::errc() && result.ptr == end && value >= 0;
 }
 
-void perlin_spheres()
+int main(int argc, char **argv)
 {
-  hittable_list world;
+  std::string scene_path = "scenes/perlin_spheres.scene";
+  bool use_cache = true, sample_lights = true, roulette = true;
+  long width = -1, spp = -1, depth = -1, threads = -1;
+  long pass_samples = -1, snapshot_passes = 0, checkpoint_passes = 0, adaptive_min = -1;
+  long roulette_min_depth = -1;
+  double snapshot_seconds = 0, time_limit = 0, noise_target = 0, checkpoint_seconds = 0, adaptive = -1;
+  std::string output, checkpoint, worker, stats_file, heatmap, sampler = "sobol", bvh_split = "sah";
+  std::string integrator = "recursive";
+  std::string sample_counts;
+  long serve_port = -1;
 
-  auto pertext = make_shared<Noise_texture>();
-  world.add(make_shared<Sphere>(point3(0, -1000, 0), 1000, make_shared<Lambertian>(pertext)));
-  world.add(make_shared<Sphere>(point3(0, 2, 0), 2, make_shared<Lambertian>(pertext)));
+  for (int k = 1; k < argc; k++)
+  {
+    std::string arg = argv[k];
+    long *count = arg == "--width"                ? &width
+                  : arg == "--spp"                ? &spp
+                  : arg == "--depth"              ? &depth
+                  : arg == "--threads"            ? &threads
+                  : arg == "--progressive"        ? &pass_samples
+                  : arg == "--snapshot-passes"    ? &snapshot_passes
+                  : arg == "--checkpoint-passes"  ? &checkpoint_passes
+                  : arg == "--serve"              ? &serve_port
+                  : arg == "--adaptive-min"       ? &adaptive_min
+                  : arg == "--roulette-min-depth" ? &roulette_min_depth
+                                                  : nullptr;
+    double *number = arg == "--snapshot-seconds"     ? &snapshot_seconds
+                     : arg == "--time-limit"         ? &time_limit
+                     : arg == "--noise-target"       ? &noise_target
+                     : arg == "--checkpoint-seconds" ? &checkpoint_seconds
+                     : arg == "--adaptive"           ? &adaptive
+                                                     : nullptr;
+    if (count || number)
+    {
+      if (k + 1 >= argc || !(count ? parse_count(argv[++k], *count) : parse_number(argv[++k], *number)))
+      {
+        std::cerr << "ERROR: " << arg << " needs a non-negative number.\n";
+        usage();
+        return 1;
+      }
+    }
+    else if (arg == "--output" && k + 1 < argc)
+      output = argv[++k];
+    else if (arg == "--checkpoint" && k + 1 < argc)
+      checkpoint = argv[++k];
+    else if (arg == "--worker" && k + 1 < argc)
+      worker = argv[++k];
+    else if (arg == "--heatmap" && k + 1 < argc)
+      heatmap = argv[++k];
+    else if (arg == "--stats" && k + 1 < argc)
+      stats_file = argv[++k];
+    else if (arg == "--sample-counts" && k + 1 < argc)
+      sample_counts = argv[++k];
+    else if (arg == "--sampler" && k + 1 < argc)
+      sampler = argv[++k];
+    else if (arg == "--integrator" && k + 1 < argc)
+      integrator = argv[++k];
+    else if (arg == "--bvh-split" && k + 1 < argc)
+      bvh_split = argv[++k];
+    else if (arg == "--no-cache")
+      use_cache = false;
+    else if (arg == "--no-light-sampling")
+      sample_lights = false;
+    else if (arg == "--no-roulette")
+      roulette = false;
+    else if (arg == "--help" || arg == "-h")
+    {
+      usage();
+      return 0;
+    }
+    else if (!arg.empty() && arg[0] != '-')
+      scene_path = arg;
+    else
+    {
+      std::cerr << "ERROR: Unknown option '" << arg << "'.\n";
+      usage();
+      return 1;
+    }
+  }
 
+  long worker_port = -1;
+  std::string worker_host;
+  if (!worker.empty())
+  {
+    auto colon = worker.rfind(':');
+    if (colon == std::string::npos || !parse_count(worker.c_str() + colon + 1, worker_port) || worker_port > 65535)
+    {
+      std::cerr << "ERROR: --worker needs HOST:PORT.\n";
+      return 1;
+    }
+    worker_host = worker.substr(0, colon);
+  }
+  Heatmap heatmap_mode = heatmap.empty()           ? Heatmap::none
+                         : heatmap == "bvh-cost"    ? Heatmap::bvh_cost
+                         : heatmap == "pixel-time"  ? Heatmap::pixel_time
+                         : heatmap == "path-length" ? Heatmap::path_length
+                                                    : Heatmap::none;
+  if (!heatmap.empty() && heatmap_mode == Heatmap::none)
+  {
+    std::cerr << "ERROR: Unknown heatmap '" << heatmap << "'.\n";
+    usage();
+    return 1;
+  }
+  Sampler_type sampler_type = sampler == "sobol"         ? Sampler_type::sobol
+                             : sampler == "halton"      ? Sampler_type::halton
+                             : sampler == "stratified"  ? Sampler_type::stratified
+                                                        : Sampler_type::independent;
+  if (sampler_type == Sampler_type::independent && sampler != "independent")
+  {
+    std::cerr << "ERROR: Unknown sampler '" << sampler << "'.\n";
+    usage();
+    return 1;
+  }
+  Integrator integrator_type = integrator == "iterative"   ? Integrator::iterative
+                               : integrator == "wavefront" ? Integrator::wavefront
+                                                           : Integrator::recursive;
+  if (integrator_type == Integrator::recursive && integrator != "recursive")
+  {
+    std::cerr << "ERROR: Unknown integrator '" << integrator << "'.\n";
+    usage();
+    return 1;
+  }
+  Bvh_build_options bvh;
+  if (bvh_split == "median")
+    bvh.split = Bvh_split::median;
+  else if (bvh_split != "sah")
+  {
+    std::cerr << "ERROR: Unknown BVH split '" << bvh_split << "'.\n";
+    usage();
+    return 1;
+  }
+  if (heatmap_mode != Heatmap::none && (pass_samples >= 0 || serve_port >= 0 || worker_port >= 0))
+  {
+    std::cerr << "ERROR: --heatmap renders locally and in one pass.\n";
+    return 1;
+  }
+  if (!stats_file.empty() && !stats::enabled)
+  {
+    std::cerr << "ERROR: --stats needs a build with statistics (make clean && make STATS=1).\n";
+    return 1;
+  }
+  if (serve_port > 65535)
+  {
+    std::cerr << "ERROR: --serve needs a port number.\n";
+    return 1;
+  }
+  if ((serve_port >= 0 || worker_port >= 0) && pass_samples >= 0)
+  {
+    std::cerr << "ERROR: Distributed rendering does not support --progressive.\n";
+    return 1;
+  }
+
+  Scene scene;
   Camera cam;
+  {
+    stats::Scoped_timer timer(stats::scene_build);
+    if (!load_scene(scene_path, scene, cam, use_cache, bvh))
+      return 1;
+  }
 
-  cam.aspect_ratio = 16.0 / 9.0;
-  cam.image_width = 400;
-  cam.samples_per_pixel = 100;
-  cam.max_depth = 50;
+  if (width >= 0)
+    cam.image_width = int(width);
+  if (spp >= 0)
+    cam.samples_per_pixel = int(spp);
+  if (depth >= 0)
+    cam.max_depth = int(depth);
+  if (threads >= 0)
+    cam.thread_count = size_t(threads);
+  cam.output_file = output;
+  cam.heatmap = heatmap_mode;
+  cam.lights = &scene.lights;
+  cam.sample_lights = sample_lights;
+  cam.sampler = sampler_type;
+  cam.integrator = integrator_type;
+  cam.russian_roulette = roulette;
+  if (roulette_min_depth >= 0)
+    cam.roulette_min_depth = size_t(roulette_min_depth);
+  if (adaptive >= 0)
+  {
+    cam.adaptive_sampling = true;
+    cam.adaptive_tolerance = adaptive;
+  }
+  if (adaptive_min >= 0)
+    cam.adaptive_min_samples = size_t(adaptive_min);
+  cam.sample_count_file = sample_counts;
 
-  cam.vfov = 20;
-  cam.lookfrom = point3(13, 2, 3);
-  cam.lookat = point3(0, 0, 0);
-  cam.vup = vec3(0, 1, 0);
+  if (pass_samples >= 0)
+  {
+    cam.progressive = true;
+    cam.pass_samples = size_t(pass_samples);
+  }
+  cam.snapshot_passes = size_t(snapshot_passes);
+  cam.snapshot_seconds = snapshot_seconds;
+  cam.time_limit = time_limit;
+  cam.noise_target = noise_target;
+  cam.checkpoint_file = checkpoint;
+  cam.checkpoint_passes = size_t(checkpoint_passes);
+  cam.checkpoint_seconds = checkpoint_seconds;
+  cam.scene_hash = scene.hash;
+  if (!checkpoint.empty() && !cam.progressive)
+  {
+    std::cerr << "ERROR: --checkpoint needs --progressive.\n";
+    return 1;
+  }
 
-  cam.defocus_angle = 0;
+  bool ok;
+  if (worker_port >= 0)
+    ok = run_worker(worker_host, uint16_t(worker_port), cam, scene.world, scene.hash);
+  else if (serve_port >= 0)
+  {
+    Framebuffer image;
+    ok = Render_coordinator(cam, scene.hash).render(uint16_t(serve_port), image) && cam.write_output(image);
+  }
+  else
+    ok = cam.render(scene.world);
 
-  cam.render(world);
-}
-int main()
-{
-  switch (3)
-  {
-    case 1:
-      bouncing_spheres();
-      break;
-    case 2:
-      wood();
-      break;
-    case 3:
-      perlin_spheres();
-      break;
-    default:
-      wood();
-      break;
+  if (stats::enabled)
+  {
+    stats::report(std::clog);
+    if (!stats_file.empty())
+    {
+      std::ofstream file(stats_file);
+      stats::write_json(file);
+      if (!file)
+      {
+        std::cerr << "ERROR: Could not write '" << stats_file << "'.\n";
+        ok = false;
+      }
+    }
   }
+  return ok ? 0 : 1;
 }
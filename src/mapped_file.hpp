@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstddef>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define RT_HAVE_MMAP 1
+#else
+#define RT_HAVE_MMAP 0
+#endif
+
+// Read-only view of a whole file. The file is memory-mapped where the platform allows it, so
+// large assets are paged in on demand instead of being copied; elsewhere it is read into memory.
+class Mapped_file
+{
+public:
+  Mapped_file() {}
+
+  explicit Mapped_file(const std::string &path) { open(path); }
+
+  ~Mapped_file() { close(); }
+
+  Mapped_file(const Mapped_file &) = delete;
+  Mapped_file &operator=(const Mapped_file &) = delete;
+
+  bool open(const std::string &path)
+  {
+    close();
+#if RT_HAVE_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+      ::close(fd);
+      return false;
+    }
+    length = size_t(info.st_size);
+    if (length > 0)
+    {
+      void *mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped == MAP_FAILED)
+      {
+        ::close(fd);
+        length = 0;
+        return false;
+      }
+      madvise(mapped, length, MADV_SEQUENTIAL);
+      bytes = static_cast<const char *>(mapped);
+    }
+    ::close(fd);
+    is_open = true;
+    return true;
+#else
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+      return false;
+    buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    bytes = buffer.data();
+    length = buffer.size();
+    is_open = true;
+    return true;
+#endif
+  }
+
+  void close()
+  {
+#if RT_HAVE_MMAP
+    if (bytes && length > 0)
+      munmap(const_cast<char *>(bytes), length);
+#else
+    buffer.clear();
+#endif
+    bytes = nullptr;
+    length = 0;
+    is_open = false;
+  }
+
+  bool good() const { return is_open; }
+  const char *data() const { return bytes; }
+  size_t size() const { return length; }
+  const char *begin() const { return bytes; }
+  const char *end() const { return bytes + length; }
+
+private:
+  const char *bytes = nullptr;
+  size_t length = 0;
+  bool is_open = false;
+#if !RT_HAVE_MMAP
+  std::vector<char> buffer;
+#endif
+};
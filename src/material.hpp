@@ -1,5 +1,7 @@
 #pragma once
 
+#include <memory>
+
 #include "./color.hpp"
 #include "./shape.hpp"
 #include "./texture.hpp"
@@ -10,15 +12,28 @@ public:
   virtual ~material() = default;
 
   virtual bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered) const { return false; }
+
+  // Radiance the surface emits back along r_in. Black except for lights.
+  virtual color emitted(const ray &, const hit_record &) const { return color(0, 0, 0); }
+
+  // Materials that scatter over a spread of directions describe that spread, so lights can be
+  // sampled at their surfaces: eval() is the fraction of radiance arriving from `direction` that
+  // leaves along -r_in.direction(), cosine included, and pdf() the solid-angle density with which
+  // scatter() picks `direction`. scatter()'s attenuation is eval() / pdf() of the direction it
+  // picks. Mirror-like materials keep the defaults and are handled by scatter() alone.
+  virtual bool has_pdf() const { return false; }
+  virtual color eval(const ray &, const hit_record &, const vec3 &) const { return color(0, 0, 0); }
+  virtual double pdf(const ray &, const hit_record &, const vec3 &) const { return 0; }
 };
 
 class Lambertian : public material
 {
-  shared_ptr<Texture> tex;
+  std::unique_ptr<Texture> own_tex;  // Set when built from a plain color
+  const Texture *tex;
 
 public:
-  Lambertian(const color &albedo) : tex(make_shared<solid_color>(albedo)) {}
-  Lambertian(shared_ptr<Texture> tex) : tex(tex) {}
+  Lambertian(const color &albedo) : own_tex(std::make_unique<solid_color>(albedo)), tex(own_tex.get()) {}
+  Lambertian(const Texture *tex) : tex(tex) {}
 
   bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered) const override
   {
@@ -33,6 +48,45 @@ public:
     attenuation = tex->value(rec.u, rec.v, rec.point);
     return true;
   }
+
+  // The normal plus a random unit vector is cosine-distributed about the normal.
+  bool has_pdf() const override { return true; }
+
+  color eval(const ray &r_in, const hit_record &rec, const vec3 &direction) const override
+  {
+    (void)r_in;
+    return tex->value(rec.u, rec.v, rec.point) * (cosine(rec, direction) / pi);
+  }
+
+  double pdf(const ray &r_in, const hit_record &rec, const vec3 &direction) const override
+  {
+    (void)r_in;
+    return cosine(rec, direction) / pi;
+  }
+
+private:
+  static double cosine(const hit_record &rec, const vec3 &direction)
+  {
+    return std::fmax(0, dot(rec.normal, unit_vector(direction)));
+  }
+};
+
+// An emitter that sends the same radiance in every direction from its front face, and scatters
+// nothing.
+class Diffuse_light : public material
+{
+  const Texture *tex;
+
+public:
+  Diffuse_light(const Texture *tex) : tex(tex) {}
+
+  color emitted(const ray &r_in, const hit_record &rec) const override
+  {
+    (void)r_in;
+    if (!rec.is_front_facing)
+      return color(0, 0, 0);
+    return tex->value(rec.u, rec.v, rec.point);
+  }
 };
 
 class metal : public material
@@ -74,7 +128,8 @@ public:
     bool cannot_refract = ri * sin_theta > 1.0;
     vec3 direction;
 
-    if (cannot_refract || reflectance(cos_theta, ri) > random_double())
+    double choice = random_double();  // Drawn either way, so later draws keep their dimensions
+    if (cannot_refract || reflectance(cos_theta, ri) > choice)
       direction = reflect(unit_direction, rec.normal);
     else
       direction = refract(unit_direction, rec.normal, ri);
@@ -0,0 +1,607 @@
+#pragma once
+
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "./mapped_file.hpp"
+#include "./triangle_mesh.hpp"
+
+// Streaming loaders for Wavefront OBJ and PLY (binary or ASCII) meshes. The file is memory-mapped
+// and parsed in place, one pass, with no allocation per line or per element: buffers are reserved
+// from a quick count up front. Polygons are split into triangle fans. The loaders only fill the
+// mesh buffers; call TriangleMesh::build() afterwards.
+
+namespace mesh_loader_detail
+{
+  inline bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+  inline void skip_blanks(const char *&p, const char *end)
+  {
+    while (p < end && is_blank(*p))
+      p++;
+  }
+
+  inline void skip_line(const char *&p, const char *end)
+  {
+    const void *newline = std::memchr(p, '\n', size_t(end - p));
+    p = newline ? static_cast<const char *>(newline) + 1 : end;
+  }
+
+  inline bool parse_double(const char *&p, const char *end, double &value)
+  {
+    skip_blanks(p, end);
+    if (p < end && *p == '+')
+      p++;
+    auto result = std::from_chars(p, end, value);
+    if (result.ec != std::errc())
+      return false;
+    p = result.ptr;
+    return true;
+  }
+
+  inline bool parse_long(const char *&p, const char *end, long &value)
+  {
+    skip_blanks(p, end);
+    if (p < end && *p == '+')
+      p++;
+    auto result = std::from_chars(p, end, value);
+    if (result.ec != std::errc())
+      return false;
+    p = result.ptr;
+    return true;
+  }
+
+  struct Obj_corner
+  {
+    uint32_t position, texcoord, normal;
+  };
+
+  // Appends one triangle of a face's fan. It uses normals or texcoords only if all three corners
+  // have them.
+  inline void add_fan_triangle(TriangleMesh &mesh, const Obj_corner &a, const Obj_corner &b, const Obj_corner &c)
+  {
+    Mesh_triangle tri;
+    const Obj_corner *corners[3] = {&a, &b, &c};
+    bool has_normals = true, has_texcoords = true;
+    for (int k = 0; k < 3; k++)
+    {
+      tri.position[k] = corners[k]->position;
+      tri.normal[k] = corners[k]->normal;
+      tri.texcoord[k] = corners[k]->texcoord;
+      has_normals = has_normals && corners[k]->normal != TriangleMesh::no_index;
+      has_texcoords = has_texcoords && corners[k]->texcoord != TriangleMesh::no_index;
+    }
+    for (int k = 0; k < 3; k++)
+    {
+      if (!has_normals)
+        tri.normal[k] = TriangleMesh::no_index;
+      if (!has_texcoords)
+        tri.texcoord[k] = TriangleMesh::no_index;
+    }
+    mesh.triangles.push_back(tri);
+  }
+
+  // OBJ indices are 1-based; negative ones count back from the latest element.
+  inline uint32_t resolve_obj_index(long index, size_t count)
+  {
+    if (index > 0)
+      return uint32_t(index - 1);
+    if (index < 0 && size_t(-index) <= count)
+      return uint32_t(long(count) + index);
+    return TriangleMesh::no_index;
+  }
+
+  inline bool check_indices(const TriangleMesh &mesh, const std::string &path)
+  {
+    if (mesh.indices_valid())
+      return true;
+    std::cerr << "ERROR: Mesh file '" << path << "' has a face with an out-of-range index.\n";
+    return false;
+  }
+
+}  // namespace mesh_loader_detail
+
+inline bool load_obj(const std::string &path, TriangleMesh &mesh)
+{
+  using namespace mesh_loader_detail;
+
+  Mapped_file file(path);
+  if (!file.good())
+  {
+    std::cerr << "ERROR: Could not load mesh file '" << path << "'.\n";
+    return false;
+  }
+
+  // Counting pass, so the buffers grow once.
+  size_t vertex_lines = 0, normal_lines = 0, texcoord_lines = 0, face_lines = 0;
+  for (const char *p = file.begin(); p < file.end(); skip_line(p, file.end()))
+  {
+    skip_blanks(p, file.end());
+    if (file.end() - p < 2)
+      continue;
+    if (p[0] == 'v' && is_blank(p[1]))
+      vertex_lines++;
+    else if (p[0] == 'v' && p[1] == 'n')
+      normal_lines++;
+    else if (p[0] == 'v' && p[1] == 't')
+      texcoord_lines++;
+    else if (p[0] == 'f' && is_blank(p[1]))
+      face_lines++;
+  }
+  mesh.positions.reserve(mesh.positions.size() + vertex_lines);
+  mesh.normals.reserve(mesh.normals.size() + normal_lines);
+  mesh.texcoords.reserve(mesh.texcoords.size() + texcoord_lines);
+  mesh.triangles.reserve(mesh.triangles.size() + face_lines);
+
+  const size_t position_base = mesh.positions.size();
+  const size_t normal_base = mesh.normals.size();
+  const size_t texcoord_base = mesh.texcoords.size();
+  size_t line_number = 0;
+
+  auto fail = [&](const char *what)
+  {
+    std::cerr << "ERROR: " << what << " on line " << line_number << " of '" << path << "'.\n";
+    return false;
+  };
+
+  const char *end = file.end();
+  for (const char *p = file.begin(); p < end; skip_line(p, end))
+  {
+    line_number++;
+    skip_blanks(p, end);
+    if (end - p < 2)
+      continue;
+
+    if (p[0] == 'v' && (is_blank(p[1]) || p[1] == 'n' || p[1] == 't'))
+    {
+      char kind = p[1];
+      p += is_blank(kind) ? 1 : 2;
+      // Texcoords may omit v; positions and normals need all three components.
+      const int components = kind == 't' ? 2 : 3;
+      const int required = kind == 't' ? 1 : 3;
+      double xyz[3] = {0, 0, 0};
+      for (int k = 0; k < components; k++)
+      {
+        if (parse_double(p, end, xyz[k]))
+          continue;
+        if (k < required)
+          return fail("Malformed vertex data");
+        break;
+      }
+
+      if (kind == 'n')
+        mesh.normals.push_back(vec3(xyz[0], xyz[1], xyz[2]));
+      else if (kind == 't')
+        mesh.texcoords.push_back({xyz[0], xyz[1]});
+      else
+        mesh.positions.push_back(point3(xyz[0], xyz[1], xyz[2]));
+    }
+    else if (p[0] == 'f' && is_blank(p[1]))
+    {
+      p++;
+      Obj_corner first{}, previous{};
+      int corner_count = 0;
+      while (true)
+      {
+        skip_blanks(p, end);
+        if (p >= end || *p == '\n' || *p == '#')
+          break;
+
+        // v, v/vt, v//vn or v/vt/vn
+        long index;
+        Obj_corner corner = {TriangleMesh::no_index, TriangleMesh::no_index, TriangleMesh::no_index};
+        if (!parse_long(p, end, index))
+          return fail("Malformed face");
+        corner.position = resolve_obj_index(index, mesh.positions.size() - position_base);
+        if (p < end && *p == '/')
+        {
+          p++;
+          if (p < end && *p != '/')
+          {
+            if (!parse_long(p, end, index))
+              return fail("Malformed face");
+            corner.texcoord = resolve_obj_index(index, mesh.texcoords.size() - texcoord_base);
+          }
+          if (p < end && *p == '/')
+          {
+            p++;
+            if (!parse_long(p, end, index))
+              return fail("Malformed face");
+            corner.normal = resolve_obj_index(index, mesh.normals.size() - normal_base);
+          }
+        }
+        if (corner.position == TriangleMesh::no_index)
+          return fail("Face index out of range");
+
+        corner.position += uint32_t(position_base);
+        if (corner.texcoord != TriangleMesh::no_index)
+          corner.texcoord += uint32_t(texcoord_base);
+        if (corner.normal != TriangleMesh::no_index)
+          corner.normal += uint32_t(normal_base);
+
+        if (corner_count == 0)
+          first = corner;
+        else if (corner_count >= 2)
+          add_fan_triangle(mesh, first, previous, corner);
+        previous = corner;
+        corner_count++;
+      }
+    }
+    // Everything else (comments, groups, materials, smoothing groups) is ignored.
+  }
+
+  return check_indices(mesh, path);
+}
+
+namespace mesh_loader_detail
+{
+  enum class Ply_type
+  {
+    none,
+    int8,
+    uint8,
+    int16,
+    uint16,
+    int32,
+    uint32,
+    float32,
+    float64
+  };
+
+  inline Ply_type ply_type(const std::string &name)
+  {
+    if (name == "char" || name == "int8")
+      return Ply_type::int8;
+    if (name == "uchar" || name == "uint8")
+      return Ply_type::uint8;
+    if (name == "short" || name == "int16")
+      return Ply_type::int16;
+    if (name == "ushort" || name == "uint16")
+      return Ply_type::uint16;
+    if (name == "int" || name == "int32")
+      return Ply_type::int32;
+    if (name == "uint" || name == "uint32")
+      return Ply_type::uint32;
+    if (name == "float" || name == "float32")
+      return Ply_type::float32;
+    if (name == "double" || name == "float64")
+      return Ply_type::float64;
+    return Ply_type::none;
+  }
+
+  inline size_t ply_type_size(Ply_type type)
+  {
+    switch (type)
+    {
+      case Ply_type::int8:
+      case Ply_type::uint8:
+        return 1;
+      case Ply_type::int16:
+      case Ply_type::uint16:
+        return 2;
+      case Ply_type::int32:
+      case Ply_type::uint32:
+      case Ply_type::float32:
+        return 4;
+      case Ply_type::float64:
+        return 8;
+      default:
+        return 0;
+    }
+  }
+
+  struct Ply_property
+  {
+    std::string name;
+    Ply_type type = Ply_type::none;        // Value type, or list item type
+    Ply_type count_type = Ply_type::none;  // Set for list properties
+  };
+
+  struct Ply_element
+  {
+    std::string name;
+    size_t count = 0;
+    std::vector<Ply_property> properties;
+  };
+
+  // Reads one value of a PLY element body, in whichever encoding the file uses.
+  class Ply_reader
+  {
+  public:
+    enum class Encoding
+    {
+      ascii,
+      binary_little_endian,
+      binary_big_endian
+    };
+
+    Ply_reader(const char *p, const char *end, Encoding encoding) : p(p), end(end), encoding(encoding)
+    {
+      const uint16_t probe = 1;
+      char first_byte;
+      std::memcpy(&first_byte, &probe, 1);
+      bool host_little = first_byte == 1;
+      swap = (encoding == Encoding::binary_little_endian && !host_little) ||
+             (encoding == Encoding::binary_big_endian && host_little);
+    }
+
+    bool read(Ply_type type, double &value)
+    {
+      if (encoding == Encoding::ascii)
+      {
+        while (p < end && std::isspace((unsigned char)*p))
+          p++;
+        return parse_double(p, end, value);
+      }
+
+      size_t size = ply_type_size(type);
+      if (size_t(end - p) < size)
+        return false;
+      unsigned char bytes[8];
+      std::memcpy(bytes, p, size);
+      p += size;
+      if (swap)
+        for (size_t k = 0; k < size / 2; k++)
+          std::swap(bytes[k], bytes[size - 1 - k]);
+
+      switch (type)
+      {
+        case Ply_type::int8: value = double(int8_t(bytes[0])); break;
+        case Ply_type::uint8: value = double(bytes[0]); break;
+        case Ply_type::int16: value = double(load<int16_t>(bytes)); break;
+        case Ply_type::uint16: value = double(load<uint16_t>(bytes)); break;
+        case Ply_type::int32: value = double(load<int32_t>(bytes)); break;
+        case Ply_type::uint32: value = double(load<uint32_t>(bytes)); break;
+        case Ply_type::float32: value = double(load<float>(bytes)); break;
+        case Ply_type::float64: value = load<double>(bytes); break;
+        default: return false;
+      }
+      return true;
+    }
+
+  private:
+    const char *p;
+    const char *end;
+    Encoding encoding;
+    bool swap = false;
+
+    template <typename T>
+    static T load(const unsigned char *bytes)
+    {
+      T value;
+      std::memcpy(&value, bytes, sizeof(T));
+      return value;
+    }
+  };
+}  // namespace mesh_loader_detail
+
+inline bool load_ply(const std::string &path, TriangleMesh &mesh)
+{
+  using namespace mesh_loader_detail;
+
+  Mapped_file file(path);
+  if (!file.good())
+  {
+    std::cerr << "ERROR: Could not load mesh file '" << path << "'.\n";
+    return false;
+  }
+  auto fail = [&](const char *what)
+  {
+    std::cerr << "ERROR: " << what << " in '" << path << "'.\n";
+    return false;
+  };
+
+  // Header: a few short text lines, ending with "end_header".
+  const char *p = file.begin();
+  const char *end = file.end();
+  Ply_reader::Encoding encoding = Ply_reader::Encoding::ascii;
+  std::vector<Ply_element> elements;
+  bool header_done = false;
+  bool magic_seen = false;
+
+  while (p < end && !header_done)
+  {
+    const char *line_end = static_cast<const char *>(std::memchr(p, '\n', size_t(end - p)));
+    if (!line_end)
+      line_end = end;
+
+    // Split the line into at most five words.
+    std::string words[5];
+    int word_count = 0;
+    for (const char *q = p; q < line_end && word_count < 5;)
+    {
+      while (q < line_end && std::isspace((unsigned char)*q))
+        q++;
+      const char *start = q;
+      while (q < line_end && !std::isspace((unsigned char)*q))
+        q++;
+      if (q > start)
+        words[word_count++].assign(start, q);
+    }
+    p = line_end < end ? line_end + 1 : end;
+
+    if (!magic_seen)
+    {
+      if (word_count != 1 || words[0] != "ply")
+        return fail("Missing PLY signature");
+      magic_seen = true;
+    }
+    else if (word_count == 0 || words[0] == "comment" || words[0] == "obj_info")
+    {
+      continue;
+    }
+    else if (words[0] == "format")
+    {
+      if (words[1] == "ascii")
+        encoding = Ply_reader::Encoding::ascii;
+      else if (words[1] == "binary_little_endian")
+        encoding = Ply_reader::Encoding::binary_little_endian;
+      else if (words[1] == "binary_big_endian")
+        encoding = Ply_reader::Encoding::binary_big_endian;
+      else
+        return fail("Unknown PLY format");
+    }
+    else if (words[0] == "element" && word_count >= 3)
+    {
+      Ply_element element;
+      element.name = words[1];
+      element.count = size_t(std::strtoull(words[2].c_str(), nullptr, 10));
+      elements.push_back(element);
+    }
+    else if (words[0] == "property" && !elements.empty())
+    {
+      Ply_property property;
+      if (words[1] == "list" && word_count >= 5)
+      {
+        property.count_type = ply_type(words[2]);
+        property.type = ply_type(words[3]);
+        property.name = words[4];
+        if (property.count_type == Ply_type::none)
+          return fail("Unknown PLY property type");
+      }
+      else if (word_count >= 3)
+      {
+        property.type = ply_type(words[1]);
+        property.name = words[2];
+      }
+      if (property.type == Ply_type::none)
+        return fail("Unknown PLY property type");
+      elements.back().properties.push_back(property);
+    }
+    else if (words[0] == "end_header")
+    {
+      header_done = true;
+    }
+  }
+  if (!header_done)
+    return fail("Unterminated PLY header");
+
+  // Body
+  Ply_reader reader(p, end, encoding);
+  const size_t position_base = mesh.positions.size();
+  bool has_normals = false, has_texcoords = false;
+
+  for (const auto &element : elements)
+  {
+    const bool is_vertex = element.name == "vertex";
+    const bool is_face = element.name == "face";
+
+    // Where each vertex property goes: 0-2 position, 3-5 normal, 6-7 texcoord, -1 ignored.
+    std::vector<int> slot(element.properties.size(), -1);
+    if (is_vertex)
+    {
+      for (size_t k = 0; k < element.properties.size(); k++)
+      {
+        const std::string &name = element.properties[k].name;
+        if (name == "x" || name == "y" || name == "z")
+          slot[k] = name[0] - 'x';
+        else if (name == "nx" || name == "ny" || name == "nz")
+          slot[k] = 3 + (name[1] - 'x');
+        else if (name == "u" || name == "s" || name == "texture_u" || name == "texture_s")
+          slot[k] = 6;
+        else if (name == "v" || name == "t" || name == "texture_v" || name == "texture_t")
+          slot[k] = 7;
+        has_normals = has_normals || (slot[k] >= 3 && slot[k] <= 5);
+        has_texcoords = has_texcoords || slot[k] >= 6;
+      }
+      mesh.positions.reserve(mesh.positions.size() + element.count);
+      if (has_normals)
+        mesh.normals.resize(position_base);
+      if (has_texcoords)
+        mesh.texcoords.resize(position_base);
+      if (has_normals)
+        mesh.normals.reserve(position_base + element.count);
+      if (has_texcoords)
+        mesh.texcoords.reserve(position_base + element.count);
+    }
+    if (is_face)
+      mesh.triangles.reserve(mesh.triangles.size() + element.count);
+
+    for (size_t i = 0; i < element.count; i++)
+    {
+      double values[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+      for (size_t k = 0; k < element.properties.size(); k++)
+      {
+        const Ply_property &property = element.properties[k];
+        double value;
+        if (property.count_type == Ply_type::none)
+        {
+          if (!reader.read(property.type, value))
+            return fail("Truncated PLY data");
+          if (slot[k] >= 0)
+            values[slot[k]] = value;
+          continue;
+        }
+
+        double count;
+        if (!reader.read(property.count_type, count))
+          return fail("Truncated PLY data");
+        bool is_indices = is_face && (property.name == "vertex_indices" || property.name == "vertex_index");
+        // Counts and indices arrive as doubles of any sign and size; check before converting.
+        if (!(count >= 0 && count <= double(UINT32_MAX)))
+          return fail(is_indices ? "Malformed face" : "Malformed PLY list");
+        uint32_t first = 0, previous = 0;
+        for (size_t c = 0; c < size_t(count); c++)
+        {
+          if (!reader.read(property.type, value))
+            return fail("Truncated PLY data");
+          if (!is_indices)
+            continue;
+          if (!(value >= 0 && value <= double(UINT32_MAX - position_base)))
+            return fail("Malformed face");
+          uint32_t index = uint32_t(position_base + size_t(value));
+          if (c == 0)
+            first = index;
+          else if (c >= 2)
+          {
+            // PLY normals and texcoords are per vertex, so they share the position index.
+            Mesh_triangle tri;
+            uint32_t corners[3] = {first, previous, index};
+            for (int v = 0; v < 3; v++)
+            {
+              tri.position[v] = corners[v];
+              tri.normal[v] = has_normals ? corners[v] : TriangleMesh::no_index;
+              tri.texcoord[v] = has_texcoords ? corners[v] : TriangleMesh::no_index;
+            }
+            mesh.triangles.push_back(tri);
+          }
+          previous = index;
+        }
+      }
+
+      if (is_vertex)
+      {
+        mesh.positions.push_back(point3(values[0], values[1], values[2]));
+        if (has_normals)
+          mesh.normals.push_back(vec3(values[3], values[4], values[5]));
+        if (has_texcoords)
+          mesh.texcoords.push_back({values[6], values[7]});
+      }
+    }
+  }
+
+  return check_indices(mesh, path);
+}
+
+// Loads an .obj or .ply file by extension.
+inline bool load_mesh(const std::string &path, TriangleMesh &mesh)
+{
+  size_t dot = path.find_last_of('.');
+  std::string extension = dot == std::string::npos ? "" : path.substr(dot + 1);
+  for (auto &c : extension)
+    c = char(std::tolower((unsigned char)c));
+
+  if (extension == "obj")
+    return load_obj(path, mesh);
+  if (extension == "ply")
+    return load_ply(path, mesh);
+
+  std::cerr << "ERROR: Unknown mesh format '" << path << "'.\n";
+  return false;
+}
@@ -0,0 +1,275 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#define RT_HAVE_SOCKETS 1
+#else
+#define RT_HAVE_SOCKETS 0
+#endif
+
+// A TCP socket that closes itself. Only what the distributed renderer needs: listen, accept,
+// connect, blocking sends and reads, and non-blocking draining of whatever has arrived. Without
+// BSD sockets every operation fails.
+class Socket
+{
+public:
+  Socket() {}
+  explicit Socket(int fd) : fd(fd) {}
+  ~Socket() { close(); }
+
+  Socket(Socket &&other) noexcept : fd(std::exchange(other.fd, -1)) {}
+  Socket &operator=(Socket &&other) noexcept
+  {
+    if (this != &other)
+    {
+      close();
+      fd = std::exchange(other.fd, -1);
+    }
+    return *this;
+  }
+
+  Socket(const Socket &) = delete;
+  Socket &operator=(const Socket &) = delete;
+
+  bool valid() const { return fd >= 0; }
+  int handle() const { return fd; }
+
+  // A socket accepting connections on `port` on every interface.
+  static Socket listen(uint16_t port)
+  {
+#if RT_HAVE_SOCKETS
+    // A dual-stack IPv6 socket takes both kinds of clients; fall back to IPv4 without IPv6.
+    bool ipv6 = true;
+    Socket s(::socket(AF_INET6, SOCK_STREAM, 0));
+    if (!s.valid())
+    {
+      ipv6 = false;
+      s = Socket(::socket(AF_INET, SOCK_STREAM, 0));
+    }
+    if (!s.valid())
+      return Socket();
+
+    int yes = 1, no = 0;
+    setsockopt(s.fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_storage address = {};
+    socklen_t length;
+    if (ipv6)
+    {
+      setsockopt(s.fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no));
+      auto &a = reinterpret_cast<sockaddr_in6 &>(address);
+      a.sin6_family = AF_INET6;
+      a.sin6_addr = in6addr_any;
+      a.sin6_port = htons(port);
+      length = sizeof(a);
+    }
+    else
+    {
+      auto &a = reinterpret_cast<sockaddr_in &>(address);
+      a.sin_family = AF_INET;
+      a.sin_addr.s_addr = htonl(INADDR_ANY);
+      a.sin_port = htons(port);
+      length = sizeof(a);
+    }
+    if (::bind(s.fd, reinterpret_cast<sockaddr *>(&address), length) != 0 || ::listen(s.fd, 64) != 0)
+      return Socket();
+    return s;
+#else
+    (void)port;
+    return Socket();
+#endif
+  }
+
+  static Socket connect(const std::string &host, uint16_t port)
+  {
+#if RT_HAVE_SOCKETS
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *found = nullptr;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found) != 0)
+      return Socket();
+
+    Socket s;
+    for (addrinfo *a = found; a; a = a->ai_next)
+    {
+      s = Socket(::socket(a->ai_family, a->ai_socktype, a->ai_protocol));
+      if (s.valid() && ::connect(s.fd, a->ai_addr, a->ai_addrlen) == 0)
+        break;
+      s.close();
+    }
+    freeaddrinfo(found);
+    if (s.valid())
+      s.set_no_delay();
+    return s;
+#else
+    (void)host;
+    (void)port;
+    return Socket();
+#endif
+  }
+
+  // The next pending connection, made non-blocking for read_available(). Invalid if none.
+  Socket accept() const
+  {
+#if RT_HAVE_SOCKETS
+    Socket s(::accept(fd, nullptr, nullptr));
+    if (s.valid())
+    {
+      s.set_no_delay();
+      fcntl(s.fd, F_SETFL, fcntl(s.fd, F_GETFL) | O_NONBLOCK);
+    }
+    return s;
+#else
+    return Socket();
+#endif
+  }
+
+  // Sends all of `data`, waiting for buffer space if the socket is non-blocking.
+  bool send_all(const void *data, size_t size) const
+  {
+#if RT_HAVE_SOCKETS
+    auto p = static_cast<const char *>(data);
+    while (size > 0)
+    {
+      ssize_t sent = ::send(fd, p, size, send_flags);
+      if (sent < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+      {
+        wait_writable();
+        continue;
+      }
+      if (sent <= 0)
+        return false;
+      p += sent;
+      size -= size_t(sent);
+    }
+    return true;
+#else
+    (void)data;
+    (void)size;
+    return false;
+#endif
+  }
+
+  // Blocks until `size` bytes have arrived. False if the peer closed first or on error.
+  bool receive_all(void *data, size_t size) const
+  {
+#if RT_HAVE_SOCKETS
+    auto p = static_cast<char *>(data);
+    while (size > 0)
+    {
+      ssize_t got = ::recv(fd, p, size, 0);
+      if (got < 0 && errno == EINTR)
+        continue;
+      if (got <= 0)
+        return false;
+      p += got;
+      size -= size_t(got);
+    }
+    return true;
+#else
+    (void)data;
+    (void)size;
+    return false;
+#endif
+  }
+
+  // Appends whatever has arrived on a non-blocking socket to `buffer`. False once the peer has
+  // closed the connection or it failed.
+  bool read_available(std::string &buffer) const
+  {
+#if RT_HAVE_SOCKETS
+    char chunk[64 * 1024];
+    for (;;)
+    {
+      ssize_t got = ::recv(fd, chunk, sizeof(chunk), 0);
+      if (got > 0)
+      {
+        buffer.append(chunk, size_t(got));
+        continue;
+      }
+      if (got < 0 && errno == EINTR)
+        continue;
+      return got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+#else
+    (void)buffer;
+    return false;
+#endif
+  }
+
+  // Ends the connection in both directions but keeps the descriptor, so it is safe while other
+  // threads are still using the socket.
+  void shutdown() const
+  {
+#if RT_HAVE_SOCKETS
+    if (fd >= 0)
+      ::shutdown(fd, SHUT_RDWR);
+#endif
+  }
+
+  void close()
+  {
+#if RT_HAVE_SOCKETS
+    if (fd >= 0)
+      ::close(fd);
+#endif
+    fd = -1;
+  }
+
+private:
+  int fd = -1;
+
+#if RT_HAVE_SOCKETS
+#ifdef MSG_NOSIGNAL
+  static const int send_flags = MSG_NOSIGNAL;  // A dead peer is an error return, not SIGPIPE
+#else
+  static const int send_flags = 0;
+#endif
+
+  void set_no_delay() const
+  {
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  }
+
+  void wait_writable() const
+  {
+    pollfd p = {fd, POLLOUT, 0};
+    ::poll(&p, 1, -1);
+  }
+#endif
+};
+
+// Waits up to timeout_ms for any of `sockets` to have data (or a closed connection) to read, and
+// sets ready[k] for those that do. Returns false on error.
+inline bool wait_readable(const std::vector<const Socket *> &sockets, std::vector<char> &ready, int timeout_ms)
+{
+  ready.assign(sockets.size(), 0);
+#if RT_HAVE_SOCKETS
+  std::vector<pollfd> fds;
+  for (const Socket *socket : sockets)
+    fds.push_back({socket->handle(), POLLIN, 0});
+  int count = ::poll(fds.data(), nfds_t(fds.size()), timeout_ms);
+  if (count < 0)
+    return errno == EINTR;
+  for (size_t k = 0; k < fds.size(); k++)
+    ready[k] = fds[k].revents != 0;
+  return true;
+#else
+  (void)timeout_ms;
+  return false;
+#endif
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "./sampler.hpp"
 #include "./utils.hpp"
 #include "./vec3.hpp"
 
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cmath>
+
+#include "./aabb.hpp"
+#include "./interval.hpp"
+#include "./ray.hpp"
+#include "./shape.hpp"
+
+// A parallelogram with corner q and edges u and v. Its front face is the side that cross(u, v)
+// points to, and (u, v) texture coordinates run from 0 to 1 along the two edges.
+class Quad : public Shape
+{
+  point3 q;
+  vec3 u, v;
+  vec3 w;         // cross(u, v) / |cross(u, v)|^2, for the planar coordinates of a hit
+  vec3 normal;    // Unit normal of the front face
+  double offset;  // dot(normal, q): the plane is dot(normal, p) = offset
+  const material *mat;
+  const Light *light = nullptr;
+  aabb bbox;
+
+public:
+  Quad(const point3 &q, const vec3 &u, const vec3 &v, const material *mat) : q(q), u(u), v(v), mat(mat)
+  {
+    vec3 n = cross(u, v);
+    normal = unit_vector(n);
+    offset = dot(normal, q);
+    w = n / dot(n, n);
+
+    // Pad the box along any axis the quad lies flat in, so slab tests never see zero width.
+    aabb box(aabb(q, q + u + v), aabb(q + u, q + v));
+    const double pad = 0.0001;
+    bbox = aabb(box.x.size() < pad ? box.x.expand(pad) : box.x, box.y.size() < pad ? box.y.expand(pad) : box.y,
+                box.z.size() < pad ? box.z.expand(pad) : box.z);
+  }
+
+  aabb bounding_box() const override { return bbox; }
+
+  bool hit(const ray &r, Interval interval, hit_record &record) const override
+  {
+    double denominator = dot(normal, r.direction());
+    if (std::fabs(denominator) < 1e-8)
+      return false;  // Ray parallel to the plane
+
+    double t = (offset - dot(normal, r.origin())) / denominator;
+    if (!interval.surrounds(t))
+      return false;
+
+    point3 p = r.at(t);
+    vec3 planar = p - q;
+    double alpha = dot(w, cross(planar, v));
+    double beta = dot(w, cross(u, planar));
+    if (!(alpha >= 0 && alpha <= 1 && beta >= 0 && beta <= 1))
+      return false;
+
+    record.t = t;
+    record.point = p;
+    record.u = alpha;
+    record.v = beta;
+    record.mat = mat;
+    record.light = light;
+    record.set_face_normal(r, normal);
+    return true;
+  }
+
+  const point3 &corner() const { return q; }
+  const vec3 &edge_u() const { return u; }
+  const vec3 &edge_v() const { return v; }
+  const vec3 &front_normal() const { return normal; }
+  const material *surface() const { return mat; }
+
+  // Marks hits on this quad as hits on `sampled`, its Light in the scene's light list.
+  void set_light(const Light *sampled) { light = sampled; }
+  double area() const { return cross(u, v).length(); }
+};
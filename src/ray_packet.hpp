@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+
+#include "./interval.hpp"
+#include "./ray.hpp"
+#include "./simd.hpp"
+
+// Eight rays traced together, stored structure-of-arrays so SIMD code can load one component of
+// all rays at once. Lanes outside `active` are ignored. t_max holds each lane's closest hit so far
+// and shrinks as shapes report hits.
+struct RayPacket8
+{
+  static const int size = 8;
+
+  alignas(32) double orig[3][size] = {};
+  alignas(32) double dir[3][size] = {};
+  alignas(32) double time[size] = {};
+  alignas(32) double t_max[size] = {};
+  double t_min = 0;
+  int active = 0;
+
+  void set(int lane, const ray &r, const Interval &interval)
+  {
+    for (int axis = 0; axis < 3; axis++)
+    {
+      orig[axis][lane] = r.origin()[axis];
+      dir[axis][lane] = r.direction()[axis];
+    }
+    time[lane] = r.time();
+    t_min = interval.min;
+    t_max[lane] = interval.max;
+    active |= 1 << lane;
+  }
+
+  ray lane_ray(int lane) const
+  {
+    return ray(point3(orig[0][lane], orig[1][lane], orig[2][lane]), vec3(dir[0][lane], dir[1][lane], dir[2][lane]), time[lane]);
+  }
+};
+
+// Per-packet data for box tests: every lane's inverse direction, plus the interval hull of the
+// origins and inverse directions. When all active rays agree on their direction sign per axis,
+// interval arithmetic on the hulls bounds the entry and exit distances of the whole packet, so
+// one test can reject a box for all eight rays.
+struct Packet_slabs
+{
+  alignas(32) double inv_dir[3][RayPacket8::size];
+  double orig_lo[3], orig_hi[3];
+  double inv_lo[3], inv_hi[3];
+  int dir_is_negative[3];
+  bool coherent = true;
+
+  Packet_slabs(const RayPacket8 &packet)
+  {
+    for (int axis = 0; axis < 3; axis++)
+    {
+      orig_lo[axis] = inv_lo[axis] = +infinity;
+      orig_hi[axis] = inv_hi[axis] = -infinity;
+      int negatives = 0, lanes = 0;
+      for (int lane = 0; lane < RayPacket8::size; lane++)
+      {
+        inv_dir[axis][lane] = 1.0 / packet.dir[axis][lane];
+        if (!(packet.active & (1 << lane)))
+          continue;
+        lanes++;
+        negatives += inv_dir[axis][lane] < 0;
+        orig_lo[axis] = std::min(orig_lo[axis], packet.orig[axis][lane]);
+        orig_hi[axis] = std::max(orig_hi[axis], packet.orig[axis][lane]);
+        inv_lo[axis] = std::min(inv_lo[axis], inv_dir[axis][lane]);
+        inv_hi[axis] = std::max(inv_hi[axis], inv_dir[axis][lane]);
+      }
+      dir_is_negative[axis] = negatives > 0;
+      if (negatives != 0 && negatives != lanes)
+        coherent = false;
+      if (!std::isfinite(inv_lo[axis]) || !std::isfinite(inv_hi[axis]))
+        coherent = false;
+    }
+  }
+
+  // Conservative whole-packet test: false means no active ray can hit the box within
+  // [t_min, t_max_any], where t_max_any is the largest t_max of the active lanes.
+  bool packet_may_hit(const double box_min[3], const double box_max[3], double t_min, double t_max_any) const
+  {
+    if (!coherent)
+      return true;
+
+    double enter = t_min;
+    double leave = t_max_any;
+    for (int axis = 0; axis < 3; axis++)
+    {
+      const double near_plane = dir_is_negative[axis] ? box_max[axis] : box_min[axis];
+      const double far_plane = dir_is_negative[axis] ? box_min[axis] : box_max[axis];
+
+      // Lower bound of (near_plane - o) * inv and upper bound of (far_plane - o) * inv over all
+      // o in [orig_lo, orig_hi] and inv in [inv_lo, inv_hi]. All inv share one sign, so each
+      // bound is reached at a known corner of the two intervals.
+      double near_offset = near_plane - (dir_is_negative[axis] ? orig_lo[axis] : orig_hi[axis]);
+      double far_offset = far_plane - (dir_is_negative[axis] ? orig_hi[axis] : orig_lo[axis]);
+      enter = std::max(enter, near_offset * (near_offset >= 0 ? inv_lo[axis] : inv_hi[axis]));
+      leave = std::min(leave, far_offset * (far_offset >= 0 ? inv_hi[axis] : inv_lo[axis]));
+      if (enter > leave)
+        return false;
+    }
+    return true;
+  }
+
+  // Per-lane slab test. Returns the mask of active lanes that hit the box before their t_max.
+  int hit_lanes(const double box_min[3], const double box_max[3], const RayPacket8 &packet, int active) const
+  {
+#if RT_AVX2_DISPATCH
+    if (cpu_has_avx2())
+      return hit_lanes_avx2(box_min, box_max, packet, active);
+#endif
+    int mask = 0;
+    for (int lane = 0; lane < RayPacket8::size; lane++)
+    {
+      double lo = packet.t_min;
+      double hi = packet.t_max[lane];
+      for (int axis = 0; axis < 3; axis++)
+      {
+        double t0 = (box_min[axis] - packet.orig[axis][lane]) * inv_dir[axis][lane];
+        double t1 = (box_max[axis] - packet.orig[axis][lane]) * inv_dir[axis][lane];
+        double t_near = t0 < t1 ? t0 : t1;
+        double t_far = t0 < t1 ? t1 : t0;
+        lo = t_near > lo ? t_near : lo;
+        hi = t_far < hi ? t_far : hi;
+      }
+      if (lo <= hi)
+        mask |= 1 << lane;
+    }
+    return mask & active;
+  }
+
+private:
+#if RT_AVX2_DISPATCH
+  RT_TARGET_AVX2 int hit_lanes_avx2(const double box_min[3], const double box_max[3], const RayPacket8 &packet, int active) const
+  {
+    int mask = 0;
+    for (int half = 0; half < RayPacket8::size; half += 4)
+    {
+      __m256d lo = _mm256_set1_pd(packet.t_min);
+      __m256d hi = _mm256_load_pd(packet.t_max + half);
+      for (int axis = 0; axis < 3; axis++)
+      {
+        __m256d orig = _mm256_load_pd(packet.orig[axis] + half);
+        __m256d inv = _mm256_load_pd(inv_dir[axis] + half);
+        __m256d t0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(box_min[axis]), orig), inv);
+        __m256d t1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(box_max[axis]), orig), inv);
+        // maxpd/minpd return the second operand when either is NaN (0 * inf), ignoring that axis.
+        lo = _mm256_max_pd(_mm256_min_pd(t0, t1), lo);
+        hi = _mm256_min_pd(_mm256_max_pd(t0, t1), hi);
+      }
+      mask |= _mm256_movemask_pd(_mm256_cmp_pd(lo, hi, _CMP_LE_OQ)) << half;
+    }
+    return mask & active;
+  }
+#endif
+};
@@ -93,6 +93,20 @@ public:
     return bdata + y * bytes_per_scanline + x * bytes_per_pixel;
   }
 
+  const float *float_pixel_data(int x, int y) const
+  {
+    // Return the address of the three linear RGB floats of the pixel at x,y, which are not
+    // limited to [0.0, 1.0] for HDR images. If there is no image data, returns black.
+    static float black[] = {0, 0, 0};
+    if (fdata == nullptr)
+      return black;
+
+    x = clamp(x, 0, image_width);
+    y = clamp(y, 0, image_height);
+
+    return fdata + y * bytes_per_scanline + x * bytes_per_pixel;
+  }
+
 private:
   const int bytes_per_pixel = 3;
   float *fdata = nullptr;          // Linear floating point pixel data
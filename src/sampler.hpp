@@ -0,0 +1,323 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "./utils.hpp"
+
+// Where the random numbers of a render come from.
+enum class Sampler_type
+{
+  independent,  // Uniform PCG32 numbers
+  stratified,   // One jittered stratum per sample, in shuffled order
+  sobol,        // Owen-scrambled Sobol (0,2)-sequence, decorrelated between dimensions
+  halton,       // Owen-scrambled Halton, with a prime base per dimension
+};
+
+namespace sampler_detail
+{
+inline double to_unit(uint32_t bits) { return bits * 0x1p-32; }
+
+inline uint32_t reverse_bits(uint32_t x)
+{
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+  x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+  x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+  x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+  return x;
+}
+
+// A hash of x in which each bit depends only on the bits below it (Laine and Karras). On a
+// bit-reversed value that is Owen scrambling: a random flip at every node of the binary tree.
+inline uint32_t laine_karras(uint32_t x, uint32_t seed)
+{
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return x;
+}
+
+// Sobol dimension 1 with its bits reversed, by bytes of the index: bit k of the index contributes
+// direction k, which for this dimension is the previous one XORed with itself shifted by one.
+struct Sobol_table
+{
+  uint32_t bytes[4][256] = {};
+};
+
+constexpr Sobol_table make_sobol_table()
+{
+  Sobol_table table;
+  uint32_t directions[32] = {};
+  directions[0] = 1;
+  for (int k = 1; k < 32; k++)
+    directions[k] = directions[k - 1] ^ (directions[k - 1] << 1);
+  for (int byte = 0; byte < 4; byte++)
+    for (int value = 0; value < 256; value++)
+      for (int bit = 0; bit < 8; bit++)
+        if (value & (1 << bit))
+          table.bytes[byte][value] ^= directions[8 * byte + bit];
+  return table;
+}
+
+inline constexpr Sobol_table sobol_table = make_sobol_table();
+
+// Point `index` of the first two Sobol dimensions, Owen-scrambled, after shuffling the index
+// with an Owen scramble too (Burley, "Practical Hash-based Owen Scrambling", 2020). The shuffle
+// keeps each power-of-two prefix of the sequence the same set of points, so it decorrelates
+// dimensions without losing their stratification. Values are 32-bit fractions; y may be null.
+inline void owen_sobol(uint32_t index, uint64_t seed, uint32_t &x, uint32_t *y)
+{
+  // The shuffled index, and bit-reversed: Sobol dimension 0 (van der Corput) before scrambling.
+  uint32_t reversed = laine_karras(reverse_bits(index), uint32_t(seed));
+  uint32_t shuffled = reverse_bits(reversed);
+  x = reverse_bits(laine_karras(shuffled, uint32_t(seed >> 32)));
+  if (!y)
+    return;
+
+  // Dimension 1, built bit-reversed so it can be scrambled directly.
+  const auto &t = sobol_table.bytes;
+  uint32_t v = t[0][shuffled & 0xff] ^ t[1][(shuffled >> 8) & 0xff] ^ t[2][(shuffled >> 16) & 0xff] ^ t[3][shuffled >> 24];
+  *y = reverse_bits(laine_karras(v, uint32_t(mix_bits(seed))));
+}
+
+// Element i of a pseudo-random permutation of [0, l) chosen by p (Kensler, "Correlated
+// Multi-Jittered Sampling", 2013).
+inline uint32_t permute(uint32_t i, uint32_t l, uint32_t p)
+{
+  uint32_t w = l - 1;
+  w |= w >> 1;
+  w |= w >> 2;
+  w |= w >> 4;
+  w |= w >> 8;
+  w |= w >> 16;
+  do
+  {
+    i ^= p;
+    i *= 0xe170893du;
+    i ^= p >> 16;
+    i ^= (i & w) >> 4;
+    i ^= p >> 8;
+    i *= 0x0929eb3fu;
+    i ^= p >> 23;
+    i ^= (i & w) >> 1;
+    i *= 1 | p >> 27;
+    i *= 0x6935fa69u;
+    i ^= (i & w) >> 11;
+    i *= 0x74dcb303u;
+    i ^= (i & w) >> 2;
+    i *= 0x9e501cc3u;
+    i ^= (i & w) >> 2;
+    i *= 0xc860a3dfu;
+    i &= w;
+    i ^= i >> 5;
+  } while (i >= l);
+  return (i + p) % l;
+}
+
+// The radical inverse of index in `base`, with every digit permuted by a hash of the digits above
+// it, which is Owen scrambling in that base. Once the digits so far tell all
+// `count` indices of a pixel apart, the remaining scrambled digits are uniformly random given
+// them, so that tail is drawn in one go.
+inline double owen_radical_inverse(uint32_t base, uint32_t index, uint64_t seed, uint32_t count)
+{
+  double inverse_base = 1.0 / base, weight = 1;
+  double result = 0;
+  uint64_t node = mix_bits(seed);  // Identifies the digits so far
+  while (index > 0 || weight * count > 1)
+  {
+    uint32_t value = permute(index % base, base, uint32_t(node));
+    index /= base;
+    node = mix_bits(node ^ (uint64_t(value) + 1) * 0x9e3779b97f4a7c15ULL);
+    weight *= inverse_base;
+    result += value * weight;
+  }
+  result += weight * to_unit(uint32_t(node >> 32));
+  return std::fmin(result, 1 - 0x1p-53);
+}
+
+// The n-th prime, for the Halton base of dimension n.
+inline uint32_t prime(uint32_t n)
+{
+  static const std::vector<uint32_t> primes = []
+  {
+    std::vector<uint32_t> list;
+    for (uint32_t candidate = 2; list.size() < 1024; candidate++)
+    {
+      bool is_prime = true;
+      for (uint32_t p : list)
+      {
+        if (p * p > candidate)
+          break;
+        if (candidate % p == 0)
+        {
+          is_prime = false;
+          break;
+        }
+      }
+      if (is_prime)
+        list.push_back(candidate);
+    }
+    return list;
+  }();
+  return primes[n % primes.size()];
+}
+}  // namespace sampler_detail
+
+// The random numbers of one pixel sample, handed out by dimension. The camera ray takes the first
+// few dimensions; each bounce then starts a fixed block of its own, so a given use (the light
+// picked at the second bounce, say) sees the same dimension in every sample of the pixel, which
+// is what lets stratified and low-discrepancy points pay off. Numbers a bounce draws past its
+// block, and everything the independent type draws, come from a PCG32 stream.
+//
+// A sampler is a small value: each thread works on its own, and a path can carry its sampler along
+// to continue later. Its numbers depend only on (type, pixel, sample, frame), as seed_random's do.
+class Sampler
+{
+public:
+  static constexpr uint32_t camera_dimensions = 5;  // Pixel position (2), lens (2), time (1)
+  static constexpr uint32_t bounce_dimensions = 8;  // Light choice (1) and point (2), scattering, roulette
+
+  Sampler() {}
+
+  // Starts sample `sample` of `pixel`; `samples` is the pixel's sample count, which the
+  // stratified and Halton types lay their strata out for, so it must stay fixed for a pixel.
+  void start(Sampler_type kind, uint64_t pixel, uint64_t sample, uint64_t frame, uint64_t samples)
+  {
+    type = kind;
+    rng.set_sequence(mix_bits(sample ^ mix_bits(frame)), mix_bits(pixel));
+    seed = mix_bits(pixel ^ mix_bits(frame ^ 0x5a3b1e2c9d4f6071ULL));
+    index = uint32_t(sample);
+    count = uint32_t(samples > 0 ? samples : 1);
+    dimension = 0;
+    end = camera_dimensions;
+  }
+
+  // Moves on to the dimensions of bounce `depth`, counting the camera ray's first hit as 0.
+  void start_bounce(size_t depth)
+  {
+    dimension = camera_dimensions + uint32_t(depth) * bounce_dimensions;
+    end = dimension + bounce_dimensions;
+  }
+
+  // Returns a real in [0,1).
+  double next_1d()
+  {
+    if (type == Sampler_type::independent || dimension >= end)
+      return rng.next_double();
+    return sample_1d(dimension++);
+  }
+
+  // Sets a and b to a point in [0,1)^2, stratified jointly where the type allows.
+  void next_2d(double &a, double &b)
+  {
+    if (type == Sampler_type::independent || dimension + 2 > end)
+    {
+      a = rng.next_double();
+      b = rng.next_double();
+      return;
+    }
+    sample_2d(dimension, a, b);
+    dimension += 2;
+  }
+
+private:
+  Sampler_type type = Sampler_type::independent;
+  Rng rng;
+  uint64_t seed = 0;
+  uint32_t index = 0;
+  uint32_t count = 1;
+  uint32_t dimension = 0;
+  uint32_t end = 0;
+
+  // Seed for everything drawn for dimension d of this pixel.
+  uint64_t dimension_seed(uint32_t d) const { return mix_bits(seed ^ d); }
+
+  double sample_1d(uint32_t d) const
+  {
+    using namespace sampler_detail;
+    uint64_t h = dimension_seed(d);
+    switch (type)
+    {
+    case Sampler_type::stratified:
+    {
+      uint32_t round = index / count;
+      uint32_t stratum = permute(index % count, count, uint32_t(h) ^ round);
+      return (stratum + jitter(h)) / count;
+    }
+    case Sampler_type::sobol:
+    {
+      uint32_t x;
+      owen_sobol(index, h, x, nullptr);
+      return to_unit(x);
+    }
+    case Sampler_type::halton:
+      return owen_radical_inverse(prime(d), index, h, count);
+    default:
+      return 0;
+    }
+  }
+
+  void sample_2d(uint32_t d, double &a, double &b) const
+  {
+    using namespace sampler_detail;
+    uint64_t h = dimension_seed(d);
+    switch (type)
+    {
+    case Sampler_type::stratified:
+    {
+      // A square grid with at least `count` cells; each sample takes a different one.
+      auto side = uint32_t(std::ceil(std::sqrt(double(count))));
+      uint32_t round = index / count;
+      uint32_t cell = permute(index % count, side * side, uint32_t(h) ^ round);
+      a = (cell % side + jitter(h)) / side;
+      b = (cell / side + jitter(mix_bits(h))) / side;
+      break;
+    }
+    case Sampler_type::sobol:
+    {
+      uint32_t x, y;
+      owen_sobol(index, h, x, &y);
+      a = to_unit(x);
+      b = to_unit(y);
+      break;
+    }
+    case Sampler_type::halton:
+      a = owen_radical_inverse(prime(d), index, h, count);
+      b = owen_radical_inverse(prime(d + 1), index, dimension_seed(d + 1), count);
+      break;
+    default:
+      a = b = 0;
+    }
+  }
+
+  // Offset within a stratum.
+  double jitter(uint64_t h) const { return sampler_detail::to_unit(uint32_t(mix_bits(h ^ index) >> 32)); }
+};
+
+// Every thread draws from its own sampler, so there is no shared state to lock.
+inline thread_local Sampler thread_sampler;
+
+// Restarts the calling thread's sampler at a point that depends only on (pixel, sample, frame). A
+// pixel sample then sees the same random numbers whichever thread renders it.
+inline void seed_random(uint64_t pixel, uint64_t sample, uint64_t frame = 0,
+                        Sampler_type type = Sampler_type::independent, uint64_t samples = 1)
+{
+  thread_sampler.start(type, pixel, sample, frame, samples);
+}
+
+// Returns a random real in [0,1).
+inline double random_double() { return thread_sampler.next_1d(); }
+
+// Returns a random real in [min,max).
+inline double random_double(double min, double max) { return min + (max - min) * random_double(); }
+
+// Returns a random integer in [min,max].
+inline int random_int(int min, int max) { return int(random_double(min, max + 1)); }
+
+// Sets a and b to a random point in [0,1)^2; the two are drawn together so that a low-discrepancy
+// sampler can spread the points out in both.
+inline void random_pair(double &a, double &b) { thread_sampler.next_2d(a, b); }
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <typeindex>
+#include <unordered_map>
+#include <utility>
+
+#include "./arena.hpp"
+#include "./light.hpp"
+#include "./material.hpp"
+#include "./shape.hpp"
+#include "./texture.hpp"
+#include "./world.hpp"
+
+// Owns every shape, material, texture and light of a scene. Everything else (hit records, lists,
+// BVH leaves, materials referring to textures) holds plain pointers into the scene, which stay
+// valid for its lifetime, so nothing on the render path touches a reference count.
+//
+// Objects live in arenas, one per concrete type: the thousands of spheres or instances of a large
+// scene are packed back to back instead of scattered across the heap, and the whole scene is
+// freed block by block when it goes away.
+class Scene
+{
+  std::unordered_map<std::type_index, std::unique_ptr<Arena>> pools;
+
+public:
+  hittable_list world;  // Top-level shapes to render
+  Light_list lights;    // Emitters also sampled directly; their shapes are in the world as well
+  uint64_t hash = 0;    // Identifies what the scene was loaded from, so checkpoints match scenes
+
+  Scene() {}
+  Scene(const Scene &) = delete;
+  Scene &operator=(const Scene &) = delete;
+
+  // Constructs a T owned by the scene and returns a pointer to it.
+  template <typename T, typename... Args>
+  T *make(Args &&...args)
+  {
+    static_assert(std::is_base_of_v<Shape, T> || std::is_base_of_v<material, T> || std::is_base_of_v<Texture, T> ||
+                      std::is_base_of_v<Light, T>,
+                  "Scene only owns shapes, materials, textures and lights");
+    return pool<T>().template make<T>(std::forward<Args>(args)...);
+  }
+
+  // Frees every object and empties the lists, leaving a scene to load into again.
+  void clear()
+  {
+    world.clear();
+    lights = Light_list();
+    hash = 0;
+    pools.clear();
+  }
+
+  // Bytes of scene objects held in the arenas.
+  size_t memory_used() const
+  {
+    size_t total = 0;
+    for (const auto &entry : pools)
+      total += entry.second->used();
+    return total;
+  }
+
+private:
+  template <typename T>
+  Arena &pool()
+  {
+    auto &arena = pools[std::type_index(typeid(T))];
+    if (!arena)
+      arena = std::make_unique<Arena>();
+    return *arena;
+  }
+};
@@ -0,0 +1,951 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "./binary_io.hpp"
+#include "./bvh_node.hpp"
+#include "./environment.hpp"
+#include "./camera.hpp"
+#include "./instance.hpp"
+#include "./light.hpp"
+#include "./mapped_file.hpp"
+#include "./material.hpp"
+#include "./mesh_loader.hpp"
+#include "./quad.hpp"
+#include "./scene.hpp"
+#include "./sphere_set.hpp"
+#include "./texture.hpp"
+#include "./transform.hpp"
+#include "./triangle_mesh.hpp"
+
+// Scene description files. One statement per line, words separated by blanks, '#' starts a
+// comment. Names must be declared before they are used.
+//
+//   camera <key> <value...> ...     keys: width, aspect, spp, depth, vfov, from x y z, at x y z,
+//                                   up x y z, defocus, focus, background r g b (instead of the sky)
+//   texture <name> solid r g b
+//   texture <name> checker <scale> r g b r g b
+//   texture <name> checker <scale> <even texture> <odd texture>
+//   texture <name> image <path>
+//   texture <name> noise
+//   material <name> lambertian r g b
+//   material <name> lambertian <texture>
+//   material <name> metal r g b <fuzz>
+//   material <name> dielectric <index>
+//   material <name> emissive r g b
+//   material <name> emissive <texture>
+//   sphere <material> x y z <radius>
+//   moving_sphere <material> x y z x2 y2 z2 <radius>
+//   quad <material> x y z ux uy uz vx vy vz   corner and two edges; emits toward cross(u, v)
+//   environment <path> [scale]      equirectangular (HDR) image around the scene, in place of the sky
+//   mesh <name> <path> <material>   an OBJ or PLY prototype
+//   group <name> ... end            the spheres in between form a prototype
+//   object <prototype>              place a prototype as is
+//   instance <prototype> <op>...    place a copy; ops apply in order: translate x y z,
+//                                   rotate ax ay az <degrees>, scale s, scale x y z
+//
+// Paths are relative to the scene file. Top-level spheres go into one SphereSet, and everything
+// placed (that set, objects, instances, quads) sits under one top-level bvh_node. Top-level quads
+// and stationary spheres with an emissive material are lights: they stay out of the SphereSet and
+// are also added to the scene's light list, to be sampled directly. Emissive spheres in groups
+// still glow, but are only found by scattering. An environment image is sampled as a light too.
+//
+// The parser makes one pass over the memory-mapped text. Numbers are read with from_chars and
+// names are views into the text, so bulk statements (spheres, instances) allocate nothing per
+// line. After a parse, the built geometry is written to "<scene>.cache": the sphere and mesh
+// arrays in BVH order together with their BVHs, the instance transforms, and the few statements
+// that are replayed from text, verbatim. While the scene file and the meshes it uses are
+// unchanged, later loads map the cache and copy those arrays in, without parsing or building the
+// bottom-level BVHs.
+
+namespace scene_file_detail
+{
+  const uint32_t cache_magic = 0x43535452;  // "RTSC"
+  const uint32_t cache_version = 2;
+
+  // Size and modification time; a cache is stale when either differs.
+  struct File_stamp
+  {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+
+    bool operator==(const File_stamp &other) const { return size == other.size && mtime == other.mtime; }
+  };
+
+  inline bool file_stamp(const std::string &path, File_stamp &stamp)
+  {
+    std::error_code error;
+    auto size = std::filesystem::file_size(path, error);
+    if (error)
+      return false;
+    auto time = std::filesystem::last_write_time(path, error);
+    if (error)
+      return false;
+    stamp.size = uint64_t(size);
+    stamp.mtime = int64_t(time.time_since_epoch().count());
+    return true;
+  }
+
+  // Hash of a file's contents, or 0 if it cannot be read.
+  inline uint64_t file_hash(const std::string &path)
+  {
+    Mapped_file file(path);
+    return file.good() ? hash_bytes(file.data(), file.size()) : 0;
+  }
+
+  struct Instance_record
+  {
+    uint32_t prototype;
+    Transform object_to_world;
+  };
+
+  // A cursor over one line of text.
+  class Line
+  {
+  public:
+    Line(const char *p, const char *end) : p(p), end(end) {}
+
+    // Next blank-separated word; false at the end of the line or at a comment.
+    bool word(std::string_view &w)
+    {
+      skip_blanks();
+      if (p == end || *p == '#')
+        return false;
+      const char *start = p;
+      while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+        p++;
+      w = std::string_view(start, size_t(p - start));
+      return true;
+    }
+
+    bool number(double &value)
+    {
+      skip_blanks();
+      const char *start = p < end && *p == '+' ? p + 1 : p;
+      auto result = std::from_chars(start, end, value);
+      if (result.ec != std::errc() || (result.ptr < end && !is_blank(*result.ptr)))
+        return false;
+      p = result.ptr;
+      return true;
+    }
+
+    bool numbers(double *values, int count)
+    {
+      for (int k = 0; k < count; k++)
+        if (!number(values[k]))
+          return false;
+      return true;
+    }
+
+    // True if the next word reads as a number, without consuming it.
+    bool number_follows()
+    {
+      const char *saved = p;
+      double ignored;
+      bool found = number(ignored);
+      p = saved;
+      return found;
+    }
+
+    bool at_end()
+    {
+      skip_blanks();
+      return p == end || *p == '#';
+    }
+
+  private:
+    const char *p;
+    const char *end;
+
+    static bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+    void skip_blanks()
+    {
+      while (p < end && is_blank(*p))
+        p++;
+    }
+  };
+}  // namespace scene_file_detail
+
+class Scene_loader
+{
+public:
+  Scene_loader(Scene &scene, Camera &cam, const Bvh_build_options &bvh = Bvh_build_options())
+      : scene(scene), cam(cam), bvh(bvh)
+  {
+  }
+
+  // Loads `path` into the scene and camera, from its cache when one is current. A damaged cache
+  // is only a derived file, so the scene text is parsed instead and the cache written again.
+  // Returns false (after an ERROR line on stderr) if the file cannot be read or has a malformed
+  // statement.
+  bool load(const std::string &path, bool use_cache = true)
+  {
+    set_paths(path);
+    // The cache holds hierarchies built with the default split; another one is built afresh.
+    if (bvh.split != Bvh_build_options().split)
+      use_cache = false;
+
+    if (use_cache)
+    {
+      Camera settings = cam;  // Before the cache's camera statements
+      Cache_result cached = load_cache();
+      if (cached == Cache_result::loaded)
+      {
+        set_scene_hash();
+        return true;
+      }
+      if (cached == Cache_result::damaged)
+      {
+        std::cerr << "WARNING: Scene cache '" << cache_path << "' is damaged; loading the scene instead.\n";
+        scene.clear();
+        cam = settings;
+        return Scene_loader(scene, cam, bvh).parse_scene(path, true);
+      }
+    }
+    return parse_scene(path, use_cache);
+  }
+
+private:
+  void set_paths(const std::string &path)
+  {
+    scene_path = path;
+    base_dir = std::filesystem::path(path).parent_path();
+    cache_path = path + ".cache";
+  }
+
+  // Loads from the scene text, then writes the cache if asked to.
+  bool parse_scene(const std::string &path, bool write)
+  {
+    set_paths(path);
+    Mapped_file file(path);
+    if (!file.good())
+    {
+      std::cerr << "ERROR: Could not load scene file '" << path << "'.\n";
+      return false;
+    }
+    source_name = path;
+    source_hash = hash_bytes(file.data(), file.size());
+    if (!parse(file.begin(), file.end(), false))
+      return false;
+    if (!finish(false))
+      return false;
+    if (write)
+      write_cache();
+    set_scene_hash();
+    return true;
+  }
+
+  using Line = scene_file_detail::Line;
+  using File_stamp = scene_file_detail::File_stamp;
+  using Instance_record = scene_file_detail::Instance_record;
+
+  // Spheres being collected into one SphereSet, with the set's material IDs by material.
+  struct Sphere_group
+  {
+    SphereSet *set = nullptr;
+    std::unordered_map<const material *, uint32_t> ids;
+    std::vector<std::string> material_names;  // In ID order, for the cache
+  };
+
+  enum class Cache_result
+  {
+    missing,  // No cache, or a stale one: parse the text
+    loaded,
+    damaged,  // Current but unreadable; the scene is half filled in and must be cleared
+  };
+
+  struct Dependency
+  {
+    std::string path;
+    File_stamp stamp;
+  };
+
+  Scene &scene;
+  Camera &cam;
+  Bvh_build_options bvh;
+  std::string scene_path;
+  std::filesystem::path base_dir;
+  std::string cache_path;
+  std::string source_name;  // For error messages
+  size_t line_number = 0;
+  uint64_t source_hash = 0;  // Scene text and meshes; kept in the cache
+  uint64_t image_hash = 0;   // Image textures, which are read again on every load
+
+  std::unordered_map<std::string_view, const Texture *> textures;
+  std::unordered_map<std::string_view, const material *> materials;
+  std::unordered_set<const material *> emitters;
+  std::unordered_map<std::string_view, uint32_t> prototype_ids;
+  std::vector<const Shape *> prototypes;
+  std::vector<const Shape *> objects;
+  std::vector<const Shape *> instances;
+
+  Sphere_group top;
+  Sphere_group group;
+  std::string_view group_name;
+  bool in_group = false;
+  bool keep_line = false;  // Set by a statement that must be replayed from the cache's text
+  Environment_light *environment = nullptr;
+
+  // What goes into the cache: replayed statements verbatim, then the bulk geometry in order.
+  std::string replayed_text;
+  std::vector<Dependency> dependencies;
+  std::vector<const Sphere_group *> cached_groups;
+  std::vector<Sphere_group> finished_groups;
+  std::vector<const TriangleMesh *> meshes;
+  std::vector<Instance_record> instance_records;
+  Binary_reader *cache_in = nullptr;  // Set while loading from the cache
+
+  void set_scene_hash() { scene.hash = mix_bits(source_hash ^ mix_bits(image_hash)); }
+
+  // Errors in a cache are reported once, by load(), as the cache being damaged.
+  bool fail(const std::string &what)
+  {
+    if (!cache_in)
+      std::cerr << "ERROR: " << what << " on line " << line_number << " of '" << source_name << "'.\n";
+    return false;
+  }
+
+  std::string resolve(std::string_view name) const
+  {
+    std::filesystem::path relative = base_dir / std::filesystem::path(std::string(name));
+    std::error_code error;
+    if (!base_dir.empty() && std::filesystem::exists(relative, error))
+      return relative.string();
+    return std::string(name);
+  }
+
+  bool parse(const char *p, const char *end, bool from_cache)
+  {
+    line_number = 0;
+    while (p < end)
+    {
+      const char *line_end = static_cast<const char *>(std::memchr(p, '\n', size_t(end - p)));
+      if (!line_end)
+        line_end = end;
+      line_number++;
+
+      Line line(p, line_end);
+      std::string_view keyword;
+      keep_line = false;
+      if (line.word(keyword) && !statement(keyword, line, from_cache))
+        return false;
+      if (!from_cache && (is_replayed_statement(keyword) || keep_line))
+        replayed_text.append(p, line_end).push_back('\n');
+      p = line_end < end ? line_end + 1 : end;
+    }
+    if (in_group)
+      return fail("Missing 'end' for group '" + std::string(group_name) + "'");
+    return true;
+  }
+
+  // Statements kept verbatim in the cache and parsed again when it is loaded.
+  static bool is_replayed_statement(std::string_view keyword)
+  {
+    return keyword == "camera" || keyword == "texture" || keyword == "material" || keyword == "mesh" ||
+           keyword == "group" || keyword == "end" || keyword == "object" || keyword == "quad" ||
+           keyword == "environment";
+  }
+
+  bool statement(std::string_view keyword, Line &line, bool from_cache)
+  {
+    if (keyword == "sphere" || keyword == "moving_sphere")
+      return sphere(line, keyword == "moving_sphere");
+    if (keyword == "instance")
+      return instance(line);
+    if (keyword == "quad")
+      return quad(line);
+    if (keyword == "environment")
+      return environment_map(line);
+    if (keyword == "camera")
+      return camera(line);
+    if (keyword == "texture")
+      return texture(line);
+    if (keyword == "material")
+      return material_statement(line);
+    if (keyword == "mesh")
+      return mesh(line, from_cache);
+    if (keyword == "group")
+      return begin_group(line);
+    if (keyword == "end")
+      return end_group(line, from_cache);
+    if (keyword == "object")
+      return object(line);
+    return fail("Unknown statement '" + std::string(keyword) + "'");
+  }
+
+  bool camera(Line &line)
+  {
+    std::string_view key;
+    while (line.word(key))
+    {
+      double v[3];
+      bool ok;
+      if (key == "from" || key == "at" || key == "up" || key == "background")
+      {
+        ok = line.numbers(v, 3);
+        vec3 value(v[0], v[1], v[2]);
+        if (key == "from")
+          cam.lookfrom = value;
+        else if (key == "at")
+          cam.lookat = value;
+        else if (key == "up")
+          cam.vup = value;
+        else
+        {
+          cam.use_sky = false;
+          cam.background_color = value;
+        }
+      }
+      else
+      {
+        ok = line.number(v[0]);
+        if (key == "width")
+          cam.image_width = int(v[0]);
+        else if (key == "aspect")
+          cam.aspect_ratio = v[0];
+        else if (key == "spp")
+          cam.samples_per_pixel = int(v[0]);
+        else if (key == "depth")
+          cam.max_depth = int(v[0]);
+        else if (key == "vfov")
+          cam.vfov = v[0];
+        else if (key == "defocus")
+          cam.defocus_angle = v[0];
+        else if (key == "focus")
+          cam.focus_dist = v[0];
+        else
+          return fail("Unknown camera setting '" + std::string(key) + "'");
+      }
+      if (!ok)
+        return fail("Bad value for camera setting '" + std::string(key) + "'");
+    }
+    return true;
+  }
+
+  bool texture(Line &line)
+  {
+    std::string_view name, kind;
+    if (!line.word(name) || !line.word(kind))
+      return fail("Expected 'texture <name> <kind> ...'");
+
+    const Texture *tex = nullptr;
+    double v[7];
+    if (kind == "solid")
+    {
+      if (!line.numbers(v, 3))
+        return fail("Expected 'texture <name> solid r g b'");
+      tex = scene.make<solid_color>(color(v[0], v[1], v[2]));
+    }
+    else if (kind == "checker")
+    {
+      if (!line.number(v[0]))
+        return fail("Expected a checker scale");
+      if (line.number_follows())
+      {
+        if (!line.numbers(v + 1, 6))
+          return fail("Expected two checker colors");
+        tex = scene.make<Checker_texture>(v[0], scene.make<solid_color>(color(v[1], v[2], v[3])),
+                                          scene.make<solid_color>(color(v[4], v[5], v[6])));
+      }
+      else
+      {
+        std::string_view even, odd;
+        if (!line.word(even) || !line.word(odd) || !textures.count(even) || !textures.count(odd))
+          return fail("Expected two declared checker textures");
+        tex = scene.make<Checker_texture>(v[0], textures[even], textures[odd]);
+      }
+    }
+    else if (kind == "image")
+    {
+      std::string_view file;
+      if (!line.word(file))
+        return fail("Expected an image path");
+      std::string image_path = resolve(file);
+      image_hash = mix_bits(image_hash ^ scene_file_detail::file_hash(image_path));
+      tex = scene.make<Image_texture>(image_path.c_str());
+    }
+    else if (kind == "noise")
+    {
+      tex = scene.make<Noise_texture>();
+    }
+    else
+    {
+      return fail("Unknown texture kind '" + std::string(kind) + "'");
+    }
+
+    textures[name] = tex;
+    return line.at_end() || fail("Unexpected words after texture");
+  }
+
+  bool material_statement(Line &line)
+  {
+    std::string_view name, kind;
+    if (!line.word(name) || !line.word(kind))
+      return fail("Expected 'material <name> <kind> ...'");
+
+    const material *mat = nullptr;
+    double v[4];
+    if (kind == "lambertian")
+    {
+      if (line.number_follows())
+      {
+        if (!line.numbers(v, 3))
+          return fail("Expected 'lambertian r g b'");
+        mat = scene.make<Lambertian>(scene.make<solid_color>(color(v[0], v[1], v[2])));
+      }
+      else
+      {
+        std::string_view tex;
+        if (!line.word(tex) || !textures.count(tex))
+          return fail("Expected a declared texture");
+        mat = scene.make<Lambertian>(textures[tex]);
+      }
+    }
+    else if (kind == "metal")
+    {
+      if (!line.numbers(v, 4))
+        return fail("Expected 'metal r g b fuzz'");
+      mat = scene.make<metal>(color(v[0], v[1], v[2]), v[3]);
+    }
+    else if (kind == "dielectric")
+    {
+      if (!line.number(v[0]))
+        return fail("Expected 'dielectric index'");
+      mat = scene.make<dielectric>(v[0]);
+    }
+    else if (kind == "emissive")
+    {
+      if (line.number_follows())
+      {
+        if (!line.numbers(v, 3))
+          return fail("Expected 'emissive r g b'");
+        mat = scene.make<Diffuse_light>(scene.make<solid_color>(color(v[0], v[1], v[2])));
+      }
+      else
+      {
+        std::string_view tex;
+        if (!line.word(tex) || !textures.count(tex))
+          return fail("Expected a declared texture");
+        mat = scene.make<Diffuse_light>(textures[tex]);
+      }
+      emitters.insert(mat);
+    }
+    else
+    {
+      return fail("Unknown material kind '" + std::string(kind) + "'");
+    }
+
+    materials[name] = mat;
+    return line.at_end() || fail("Unexpected words after material");
+  }
+
+  bool sphere(Line &line, bool moving)
+  {
+    std::string_view name;
+    double v[7];
+    int count = moving ? 7 : 4;
+    if (!line.word(name) || !line.numbers(v, count) || !line.at_end())
+      return fail(moving ? "Expected 'moving_sphere <material> x y z x2 y2 z2 radius'" : "Expected 'sphere <material> x y z radius'");
+
+    auto found = materials.find(name);
+    if (found == materials.end())
+      return fail("Unknown material '" + std::string(name) + "'");
+
+    if (!in_group && emitters.count(found->second))
+    {
+      // A light: its own Sphere, placed with the objects, and replayed from the cache's text.
+      point3 center(v[0], v[1], v[2]);
+      if (moving)
+        objects.push_back(scene.make<Sphere>(center, point3(v[3], v[4], v[5]), v[6], found->second));
+      else
+      {
+        auto shape = scene.make<Sphere>(center, v[3], found->second);
+        auto light = scene.make<Sphere_light>(center, v[3], found->second);
+        shape->set_light(light);
+        objects.push_back(shape);
+        scene.lights.add(light);
+      }
+      keep_line = true;
+      return true;
+    }
+
+    Sphere_group &target = in_group ? group : top;
+    if (!target.set)
+      target.set = scene.make<SphereSet>();
+    auto id = target.ids.find(found->second);
+    if (id == target.ids.end())
+    {
+      id = target.ids.emplace(found->second, target.set->add_material(found->second)).first;
+      target.material_names.emplace_back(name);
+    }
+
+    if (moving)
+      target.set->add(point3(v[0], v[1], v[2]), point3(v[3], v[4], v[5]), v[6], id->second);
+    else
+      target.set->add(point3(v[0], v[1], v[2]), v[3], id->second);
+    return true;
+  }
+
+  bool quad(Line &line)
+  {
+    std::string_view name;
+    double v[9];
+    if (!line.word(name) || !line.numbers(v, 9) || !line.at_end())
+      return fail("Expected 'quad <material> x y z ux uy uz vx vy vz'");
+    if (in_group)
+      return fail("Groups can only hold spheres");
+    auto found = materials.find(name);
+    if (found == materials.end())
+      return fail("Unknown material '" + std::string(name) + "'");
+
+    auto shape = scene.make<Quad>(point3(v[0], v[1], v[2]), vec3(v[3], v[4], v[5]), vec3(v[6], v[7], v[8]), found->second);
+    if (!(shape->area() > 0))
+      return fail("A quad needs two independent edges");
+    objects.push_back(shape);
+    if (emitters.count(found->second))
+    {
+      auto light = scene.make<Quad_light>(*shape);
+      shape->set_light(light);
+      scene.lights.add(light);
+    }
+    return true;
+  }
+
+  bool environment_map(Line &line)
+  {
+    std::string_view file;
+    double scale = 1;
+    if (!line.word(file) || (line.number_follows() && !line.number(scale)) || !line.at_end())
+      return fail("Expected 'environment <path> [scale]'");
+    if (environment)
+      return fail("A scene has at most one environment");
+
+    std::string image_path = resolve(file);
+    image_hash = mix_bits(image_hash ^ scene_file_detail::file_hash(image_path));
+    environment = scene.make<Environment_light>(image_path.c_str(), scale);
+    if (!environment->loaded())
+      return fail("Could not load environment image '" + image_path + "'");
+    cam.environment = environment;
+    return true;
+  }
+
+  bool prototype(Line &line, uint32_t &id)
+  {
+    std::string_view name;
+    if (!line.word(name))
+      return fail("Expected a prototype name");
+    auto found = prototype_ids.find(name);
+    if (found == prototype_ids.end())
+      return fail("Unknown prototype '" + std::string(name) + "'");
+    id = found->second;
+    return true;
+  }
+
+  bool instance(Line &line)
+  {
+    uint32_t id;
+    if (!prototype(line, id))
+      return false;
+
+    Transform object_to_world;
+    std::string_view op;
+    while (line.word(op))
+    {
+      double v[4];
+      if (op == "translate" && line.numbers(v, 3))
+        object_to_world = Transform::translate(vec3(v[0], v[1], v[2])) * object_to_world;
+      else if (op == "rotate" && line.numbers(v, 4))
+        object_to_world = Transform::rotate(vec3(v[0], v[1], v[2]), v[3]) * object_to_world;
+      else if (op == "scale" && line.number(v[0]))
+      {
+        vec3 factors(v[0], v[0], v[0]);
+        if (line.number_follows())
+        {
+          if (!line.numbers(v + 1, 2))
+            return fail("Expected 'scale s' or 'scale x y z'");
+          factors = vec3(v[0], v[1], v[2]);
+        }
+        object_to_world = Transform::scale(factors) * object_to_world;
+      }
+      else
+        return fail("Bad instance transform '" + std::string(op) + "'");
+    }
+
+    place_instance({id, object_to_world});
+    return true;
+  }
+
+  void place_instance(const Instance_record &record)
+  {
+    instances.push_back(scene.make<Instance>(prototypes[record.prototype], record.object_to_world));
+    instance_records.push_back(record);
+  }
+
+  bool object(Line &line)
+  {
+    uint32_t id;
+    if (!prototype(line, id))
+      return false;
+    objects.push_back(prototypes[id]);
+    return line.at_end() || fail("Unexpected words after object");
+  }
+
+  bool add_prototype(std::string_view name, const Shape *shape)
+  {
+    if (prototype_ids.count(name))
+      return fail("Prototype '" + std::string(name) + "' is already declared");
+    prototype_ids[name] = uint32_t(prototypes.size());
+    prototypes.push_back(shape);
+    return true;
+  }
+
+  bool mesh(Line &line, bool from_cache)
+  {
+    std::string_view name, file, mat_name;
+    if (!line.word(name) || !line.word(file) || !line.word(mat_name) || !line.at_end())
+      return fail("Expected 'mesh <name> <path> <material>'");
+    auto mat = materials.find(mat_name);
+    if (mat == materials.end())
+      return fail("Unknown material '" + std::string(mat_name) + "'");
+
+    auto shape = scene.make<TriangleMesh>(mat->second);
+    if (from_cache)
+    {
+      if (!shape->load(*cache_in, bvh))
+        return fail("Truncated cache");
+    }
+    else
+    {
+      std::string mesh_path = resolve(file);
+      if (!load_mesh(mesh_path, *shape))
+        return fail("Could not load mesh '" + std::string(file) + "'");
+      shape->build(bvh);
+
+      Dependency dependency{mesh_path, {}};
+      scene_file_detail::file_stamp(mesh_path, dependency.stamp);
+      dependencies.push_back(dependency);
+      source_hash = mix_bits(source_hash ^ scene_file_detail::file_hash(mesh_path));
+      meshes.push_back(shape);
+    }
+    return add_prototype(name, shape);
+  }
+
+  bool begin_group(Line &line)
+  {
+    if (in_group)
+      return fail("Groups cannot be nested");
+    if (!line.word(group_name) || !line.at_end())
+      return fail("Expected 'group <name>'");
+    in_group = true;
+    group = Sphere_group();
+    group.set = scene.make<SphereSet>();
+    return true;
+  }
+
+  bool end_group(Line &line, bool from_cache)
+  {
+    if (!in_group)
+      return fail("'end' without 'group'");
+    if (!line.at_end())
+      return fail("Unexpected words after end");
+    in_group = false;
+
+    if (from_cache)
+    {
+      if (!read_group(group))
+        return fail("Truncated cache");
+    }
+    else
+    {
+      group.set->build(bvh);
+      finished_groups.push_back(group);
+    }
+    return add_prototype(group_name, group.set);
+  }
+
+  // Completes the top-level sphere set (and, from the cache, the instances), then puts one
+  // hierarchy over everything placed. Objects, instances and the sphere set always come in that
+  // order, so a cached load builds the same tree as a parse.
+  bool finish(bool from_cache)
+  {
+    if (from_cache)
+    {
+      std::vector<Instance_record> records;
+      if (!read_group(top) || !cache_in->array(records))
+        return false;
+      for (const auto &record : records)
+      {
+        if (record.prototype >= prototypes.size())
+          return false;
+        place_instance(record);
+      }
+    }
+    else if (top.set)
+    {
+      top.set->build(bvh);
+    }
+
+    std::vector<const Shape *> placed = objects;
+    placed.insert(placed.end(), instances.begin(), instances.end());
+    if (top.set && top.set->size() > 0)
+      placed.push_back(top.set);
+
+    if (placed.size() == 1)
+      scene.world.add(placed[0]);
+    else if (placed.size() > 1)
+      scene.world.add(scene.make<bvh_node>(placed, bvh));
+
+    // Rated by the light it sends into the scene, so it waits for the scene's bounds.
+    if (environment)
+    {
+      environment->fit(scene.world.bounding_box());
+      scene.lights.add(environment);
+    }
+    return true;
+  }
+
+  // Cache layout: header, dependencies, replayed text, then one block per group and mesh in
+  // declaration order, the top-level sphere group, and the instance records.
+
+  void write_group(Binary_writer &out, const Sphere_group &g) const
+  {
+    out.value(uint8_t(g.set != nullptr));
+    if (!g.set)
+      return;
+    out.value(uint64_t(g.material_names.size()));
+    for (const auto &name : g.material_names)
+      out.string(name);
+    g.set->save(out);
+  }
+
+  bool read_group(Sphere_group &g)
+  {
+    uint8_t present = 0;
+    if (!cache_in->value(present))
+      return false;
+    if (!present)
+      return true;
+    if (!g.set)
+      g.set = scene.make<SphereSet>();
+
+    uint64_t material_count = 0;
+    cache_in->value(material_count);
+    for (uint64_t k = 0; k < material_count && cache_in->good(); k++)
+    {
+      std::string name;
+      cache_in->string(name);
+      auto found = materials.find(name);
+      if (found == materials.end())
+        return false;
+      g.set->add_material(found->second);
+    }
+    return g.set->load(*cache_in, bvh);
+  }
+
+  void write_cache() const
+  {
+    File_stamp scene_stamp;
+    if (!scene_file_detail::file_stamp(scene_path, scene_stamp))
+      return;
+
+    std::string temp_path = cache_path + ".tmp";
+    {
+      std::ofstream file(temp_path, std::ios::binary);
+      if (!file)
+        return;
+      Binary_writer out(file);
+      out.value(scene_file_detail::cache_magic);
+      out.value(scene_file_detail::cache_version);
+      out.value(scene_stamp);
+      out.value(source_hash);
+      out.value(uint64_t(dependencies.size()));
+      for (const auto &dependency : dependencies)
+      {
+        out.string(dependency.path);
+        out.value(dependency.stamp);
+      }
+      out.string(replayed_text);
+
+      // Groups and meshes interleave in the replayed text; replay that order.
+      size_t next_group = 0, next_mesh = 0;
+      for (const char *p = replayed_text.data(), *end = p + replayed_text.size(); p < end;)
+      {
+        const char *line_end = static_cast<const char *>(std::memchr(p, '\n', size_t(end - p)));
+        Line line(p, line_end);
+        std::string_view keyword;
+        if (line.word(keyword))
+        {
+          if (keyword == "end")
+            write_group(out, finished_groups[next_group++]);
+          else if (keyword == "mesh")
+            meshes[next_mesh++]->save(out);
+        }
+        p = line_end + 1;
+      }
+      write_group(out, top);
+      out.array(instance_records);
+      if (!out.good())
+      {
+        std::remove(temp_path.c_str());
+        return;
+      }
+    }
+    std::rename(temp_path.c_str(), cache_path.c_str());
+  }
+
+  Cache_result load_cache()
+  {
+    File_stamp scene_stamp;
+    if (!scene_file_detail::file_stamp(scene_path, scene_stamp))
+      return Cache_result::missing;
+    Mapped_file file(cache_path);
+    if (!file.good())
+      return Cache_result::missing;
+
+    Binary_reader in(file.begin(), file.end());
+    uint32_t magic = 0, version = 0;
+    File_stamp cached_stamp;
+    uint64_t dependency_count = 0;
+    in.value(magic);
+    in.value(version);
+    in.value(cached_stamp);
+    in.value(source_hash);
+    in.value(dependency_count);
+    if (!in.good() || magic != scene_file_detail::cache_magic || version != scene_file_detail::cache_version ||
+        !(cached_stamp == scene_stamp))
+      return Cache_result::missing;
+    for (uint64_t k = 0; k < dependency_count; k++)
+    {
+      std::string path;
+      File_stamp cached, current;
+      if (!in.string(path) || !in.value(cached) || !scene_file_detail::file_stamp(path, current) || !(cached == current))
+        return Cache_result::missing;
+    }
+
+    std::string text;
+    if (!in.string(text))
+      return Cache_result::damaged;
+    cache_in = &in;
+    source_name = cache_path;
+    bool ok = parse(text.data(), text.data() + text.size(), true) && finish(true);
+    cache_in = nullptr;
+    return ok ? Cache_result::loaded : Cache_result::damaged;
+  }
+};
+
+inline bool load_scene(const std::string &path, Scene &scene, Camera &cam, bool use_cache = true,
+                       const Bvh_build_options &bvh = Bvh_build_options())
+{
+  return Scene_loader(scene, cam, bvh).load(path, use_cache);
+}
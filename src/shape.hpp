@@ -3,8 +3,11 @@
 #include "./aabb.hpp"
 #include "./interval.hpp"
 #include "./ray.hpp"
+#include "./ray_packet.hpp"
+#include "./stats.hpp"
 
 class material;
+class Light;
 
 class hit_record
 {
@@ -15,7 +18,8 @@ public:
   point3 point;
   vec3 normal;
   bool is_front_facing;
-  shared_ptr<material> mat;
+  const material *mat;  // Owned by the Scene; a plain pointer keeps hit records free of refcounting
+  const Light *light;   // The Light this surface is also sampled as, or null
 
   inline void set_face_normal(const ray &r, const vec3 &outward_normal)
   {
@@ -31,4 +35,31 @@ public:
 
   virtual bool hit(const ray &r, Interval interval, hit_record &rec) const = 0;
   virtual aabb bounding_box() const = 0;
+
+  // hit(), also adding the BVH nodes it visits and the primitives it tests to `cost`, for the
+  // bvh-cost heatmap. Shapes with hierarchies override it with a counting copy of their traversal,
+  // so hit() itself counts nothing. A single primitive is one test.
+  virtual bool hit_counted(const ray &r, Interval interval, hit_record &rec, stats::Traversal_cost &cost) const
+  {
+    cost.primitives++;
+    return hit(r, interval, rec);
+  }
+
+  // Intersects the active lanes of a packet. Each lane that finds a hit closer than its t_max
+  // gets records[lane] filled in and t_max shrunk; the mask of those lanes is returned.
+  virtual int hit8(RayPacket8 &packet, hit_record *records) const
+  {
+    int hits = 0;
+    for (int lane = 0; lane < RayPacket8::size; lane++)
+    {
+      if (!(packet.active & (1 << lane)))
+        continue;
+      if (hit(packet.lane_ray(lane), Interval(packet.t_min, packet.t_max[lane]), records[lane]))
+      {
+        packet.t_max[lane] = records[lane].t;
+        hits |= 1 << lane;
+      }
+    }
+    return hits;
+  }
 };
@@ -0,0 +1,29 @@
+#pragma once
+
+// Compile-time and run-time detection of the SIMD instruction sets the hot loops can use. Wider
+// kernels are compiled with a target attribute and picked at run time, so one binary runs
+// everywhere and still uses AVX2 where the CPU has it.
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define RT_AVX2_DISPATCH 1
+#define RT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#ifndef RT_AVX2_DISPATCH
+#define RT_AVX2_DISPATCH 0
+#endif
+
+inline bool cpu_has_avx2()
+{
+#if RT_AVX2_DISPATCH
+  static const bool supported = __builtin_cpu_supports("avx2");
+  return supported;
+#else
+  return false;
+#endif
+}
@@ -1,6 +1,10 @@
 #pragma once
 
+#include <bitset>
+
 #include "./shape.hpp"
+#include "./simd.hpp"
+#include "./stats.hpp"
 #include "aabb.hpp"
 #include "interval.hpp"
 #include "ray.hpp"
@@ -9,12 +13,13 @@ class Sphere : public Shape
 {
   ray center;
   double radius;
-  shared_ptr<material> mat;
+  const material *mat;
+  const Light *light = nullptr;
   aabb bbox;
 
 public:
   // Stationary Sphere
-  Sphere(const point3 &static_center, double radius, shared_ptr<material> mat)
+  Sphere(const point3 &static_center, double radius, const material *mat)
       : center(static_center, vec3(0, 0, 0)), radius(std::fmax(0, radius)), mat(mat)
   {
     auto rvec = vec3(radius, radius, radius);
@@ -22,7 +27,7 @@ public:
   }
 
   // Moving Sphere
-  Sphere(const point3 &center1, const point3 &center2, double radius, shared_ptr<material> mat)
+  Sphere(const point3 &center1, const point3 &center2, double radius, const material *mat)
       : center(center1, center2 - center1), radius(std::fmax(0, radius)), mat(mat)
   {
     auto rvec = vec3(radius, radius, radius);
@@ -32,8 +37,12 @@ public:
   }
   aabb bounding_box() const override { return bbox; }
 
+  // Marks hits on this sphere as hits on `sampled`, its Light in the scene's light list.
+  void set_light(const Light *sampled) { light = sampled; }
+
   bool hit(const ray &r, Interval interval, hit_record &record) const override
   {
+    stats::add(stats::sphere_tests);
     point3 current_center = center.at(r.time());
     vec3 oc = current_center - r.origin();
     auto a = r.direction().length_squared();
@@ -55,15 +64,30 @@ public:
         return false;
     }
 
-    record.t = root;
-    record.point = r.at(record.t);
-    vec3 outward_normal = (record.point - current_center) / radius;
-    record.set_face_normal(r, outward_normal);
-    get_sphere_uv(outward_normal, record.u, record.v);
-    record.mat = mat;
-
+    set_record(r, root, record);
     return true;
   }
+
+  int hit8(RayPacket8 &packet, hit_record *records) const override
+  {
+    stats::add(stats::sphere_tests, std::bitset<RayPacket8::size>(unsigned(packet.active)).count());
+    alignas(32) double roots[RayPacket8::size];
+#if RT_AVX2_DISPATCH
+    int hits = cpu_has_avx2() ? roots8_avx2(packet, roots) : roots8(packet, roots);
+#else
+    int hits = roots8(packet, roots);
+#endif
+
+    for (int lane = 0; lane < RayPacket8::size; lane++)
+    {
+      if (!(hits & (1 << lane)))
+        continue;
+      set_record(packet.lane_ray(lane), roots[lane], records[lane]);
+      packet.t_max[lane] = roots[lane];
+    }
+    return hits;
+  }
+
   // @param p: a given point on the sphere of radius one, centered at the origin.
   // @param u: returned value [0,1] of angle around the Y axis from X=-1.
   // @param v: returned value [0,1] of angle from Y=-1 to Y=+1.
@@ -78,4 +102,95 @@ public:
     u = phi / (2 * pi);
     v = theta / pi;
   }
+
+private:
+  void set_record(const ray &r, double root, hit_record &record) const
+  {
+    point3 current_center = center.at(r.time());
+    record.t = root;
+    record.point = r.at(record.t);
+    vec3 outward_normal = (record.point - current_center) / radius;
+    record.set_face_normal(r, outward_normal);
+    get_sphere_uv(outward_normal, record.u, record.v);
+    record.mat = mat;
+    record.light = light;
+  }
+
+  // Nearest root in (t_min, t_max[lane]) for every active lane of the packet, evaluated with the
+  // same operations in the same order as hit(), so packet and single-ray results agree exactly.
+  int roots8(const RayPacket8 &packet, double *roots) const
+  {
+    int hits = 0;
+    for (int lane = 0; lane < RayPacket8::size; lane++)
+    {
+      if (!(packet.active & (1 << lane)))
+        continue;
+      ray r = packet.lane_ray(lane);
+      vec3 oc = center.at(r.time()) - r.origin();
+      auto a = r.direction().length_squared();
+      auto h = dot(r.direction(), oc);
+      auto c = oc.length_squared() - radius * radius;
+
+      auto discriminant = h * h - a * c;
+      if (discriminant < 0)
+        continue;
+
+      auto sqrtd = std::sqrt(discriminant);
+      Interval interval(packet.t_min, packet.t_max[lane]);
+      auto root = (h - sqrtd) / a;
+      if (!interval.surrounds(root))
+      {
+        root = (h + sqrtd) / a;
+        if (!interval.surrounds(root))
+          continue;
+      }
+      roots[lane] = root;
+      hits |= 1 << lane;
+    }
+    return hits;
+  }
+
+#if RT_AVX2_DISPATCH
+  RT_TARGET_AVX2 int roots8_avx2(const RayPacket8 &packet, double *roots) const
+  {
+    const point3 c0 = center.origin();
+    const vec3 motion = center.direction();
+    const __m256d radius_sq = _mm256_set1_pd(radius * radius);
+    const __m256d t_min = _mm256_set1_pd(packet.t_min);
+
+    int hits = 0;
+    for (int half = 0; half < RayPacket8::size; half += 4)
+    {
+      __m256d time = _mm256_load_pd(packet.time + half);
+      __m256d dx = _mm256_load_pd(packet.dir[0] + half);
+      __m256d dy = _mm256_load_pd(packet.dir[1] + half);
+      __m256d dz = _mm256_load_pd(packet.dir[2] + half);
+      __m256d ocx = _mm256_sub_pd(_mm256_add_pd(_mm256_set1_pd(c0.x()), _mm256_mul_pd(time, _mm256_set1_pd(motion.x()))),
+                                  _mm256_load_pd(packet.orig[0] + half));
+      __m256d ocy = _mm256_sub_pd(_mm256_add_pd(_mm256_set1_pd(c0.y()), _mm256_mul_pd(time, _mm256_set1_pd(motion.y()))),
+                                  _mm256_load_pd(packet.orig[1] + half));
+      __m256d ocz = _mm256_sub_pd(_mm256_add_pd(_mm256_set1_pd(c0.z()), _mm256_mul_pd(time, _mm256_set1_pd(motion.z()))),
+                                  _mm256_load_pd(packet.orig[2] + half));
+
+      __m256d a = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz));
+      __m256d h = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, ocx), _mm256_mul_pd(dy, ocy)), _mm256_mul_pd(dz, ocz));
+      __m256d oc_sq = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz));
+      __m256d c = _mm256_sub_pd(oc_sq, radius_sq);
+      __m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(h, h), _mm256_mul_pd(a, c));
+      __m256d real = _mm256_cmp_pd(discriminant, _mm256_setzero_pd(), _CMP_GE_OQ);
+
+      __m256d sqrtd = _mm256_sqrt_pd(_mm256_max_pd(discriminant, _mm256_setzero_pd()));
+      __m256d t_max = _mm256_load_pd(packet.t_max + half);
+      __m256d near_root = _mm256_div_pd(_mm256_sub_pd(h, sqrtd), a);
+      __m256d far_root = _mm256_div_pd(_mm256_add_pd(h, sqrtd), a);
+      __m256d near_ok = _mm256_and_pd(_mm256_cmp_pd(t_min, near_root, _CMP_LT_OQ), _mm256_cmp_pd(near_root, t_max, _CMP_LT_OQ));
+      __m256d far_ok = _mm256_and_pd(_mm256_cmp_pd(t_min, far_root, _CMP_LT_OQ), _mm256_cmp_pd(far_root, t_max, _CMP_LT_OQ));
+
+      _mm256_store_pd(roots + half, _mm256_blendv_pd(far_root, near_root, near_ok));
+      int lane_hits = _mm256_movemask_pd(_mm256_and_pd(real, _mm256_or_pd(near_ok, far_ok)));
+      hits |= lane_hits << half;
+    }
+    return hits & packet.active;
+  }
+#endif
 };
@@ -0,0 +1,356 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "./aabb.hpp"
+#include "./binary_io.hpp"
+#include "./interval.hpp"
+#include "./linear_bvh.hpp"
+#include "./ray.hpp"
+#include "./shape.hpp"
+#include "./simd.hpp"
+#include "./sphere.hpp"
+#include "./stats.hpp"
+#include "./wide_bvh.hpp"
+
+// Many spheres stored as one shape. Centers, motion vectors, radii and material IDs sit in
+// structure-of-arrays form, so a sphere costs 60 bytes instead of a heap object, a list entry and
+// a virtual call. The set carries its own BVH whose leaves are contiguous runs of those arrays,
+// and each leaf is intersected four spheres at a time with AVX2 (scalar elsewhere). The whole set
+// is a single Shape, so it can itself sit in a hittable_list or a bvh_node.
+//
+// Usage: add_material() and add() every sphere, then build() once before rendering.
+class SphereSet : public Shape
+{
+  static const int batch = 4;  // Spheres per SIMD test
+
+  // Packed in BVH leaf order after build(), with `batch - 1` padding entries at the end so the
+  // last batch can always load a full register.
+  std::vector<double> center_x, center_y, center_z;  // Center at time 0
+  std::vector<double> motion_x, motion_y, motion_z;  // Center moves by this much from time 0 to 1
+  std::vector<double> radius;
+  std::vector<uint32_t> material_id;
+  std::vector<const material *> materials;
+  size_t sphere_count = 0;
+
+  Linear_bvh bvh;
+  Wide_bvh wide;
+  aabb bbox = aabb::empty;
+
+public:
+  SphereSet() {}
+
+  // Registers a material and returns the ID that add() takes.
+  uint32_t add_material(const material *mat)
+  {
+    materials.push_back(mat);
+    return uint32_t(materials.size() - 1);
+  }
+
+  // Stationary sphere
+  void add(const point3 &center, double radius, uint32_t material) { add(center, center, radius, material); }
+
+  // Moving sphere
+  void add(const point3 &center1, const point3 &center2, double sphere_radius, uint32_t material)
+  {
+    vec3 motion = center2 - center1;
+    center_x.push_back(center1.x());
+    center_y.push_back(center1.y());
+    center_z.push_back(center1.z());
+    motion_x.push_back(motion.x());
+    motion_y.push_back(motion.y());
+    motion_z.push_back(motion.z());
+    radius.push_back(std::fmax(0, sphere_radius));
+    material_id.push_back(material);
+    sphere_count++;
+  }
+
+  size_t size() const { return sphere_count; }
+
+  // Builds the hierarchy and packs the arrays into leaf order. Spheres added afterwards are not
+  // seen until build() is called again.
+  void build(const Bvh_build_options &options = Bvh_build_options())
+  {
+    trim_padding();
+
+    std::vector<aabb> bounds(sphere_count);
+    for (size_t k = 0; k < sphere_count; k++)
+      bounds[k] = sphere_box(k);
+
+    bvh.build(bounds, options);
+    wide = options.width != 2 ? Wide_bvh(bvh, options.width) : Wide_bvh();
+
+    const auto &order = bvh.primitive_order();
+    permute(center_x, order);
+    permute(center_y, order);
+    permute(center_z, order);
+    permute(motion_x, order);
+    permute(motion_y, order);
+    permute(motion_z, order);
+    permute(radius, order);
+    permute(material_id, order);
+
+    bbox = aabb::empty;
+    for (const auto &box : bounds)
+      bbox = aabb(bbox, box);
+
+    add_padding();
+  }
+
+  // Cache support: the packed arrays and the hierarchy exactly as build() left them. load()
+  // expects the same materials to have been registered again, in the same order.
+  void save(Binary_writer &out) const
+  {
+    out.value(uint64_t(sphere_count));
+    out.array(center_x);
+    out.array(center_y);
+    out.array(center_z);
+    out.array(motion_x);
+    out.array(motion_y);
+    out.array(motion_z);
+    out.array(radius);
+    out.array(material_id);
+    bvh.save(out);
+  }
+
+  bool load(Binary_reader &in, const Bvh_build_options &options = Bvh_build_options())
+  {
+    uint64_t count = 0;
+    in.value(count);
+    in.array(center_x);
+    in.array(center_y);
+    in.array(center_z);
+    in.array(motion_x);
+    in.array(motion_y);
+    in.array(motion_z);
+    in.array(radius);
+    in.array(material_id);
+    bool hierarchy_valid = bvh.load(in, size_t(count));
+    if (!in.good() || !hierarchy_valid)
+      return false;
+
+    // The SIMD loop reads whole batches, so every array must hold the padding too.
+    const size_t padded = size_t(count) + batch - 1;
+    for (const auto *values : {&center_x, &center_y, &center_z, &motion_x, &motion_y, &motion_z, &radius})
+      if (values->size() != padded)
+        return false;
+    if (material_id.size() != padded)
+      return false;
+    for (size_t k = 0; k < size_t(count); k++)
+      if (material_id[k] >= materials.size())
+        return false;
+
+    sphere_count = size_t(count);
+    wide = options.width != 2 ? Wide_bvh(bvh, options.width) : Wide_bvh();
+    bbox = aabb::empty;
+    for (size_t k = 0; k < sphere_count; k++)
+      bbox = aabb(bbox, sphere_box(k));
+    return true;
+  }
+
+  aabb bounding_box() const override { return bbox; }
+
+  bool hit(const ray &r, Interval ray_t, hit_record &rec) const override
+  {
+    return find_hit<false>(r, ray_t, rec, nullptr);
+  }
+
+  bool hit_counted(const ray &r, Interval ray_t, hit_record &rec, stats::Traversal_cost &cost) const override
+  {
+    return find_hit<true>(r, ray_t, rec, &cost);
+  }
+
+private:
+  template <bool Counted>
+  bool find_hit(const ray &r, Interval ray_t, hit_record &rec, stats::Traversal_cost *cost) const
+  {
+    const Sphere_ray sr(r);
+    size_t closest = 0;
+    double closest_t = 0;
+
+    auto hit_leaf = [&](size_t first, size_t count, Interval &t)
+    {
+      bool hit_anything = false;
+      stats::add(stats::sphere_tests, count);
+      if constexpr (Counted)
+        cost->primitives += count;
+      for (size_t k = first; k < first + count; k += batch)
+      {
+        alignas(32) double roots[batch];
+        int mask = roots4(k, sr, t, roots);
+        if (first + count - k < size_t(batch))
+          mask &= (1 << (first + count - k)) - 1;
+
+        // Lanes in order, strict comparison: the earlier sphere wins a tie, as in a list of Spheres.
+        for (int lane = 0; lane < batch; lane++)
+        {
+          if ((mask & (1 << lane)) && roots[lane] < t.max)
+          {
+            t.max = closest_t = roots[lane];
+            closest = k + lane;
+            hit_anything = true;
+          }
+        }
+      }
+      return hit_anything;
+    };
+
+    bool hit_anything =
+        !wide.empty() ? wide.traverse<Counted>(r, ray_t, hit_leaf, cost) : bvh.traverse<Counted>(r, ray_t, hit_leaf, cost);
+    if (!hit_anything)
+      return false;
+
+    set_record(r, closest, closest_t, rec);
+    return true;
+  }
+
+  // The per-ray terms of the sphere quadratic, computed once per ray rather than per sphere.
+  struct Sphere_ray
+  {
+    double orig[3];
+    double dir[3];
+    double time;
+    double a;
+
+    Sphere_ray(const ray &r)
+    {
+      for (int axis = 0; axis < 3; axis++)
+      {
+        orig[axis] = r.origin()[axis];
+        dir[axis] = r.direction()[axis];
+      }
+      time = r.time();
+      a = r.direction().length_squared();
+    }
+  };
+
+  aabb sphere_box(size_t k) const
+  {
+    // Same construction as the moving Sphere, so a set and a list of Spheres get identical trees.
+    point3 start(center_x[k], center_y[k], center_z[k]);
+    vec3 motion(motion_x[k], motion_y[k], motion_z[k]);
+    vec3 rvec(radius[k], radius[k], radius[k]);
+    point3 end = start + 1 * motion;
+    return aabb(aabb(start - rvec, start + rvec), aabb(end - rvec, end + rvec));
+  }
+
+  void set_record(const ray &r, size_t k, double root, hit_record &record) const
+  {
+    point3 current_center = point3(center_x[k], center_y[k], center_z[k]) + r.time() * vec3(motion_x[k], motion_y[k], motion_z[k]);
+    record.t = root;
+    record.point = r.at(record.t);
+    vec3 outward_normal = (record.point - current_center) / radius[k];
+    record.set_face_normal(r, outward_normal);
+    Sphere::get_sphere_uv(outward_normal, record.u, record.v);
+    record.mat = materials[material_id[k]];
+    record.light = nullptr;
+  }
+
+  template <typename T>
+  static void permute(std::vector<T> &values, const std::vector<uint32_t> &order)
+  {
+    std::vector<T> packed(order.size());
+    for (size_t k = 0; k < order.size(); k++)
+      packed[k] = values[order[k]];
+    values.swap(packed);
+  }
+
+  void add_padding()
+  {
+    for (int p = 0; p < batch - 1; p++)
+    {
+      center_x.push_back(0);
+      center_y.push_back(0);
+      center_z.push_back(0);
+      motion_x.push_back(0);
+      motion_y.push_back(0);
+      motion_z.push_back(0);
+      radius.push_back(0);
+      material_id.push_back(0);
+    }
+  }
+
+  void trim_padding()
+  {
+    center_x.resize(sphere_count);
+    center_y.resize(sphere_count);
+    center_z.resize(sphere_count);
+    motion_x.resize(sphere_count);
+    motion_y.resize(sphere_count);
+    motion_z.resize(sphere_count);
+    radius.resize(sphere_count);
+    material_id.resize(sphere_count);
+  }
+
+  // Nearest root in (t.min, t.max) of the ray against spheres [first, first + 4), evaluated with
+  // the same operations in the same order as Sphere::hit, so a set renders exactly like a list
+  // of Spheres. Returns the mask of spheres hit.
+  int roots4(size_t first, const Sphere_ray &r, const Interval &t, double *roots) const
+  {
+#if RT_AVX2_DISPATCH
+    if (cpu_has_avx2())
+      return roots4_avx2(first, r, t, roots);
+#endif
+    int mask = 0;
+    for (int lane = 0; lane < batch; lane++)
+    {
+      size_t k = first + lane;
+      double oc[3] = {center_x[k] + r.time * motion_x[k] - r.orig[0], center_y[k] + r.time * motion_y[k] - r.orig[1],
+                      center_z[k] + r.time * motion_z[k] - r.orig[2]};
+      double h = r.dir[0] * oc[0] + r.dir[1] * oc[1] + r.dir[2] * oc[2];
+      double c = (oc[0] * oc[0] + oc[1] * oc[1] + oc[2] * oc[2]) - radius[k] * radius[k];
+
+      double discriminant = h * h - r.a * c;
+      if (discriminant < 0)
+        continue;
+
+      double sqrtd = std::sqrt(discriminant);
+      double root = (h - sqrtd) / r.a;
+      if (!t.surrounds(root))
+      {
+        root = (h + sqrtd) / r.a;
+        if (!t.surrounds(root))
+          continue;
+      }
+      roots[lane] = root;
+      mask |= 1 << lane;
+    }
+    return mask;
+  }
+
+#if RT_AVX2_DISPATCH
+  RT_TARGET_AVX2 int roots4_avx2(size_t first, const Sphere_ray &r, const Interval &t, double *roots) const
+  {
+    const __m256d time = _mm256_set1_pd(r.time);
+    const __m256d a = _mm256_set1_pd(r.a);
+    const __m256d t_min = _mm256_set1_pd(t.min);
+    const __m256d t_max = _mm256_set1_pd(t.max);
+
+    __m256d ocx = _mm256_sub_pd(_mm256_add_pd(_mm256_loadu_pd(&center_x[first]), _mm256_mul_pd(time, _mm256_loadu_pd(&motion_x[first]))),
+                                _mm256_set1_pd(r.orig[0]));
+    __m256d ocy = _mm256_sub_pd(_mm256_add_pd(_mm256_loadu_pd(&center_y[first]), _mm256_mul_pd(time, _mm256_loadu_pd(&motion_y[first]))),
+                                _mm256_set1_pd(r.orig[1]));
+    __m256d ocz = _mm256_sub_pd(_mm256_add_pd(_mm256_loadu_pd(&center_z[first]), _mm256_mul_pd(time, _mm256_loadu_pd(&motion_z[first]))),
+                                _mm256_set1_pd(r.orig[2]));
+    __m256d rad = _mm256_loadu_pd(&radius[first]);
+
+    __m256d h = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(r.dir[0]), ocx), _mm256_mul_pd(_mm256_set1_pd(r.dir[1]), ocy)),
+                              _mm256_mul_pd(_mm256_set1_pd(r.dir[2]), ocz));
+    __m256d oc_sq = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz));
+    __m256d c = _mm256_sub_pd(oc_sq, _mm256_mul_pd(rad, rad));
+    __m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(h, h), _mm256_mul_pd(a, c));
+    __m256d real = _mm256_cmp_pd(discriminant, _mm256_setzero_pd(), _CMP_GE_OQ);
+
+    __m256d sqrtd = _mm256_sqrt_pd(_mm256_max_pd(discriminant, _mm256_setzero_pd()));
+    __m256d near_root = _mm256_div_pd(_mm256_sub_pd(h, sqrtd), a);
+    __m256d far_root = _mm256_div_pd(_mm256_add_pd(h, sqrtd), a);
+    __m256d near_ok = _mm256_and_pd(_mm256_cmp_pd(t_min, near_root, _CMP_LT_OQ), _mm256_cmp_pd(near_root, t_max, _CMP_LT_OQ));
+    __m256d far_ok = _mm256_and_pd(_mm256_cmp_pd(t_min, far_root, _CMP_LT_OQ), _mm256_cmp_pd(far_root, t_max, _CMP_LT_OQ));
+
+    _mm256_store_pd(roots, _mm256_blendv_pd(far_root, near_root, near_ok));
+    return _mm256_movemask_pd(_mm256_and_pd(real, _mm256_or_pd(near_ok, far_ok)));
+  }
+#endif
+};
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <typeinfo>
+
+// Render statistics: event counters, the distribution of path lengths, scatter calls per material
+// type, and wall-clock time per phase. Counting is compiled in only with RT_STATS=1 (`make
+// STATS=1`); otherwise every function here is empty and the renderer is exactly as fast as before.
+//
+// Each thread counts into its own thread_local block, which is added to the process totals when
+// the thread exits, so counting takes no locks. report() and write_json() read the totals plus the
+// calling thread's own block; call them once the render's worker threads have finished.
+#ifndef RT_STATS
+#define RT_STATS 0
+#endif
+
+#if RT_STATS
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
+#endif
+
+namespace stats
+{
+enum Counter
+{
+  rays,            // Rays traced through the world, camera and bounce rays alike
+  bvh_nodes,       // BVH nodes whose children or primitives were examined
+  box_tests,       // Ray-box slab tests, counting each child of a wide node
+  sphere_tests,    // Ray-sphere tests, in Sphere and SphereSet
+  triangle_tests,  // Ray-triangle tests in TriangleMesh
+  counter_count,
+};
+
+enum Phase
+{
+  scene_build,  // Loading the scene, including any BVH builds
+  bvh_build,    // Building and collapsing BVHs, on the calling thread
+  render,
+  output,  // Writing the image
+  phase_count,
+};
+
+// BVH nodes visited and primitives tested by a ray, as Shape::hit_counted reports them for the
+// bvh-cost heatmap. That is a separate path from hit(), so it is available in every build and
+// costs normal rendering nothing.
+struct Traversal_cost
+{
+  uint64_t nodes = 0;
+  uint64_t primitives = 0;
+};
+
+#if RT_STATS
+
+namespace stats_detail
+{
+inline const char *const counter_names[counter_count] = {"rays", "bvh_nodes", "box_tests", "sphere_tests",
+                                                          "triangle_tests"};
+inline const char *const phase_names[phase_count] = {"scene_build", "bvh_build", "render", "output"};
+
+// Readable name of a type, for the scatter table.
+inline std::string type_name(const std::type_info &type)
+{
+#ifdef __GNUG__
+  int status = 0;
+  std::unique_ptr<char, void (*)(void *)> name(abi::__cxa_demangle(type.name(), nullptr, nullptr, &status), std::free);
+  if (status == 0 && name)
+    return name.get();
+#endif
+  return type.name();
+}
+
+struct Totals
+{
+  std::mutex mutex;
+  uint64_t counts[counter_count] = {};
+  std::vector<uint64_t> path_lengths;
+  std::map<std::string, uint64_t> scatters;
+  double seconds[phase_count] = {};
+};
+
+inline Totals &totals()
+{
+  static Totals t;
+  return t;
+}
+
+struct Thread_counters
+{
+  uint64_t counts[counter_count] = {};
+  std::vector<uint64_t> path_lengths;  // path_lengths[n]: paths that ended after n rays
+  std::vector<std::pair<const std::type_info *, uint64_t>> scatters;  // Few entries; searched linearly
+
+  ~Thread_counters() { merge_into(totals()); }
+
+  void merge_into(Totals &t) const
+  {
+    std::lock_guard<std::mutex> lock(t.mutex);
+    add_to(t);
+  }
+
+  // Adds this block to `t`, whose mutex the caller holds.
+  void add_to(Totals &t) const
+  {
+    for (int c = 0; c < counter_count; c++)
+      t.counts[c] += counts[c];
+    if (t.path_lengths.size() < path_lengths.size())
+      t.path_lengths.resize(path_lengths.size());
+    for (size_t n = 0; n < path_lengths.size(); n++)
+      t.path_lengths[n] += path_lengths[n];
+    for (const auto &scatter : scatters)
+      t.scatters[type_name(*scatter.first)] += scatter.second;
+  }
+};
+
+inline thread_local Thread_counters local;
+
+// The totals with the calling thread's counts added.
+struct Snapshot : Totals
+{
+  Snapshot()
+  {
+    Totals &t = totals();
+    {
+      std::lock_guard<std::mutex> lock(t.mutex);
+      std::copy(t.counts, t.counts + counter_count, counts);
+      path_lengths = t.path_lengths;
+      scatters = t.scatters;
+      std::copy(t.seconds, t.seconds + phase_count, seconds);
+    }
+    local.add_to(*this);
+  }
+
+  double per_ray(Counter c) const { return counts[rays] ? double(counts[c]) / counts[rays] : 0; }
+  double mrays_per_second() const { return seconds[render] > 0 ? counts[rays] / seconds[render] * 1e-6 : 0; }
+};
+}  // namespace stats_detail
+
+inline void add(Counter counter, uint64_t count = 1) { stats_detail::local.counts[counter] += count; }
+
+// Records `count` paths that ended after tracing `length` rays each, for whatever reason.
+inline void path_ended(size_t length, uint64_t count = 1)
+{
+  auto &lengths = stats_detail::local.path_lengths;
+  if (lengths.size() <= length)
+    lengths.resize(length + 1);
+  lengths[length] += count;
+}
+
+// Records a scatter() call on `object`, counted by its dynamic type.
+template <typename Material>
+inline void scatter(const Material &object)
+{
+  const std::type_info &type = typeid(object);
+  for (auto &entry : stats_detail::local.scatters)
+  {
+    if (*entry.first == type)
+    {
+      entry.second++;
+      return;
+    }
+  }
+  stats_detail::local.scatters.push_back({&type, 1});
+}
+
+// Adds the time from construction to destruction to a phase. Phases may nest or repeat.
+class Scoped_timer
+{
+public:
+  explicit Scoped_timer(Phase phase) : phase(phase), start(std::chrono::steady_clock::now()) {}
+  ~Scoped_timer()
+  {
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    auto &t = stats_detail::totals();
+    std::lock_guard<std::mutex> lock(t.mutex);
+    t.seconds[phase] += seconds;
+  }
+
+  Scoped_timer(const Scoped_timer &) = delete;
+  Scoped_timer &operator=(const Scoped_timer &) = delete;
+
+private:
+  Phase phase;
+  std::chrono::steady_clock::time_point start;
+};
+
+inline void report(std::ostream &out)
+{
+  stats_detail::Snapshot s;
+  auto flags = out.flags();
+  auto precision = out.precision();
+  out << std::fixed << std::setprecision(3) << "Statistics:\n"
+      << "  Scene build       " << std::setw(10) << s.seconds[scene_build] << " s\n"
+      << "  BVH build         " << std::setw(10) << s.seconds[bvh_build] << " s\n"
+      << "  Render            " << std::setw(10) << s.seconds[render] << " s\n"
+      << "  Output            " << std::setw(10) << s.seconds[output] << " s\n"
+      << std::setprecision(2) << "  Rays              " << std::setw(14) << s.counts[rays] << "  " << s.mrays_per_second()
+      << " Mrays/s\n"
+      << "  BVH nodes visited " << std::setw(14) << s.counts[bvh_nodes] << "  " << s.per_ray(bvh_nodes) << " per ray\n"
+      << "  Box tests         " << std::setw(14) << s.counts[box_tests] << "  " << s.per_ray(box_tests) << " per ray\n"
+      << "  Sphere tests      " << std::setw(14) << s.counts[sphere_tests] << "  " << s.per_ray(sphere_tests)
+      << " per ray\n"
+      << "  Triangle tests    " << std::setw(14) << s.counts[triangle_tests] << "  " << s.per_ray(triangle_tests)
+      << " per ray\n";
+
+  out << "  Scatter calls\n";
+  for (const auto &scatter : s.scatters)
+    out << "    " << std::left << std::setw(16) << scatter.first << std::right << std::setw(12) << scatter.second << '\n';
+
+  // One bar per path length that occurred, scaled to the most common length.
+  uint64_t paths = 0, most = 0;
+  for (auto count : s.path_lengths)
+  {
+    paths += count;
+    most = std::max(most, count);
+  }
+  out << "  Rays per path (" << paths << " paths)\n";
+  for (size_t n = 0; n < s.path_lengths.size(); n++)
+  {
+    uint64_t count = s.path_lengths[n];
+    if (count == 0)
+      continue;
+    out << "    " << std::setw(4) << n << std::setw(14) << count << std::setw(7) << 100.0 * count / paths << "%  "
+        << std::string(size_t(40.0 * count / most + 0.5), '#') << '\n';
+  }
+  out.flags(flags);
+  out.precision(precision);
+}
+
+inline void write_json(std::ostream &out)
+{
+  stats_detail::Snapshot s;
+  out << "{\n  \"seconds\": {";
+  for (int p = 0; p < phase_count; p++)
+    out << (p ? ", \"" : "\"") << stats_detail::phase_names[p] << "\": " << s.seconds[p];
+  out << "},\n  \"counters\": {";
+  for (int c = 0; c < counter_count; c++)
+    out << (c ? ", \"" : "\"") << stats_detail::counter_names[c] << "\": " << s.counts[c];
+  out << "},\n  \"mrays_per_second\": " << s.mrays_per_second() << ",\n  \"nodes_per_ray\": " << s.per_ray(bvh_nodes)
+      << ",\n  \"box_tests_per_ray\": " << s.per_ray(box_tests) << ",\n  \"scatter_calls\": {";
+  bool first = true;
+  for (const auto &scatter : s.scatters)
+  {
+    out << (first ? "\"" : ", \"") << scatter.first << "\": " << scatter.second;
+    first = false;
+  }
+  out << "},\n  \"rays_per_path\": [";
+  for (size_t n = 0; n < s.path_lengths.size(); n++)
+    out << (n ? ", " : "") << s.path_lengths[n];
+  out << "]\n}\n";
+}
+
+#else
+
+inline void add(Counter, uint64_t = 1) {}
+inline void path_ended(size_t, uint64_t = 1) {}
+template <typename Material>
+inline void scatter(const Material &) {}
+
+class Scoped_timer
+{
+public:
+  explicit Scoped_timer(Phase) {}
+};
+
+inline void report(std::ostream &) {}
+inline void write_json(std::ostream &) {}
+
+#endif
+
+// True when statistics are compiled in.
+constexpr bool enabled = RT_STATS;
+}  // namespace stats
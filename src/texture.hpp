@@ -1,5 +1,7 @@
 #pragma once
 
+#include <memory>
+
 #include "./color.hpp"
 #include "./rtw_stb_image.hpp"
 #include "./vec3.hpp"
@@ -29,14 +31,16 @@ private:
 class Checker_texture : public Texture
 {
   double inv_scale;
-  shared_ptr<Texture> even;
-  shared_ptr<Texture> odd;
+  std::unique_ptr<Texture> own_even, own_odd;  // Set when built from plain colors
+  const Texture *even;
+  const Texture *odd;
 
 public:
-  Checker_texture(double scale, shared_ptr<Texture> even, shared_ptr<Texture> odd) : inv_scale(1.0 / scale), even(even), odd(odd) {}
+  Checker_texture(double scale, const Texture *even, const Texture *odd) : inv_scale(1.0 / scale), even(even), odd(odd) {}
 
   Checker_texture(double scale, const color &c1, const color &c2)
-      : Checker_texture(scale, make_shared<solid_color>(c1), make_shared<solid_color>(c2))
+      : inv_scale(1.0 / scale), own_even(std::make_unique<solid_color>(c1)), own_odd(std::make_unique<solid_color>(c2)),
+        even(own_even.get()), odd(own_odd.get())
   {
   }
 
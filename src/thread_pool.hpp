@@ -0,0 +1,166 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads with one task deque per worker. A worker pops from the back of
+// its own deque (most recently pushed, so still warm in cache) and, once that is empty, steals
+// from the front of the other workers' deques. Tasks submitted from inside a worker go to that
+// worker's deque, so recursive work (e.g. subtree builds) stays local until someone steals it.
+class Thread_pool
+{
+public:
+  using Task = std::function<void()>;
+
+  // A thread_count of 0 uses one worker per hardware thread.
+  explicit Thread_pool(size_t thread_count = 0)
+  {
+    if (thread_count == 0)
+      thread_count = default_thread_count();
+
+    for (size_t i = 0; i < thread_count; i++)
+      queues.push_back(std::make_unique<Worker_queue>());
+    for (size_t i = 0; i < thread_count; i++)
+      threads.emplace_back([this, i] { worker_loop(i); });
+  }
+
+  Thread_pool(const Thread_pool &) = delete;
+  Thread_pool &operator=(const Thread_pool &) = delete;
+
+  ~Thread_pool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(state_mutex);
+      stopping = true;
+    }
+    work_available.notify_all();
+    for (auto &thread : threads)
+      thread.join();
+  }
+
+  static size_t default_thread_count()
+  {
+    auto n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : n;
+  }
+
+  size_t size() const { return threads.size(); }
+
+  void submit(Task task)
+  {
+    size_t target = (current_pool == this) ? current_worker : next_queue++ % queues.size();
+
+    // Count the task before it becomes visible, so a thief can never decrement past zero.
+    {
+      std::lock_guard<std::mutex> lock(state_mutex);
+      queued++;
+      pending++;
+    }
+    {
+      std::lock_guard<std::mutex> lock(queues[target]->mutex);
+      queues[target]->tasks.push_back(std::move(task));
+    }
+    work_available.notify_one();
+  }
+
+  // Blocks until every submitted task, including tasks submitted by other tasks, has finished.
+  // Must not be called from inside a task.
+  void wait()
+  {
+    std::unique_lock<std::mutex> lock(state_mutex);
+    all_done.wait(lock, [this] { return pending == 0; });
+  }
+
+  // Runs body(i) for every i in [0, count) and waits for all of them.
+  template <typename F>
+  void parallel_for(size_t count, F &&body)
+  {
+    for (size_t i = 0; i < count; i++)
+      submit([&body, i] { body(i); });
+    wait();
+  }
+
+private:
+  struct Worker_queue
+  {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<std::unique_ptr<Worker_queue>> queues;
+  std::vector<std::thread> threads;
+  std::atomic<size_t> next_queue{0};
+
+  std::mutex state_mutex;
+  std::condition_variable work_available;
+  std::condition_variable all_done;
+  size_t queued = 0;   // Tasks sitting in some deque
+  size_t pending = 0;  // Tasks submitted but not yet finished
+  bool stopping = false;
+
+  static inline thread_local const Thread_pool *current_pool = nullptr;
+  static inline thread_local size_t current_worker = 0;
+
+  bool pop_local(size_t index, Task &task)
+  {
+    auto &queue = *queues[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty())
+      return false;
+    task = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+    return true;
+  }
+
+  bool steal(size_t thief, Task &task)
+  {
+    for (size_t offset = 1; offset < queues.size(); offset++)
+    {
+      auto &queue = *queues[(thief + offset) % queues.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (queue.tasks.empty())
+        continue;
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+      return true;
+    }
+    return false;
+  }
+
+  void worker_loop(size_t index)
+  {
+    current_pool = this;
+    current_worker = index;
+
+    while (true)
+    {
+      Task task;
+      if (pop_local(index, task) || steal(index, task))
+      {
+        {
+          std::lock_guard<std::mutex> lock(state_mutex);
+          queued--;
+        }
+        task();
+
+        std::lock_guard<std::mutex> lock(state_mutex);
+        if (--pending == 0)
+          all_done.notify_all();
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(state_mutex);
+      work_available.wait(lock, [this] { return stopping || queued > 0; });
+      if (stopping && queued == 0)
+        return;
+    }
+  }
+};
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cmath>
+
+#include "./aabb.hpp"
+#include "./utils.hpp"
+#include "./vec3.hpp"
+
+// An affine transform: a 3x3 linear part and a translation, stored as the top three rows of a
+// 4x4 matrix. Composition reads right to left, like matrices: (a * b).point(p) == a.point(b.point(p)).
+class Transform
+{
+public:
+  double m[3][4];
+
+  Transform() : m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}} {}
+
+  static Transform translate(const vec3 &offset)
+  {
+    Transform t;
+    for (int row = 0; row < 3; row++)
+      t.m[row][3] = offset[row];
+    return t;
+  }
+
+  static Transform scale(const vec3 &factors)
+  {
+    Transform t;
+    for (int row = 0; row < 3; row++)
+      t.m[row][row] = factors[row];
+    return t;
+  }
+
+  static Transform scale(double factor) { return scale(vec3(factor, factor, factor)); }
+
+  // Rotation by `degrees` around `axis`, counter-clockwise when looking down the axis.
+  static Transform rotate(const vec3 &axis, double degrees)
+  {
+    vec3 a = unit_vector(axis);
+    double radians = degrees_to_radians(degrees);
+    double s = std::sin(radians);
+    double c = std::cos(radians);
+    double k = 1 - c;
+
+    Transform t;
+    t.m[0][0] = a.x() * a.x() * k + c;
+    t.m[0][1] = a.x() * a.y() * k - a.z() * s;
+    t.m[0][2] = a.x() * a.z() * k + a.y() * s;
+    t.m[1][0] = a.y() * a.x() * k + a.z() * s;
+    t.m[1][1] = a.y() * a.y() * k + c;
+    t.m[1][2] = a.y() * a.z() * k - a.x() * s;
+    t.m[2][0] = a.z() * a.x() * k - a.y() * s;
+    t.m[2][1] = a.z() * a.y() * k + a.x() * s;
+    t.m[2][2] = a.z() * a.z() * k + c;
+    return t;
+  }
+
+  Transform operator*(const Transform &rhs) const
+  {
+    Transform t;
+    for (int row = 0; row < 3; row++)
+    {
+      for (int col = 0; col < 4; col++)
+      {
+        double sum = col == 3 ? m[row][3] : 0;
+        for (int k = 0; k < 3; k++)
+          sum += m[row][k] * rhs.m[k][col];
+        t.m[row][col] = sum;
+      }
+    }
+    return t;
+  }
+
+  point3 point(const point3 &p) const
+  {
+    return point3(m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+                  m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+                  m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+  }
+
+  vec3 vector(const vec3 &v) const
+  {
+    return vec3(m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(), m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+  }
+
+  // Multiplies by the transpose of the linear part. Normals go through the inverse transpose, so
+  // a world_to_object transform maps object-space normals to world space with this.
+  vec3 transpose_vector(const vec3 &v) const
+  {
+    return vec3(m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(), m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+                m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+  }
+
+  // Box around the eight transformed corners.
+  aabb box(const aabb &b) const
+  {
+    if (b.x.min > b.x.max || b.y.min > b.y.max || b.z.min > b.z.max)
+      return aabb::empty;
+
+    aabb result = aabb::empty;
+    for (int corner = 0; corner < 8; corner++)
+    {
+      point3 p(corner & 1 ? b.x.max : b.x.min, corner & 2 ? b.y.max : b.y.min, corner & 4 ? b.z.max : b.z.min);
+      point3 q = point(p);
+      result = aabb(result, aabb(q, q));
+    }
+    return result;
+  }
+
+  Transform inverse() const
+  {
+    // Inverse of the linear part by cofactors, then the translation moved to the other side.
+    double a = m[0][0], b = m[0][1], c = m[0][2];
+    double d = m[1][0], e = m[1][1], f = m[1][2];
+    double g = m[2][0], h = m[2][1], i = m[2][2];
+    double inv_det = 1 / (a * (e * i - f * h) - b * (d * i - f * g) + c * (d * h - e * g));
+
+    Transform t;
+    t.m[0][0] = (e * i - f * h) * inv_det;
+    t.m[0][1] = (c * h - b * i) * inv_det;
+    t.m[0][2] = (b * f - c * e) * inv_det;
+    t.m[1][0] = (f * g - d * i) * inv_det;
+    t.m[1][1] = (a * i - c * g) * inv_det;
+    t.m[1][2] = (c * d - a * f) * inv_det;
+    t.m[2][0] = (d * h - e * g) * inv_det;
+    t.m[2][1] = (b * g - a * h) * inv_det;
+    t.m[2][2] = (a * e - b * d) * inv_det;
+    for (int row = 0; row < 3; row++)
+      t.m[row][3] = -(t.m[row][0] * m[0][3] + t.m[row][1] * m[1][3] + t.m[row][2] * m[2][3]);
+    return t;
+  }
+};
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "./aabb.hpp"
+#include "./binary_io.hpp"
+#include "./interval.hpp"
+#include "./linear_bvh.hpp"
+#include "./ray.hpp"
+#include "./shape.hpp"
+#include "./stats.hpp"
+#include "./wide_bvh.hpp"
+
+struct Texcoord
+{
+  double u;
+  double v;
+};
+
+// Corners of one triangle, as indices into the mesh's position, normal and texcoord buffers.
+// A missing normal or texcoord is marked with TriangleMesh::no_index.
+struct Mesh_triangle
+{
+  uint32_t position[3];
+  uint32_t normal[3];
+  uint32_t texcoord[3];
+};
+
+// An indexed triangle mesh with one material. Like SphereSet it is a single Shape carrying its own
+// BVH over the triangles, so it can be added to a hittable_list or a bvh_node as one object.
+//
+// Usage: fill the buffers (see mesh_loader.hpp for OBJ and PLY files), then build() once.
+class TriangleMesh : public Shape
+{
+public:
+  static const uint32_t no_index = 0xffffffffu;
+
+  std::vector<point3> positions;
+  std::vector<vec3> normals;
+  std::vector<Texcoord> texcoords;
+  std::vector<Mesh_triangle> triangles;
+  const material *mat;
+
+  TriangleMesh(const material *mat) : mat(mat) {}
+
+  size_t size() const { return triangles.size(); }
+
+  // Whether every corner indexes into its buffer (or is no_index, for normals and texcoords).
+  bool indices_valid() const
+  {
+    for (const auto &tri : triangles)
+    {
+      for (int k = 0; k < 3; k++)
+      {
+        if (tri.position[k] >= positions.size() || (tri.normal[k] != no_index && tri.normal[k] >= normals.size()) ||
+            (tri.texcoord[k] != no_index && tri.texcoord[k] >= texcoords.size()))
+          return false;
+      }
+    }
+    return true;
+  }
+
+  // Builds the hierarchy and reorders `triangles` into leaf order.
+  void build(const Bvh_build_options &options = Bvh_build_options())
+  {
+    std::vector<aabb> bounds;
+    bounds.reserve(triangles.size());
+    for (const auto &tri : triangles)
+    {
+      const point3 &p0 = positions[tri.position[0]];
+      bounds.push_back(aabb(aabb(p0, positions[tri.position[1]]), aabb(p0, positions[tri.position[2]])));
+    }
+
+    bvh.build(bounds, options);
+    wide = options.width != 2 ? Wide_bvh(bvh, options.width) : Wide_bvh();
+
+    std::vector<Mesh_triangle> packed;
+    packed.reserve(triangles.size());
+    for (auto index : bvh.primitive_order())
+      packed.push_back(triangles[index]);
+    triangles.swap(packed);
+
+    bbox = aabb::empty;
+    for (const auto &box : bounds)
+      bbox = aabb(bbox, box);
+  }
+
+  // Cache support: the buffers and the hierarchy exactly as build() left them.
+  void save(Binary_writer &out) const
+  {
+    out.array(positions);
+    out.array(normals);
+    out.array(texcoords);
+    out.array(triangles);
+    bvh.save(out);
+    for (const Interval *axis : {&bbox.x, &bbox.y, &bbox.z})
+    {
+      out.value(axis->min);
+      out.value(axis->max);
+    }
+  }
+
+  bool load(Binary_reader &in, const Bvh_build_options &options = Bvh_build_options())
+  {
+    in.array(positions);
+    in.array(normals);
+    in.array(texcoords);
+    in.array(triangles);
+    bool hierarchy_valid = bvh.load(in, triangles.size());
+    for (Interval *axis : {&bbox.x, &bbox.y, &bbox.z})
+    {
+      in.value(axis->min);
+      in.value(axis->max);
+    }
+    // Anything out of range means a damaged cache, which the caller answers by reparsing.
+    if (!in.good() || !hierarchy_valid || !indices_valid())
+      return false;
+
+    wide = options.width != 2 ? Wide_bvh(bvh, options.width) : Wide_bvh();
+    return true;
+  }
+
+  aabb bounding_box() const override { return bbox; }
+
+  bool hit(const ray &r, Interval ray_t, hit_record &rec) const override
+  {
+    return find_hit<false>(r, ray_t, rec, nullptr);
+  }
+
+  bool hit_counted(const ray &r, Interval ray_t, hit_record &rec, stats::Traversal_cost &cost) const override
+  {
+    return find_hit<true>(r, ray_t, rec, &cost);
+  }
+
+private:
+  Linear_bvh bvh;
+  Wide_bvh wide;
+  aabb bbox = aabb::empty;
+
+  template <bool Counted>
+  bool find_hit(const ray &r, Interval ray_t, hit_record &rec, stats::Traversal_cost *cost) const
+  {
+    size_t closest = 0;
+    double closest_t = 0, closest_b1 = 0, closest_b2 = 0;
+
+    auto hit_leaf = [&](size_t first, size_t count, Interval &t)
+    {
+      bool hit_anything = false;
+      stats::add(stats::triangle_tests, count);
+      if constexpr (Counted)
+        cost->primitives += count;
+      for (size_t k = first; k < first + count; k++)
+      {
+        double root, b1, b2;
+        if (hit_triangle(triangles[k], r, t, root, b1, b2))
+        {
+          t.max = closest_t = root;
+          closest = k;
+          closest_b1 = b1;
+          closest_b2 = b2;
+          hit_anything = true;
+        }
+      }
+      return hit_anything;
+    };
+
+    bool hit_anything =
+        !wide.empty() ? wide.traverse<Counted>(r, ray_t, hit_leaf, cost) : bvh.traverse<Counted>(r, ray_t, hit_leaf, cost);
+    if (!hit_anything)
+      return false;
+
+    set_record(r, closest, closest_t, closest_b1, closest_b2, rec);
+    return true;
+  }
+
+  // Möller–Trumbore. On a hit inside ray_t, returns the distance and the barycentric weights of
+  // the second and third corners.
+  bool hit_triangle(const Mesh_triangle &tri, const ray &r, const Interval &ray_t, double &root, double &b1, double &b2) const
+  {
+    const point3 &p0 = positions[tri.position[0]];
+    vec3 edge1 = positions[tri.position[1]] - p0;
+    vec3 edge2 = positions[tri.position[2]] - p0;
+
+    vec3 pvec = cross(r.direction(), edge2);
+    double det = dot(edge1, pvec);
+    if (det == 0)
+      return false;  // Ray parallel to the triangle's plane
+    double inv_det = 1 / det;
+
+    vec3 tvec = r.origin() - p0;
+    b1 = dot(tvec, pvec) * inv_det;
+    if (!(b1 >= 0 && b1 <= 1))
+      return false;
+
+    vec3 qvec = cross(tvec, edge1);
+    b2 = dot(r.direction(), qvec) * inv_det;
+    if (!(b2 >= 0 && b1 + b2 <= 1))
+      return false;
+
+    root = dot(edge2, qvec) * inv_det;
+    return ray_t.surrounds(root);
+  }
+
+  void set_record(const ray &r, size_t k, double root, double b1, double b2, hit_record &record) const
+  {
+    const Mesh_triangle &tri = triangles[k];
+    const double b0 = 1 - b1 - b2;
+
+    const point3 &p0 = positions[tri.position[0]];
+    vec3 geometric_normal = unit_vector(cross(positions[tri.position[1]] - p0, positions[tri.position[2]] - p0));
+
+    record.t = root;
+    record.point = r.at(record.t);
+    record.mat = mat;
+    record.light = nullptr;
+
+    // Sidedness comes from the geometric normal; interpolated normals only shade.
+    record.is_front_facing = dot(r.direction(), geometric_normal) < 0;
+    vec3 shading_normal = geometric_normal;
+    if (tri.normal[0] != no_index)
+    {
+      vec3 n = b0 * normals[tri.normal[0]] + b1 * normals[tri.normal[1]] + b2 * normals[tri.normal[2]];
+      if (n.length_squared() > 0)
+        shading_normal = unit_vector(n);
+    }
+    bool shading_front = dot(shading_normal, geometric_normal) >= 0;
+    record.normal = (record.is_front_facing == shading_front) ? shading_normal : -shading_normal;
+
+    if (tri.texcoord[0] != no_index)
+    {
+      const Texcoord &t0 = texcoords[tri.texcoord[0]];
+      const Texcoord &t1 = texcoords[tri.texcoord[1]];
+      const Texcoord &t2 = texcoords[tri.texcoord[2]];
+      record.u = b0 * t0.u + b1 * t1.u + b2 * t2.u;
+      record.v = b0 * t0.v + b1 * t1.v + b2 * t2.v;
+    }
+    else
+    {
+      record.u = b1;
+      record.v = b2;
+    }
+  }
+};
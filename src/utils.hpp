@@ -1,14 +1,9 @@
 #pragma once
 
 #include <cmath>
-#include <cstdlib>
+#include <cstdint>
+#include <cstring>
 #include <limits>
-#include <memory>
-
-// C++ Std Usings
-
-using std::make_shared;
-using std::shared_ptr;
 
 // Constants
 
@@ -19,11 +14,65 @@ const double pi = 3.1415926535897932385;
 
 inline double degrees_to_radians(double degrees) { return degrees * pi / 180.0; }
 
-// Returns a random real in [0,1).
-inline double random_double() { return std::rand() / (RAND_MAX + 1.0); }
+// Random Numbers
+
+// PCG32 generator (see pcg-random.org): a 64-bit LCG whose output is permuted down to 32 bits.
+// Small enough to copy around with a path, and every (seed, stream) pair gives an independent
+// sequence.
+class Rng
+{
+  uint64_t state = 0x853c49e6748fea9bULL;
+  uint64_t inc = 0xda3e39cb94b95bdbULL;
+
+public:
+  Rng() {}
+  Rng(uint64_t seed, uint64_t stream) { set_sequence(seed, stream); }
+
+  void set_sequence(uint64_t seed, uint64_t stream)
+  {
+    state = 0;
+    inc = (stream << 1) | 1;
+    next_uint();
+    state += seed;
+    next_uint();
+  }
+
+  uint32_t next_uint()
+  {
+    uint64_t old = state;
+    state = old * 0x5851f42d4c957f2dULL + inc;
+    auto xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+    auto rot = uint32_t(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+  }
+
+  // Returns a random real in [0,1).
+  double next_double() { return next_uint() * 0x1p-32; }
+};
+
+// Finalizer of SplitMix64; scrambles all input bits into all output bits.
+inline uint64_t mix_bits(uint64_t v)
+{
+  v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  v = (v ^ (v >> 27)) * 0x94d049bb133111ebULL;
+  return v ^ (v >> 31);
+}
 
-// Returns a random real in [min,max).
-inline double random_double(double min, double max) { return min + (max - min) * random_double(); }
+// Hash of a block of bytes, for telling files and settings apart. Not cryptographic.
+inline uint64_t hash_bytes(const void *data, size_t size, uint64_t seed = 0)
+{
+  auto p = static_cast<const unsigned char *>(data);
+  uint64_t h = mix_bits(seed ^ size);
+  for (; size >= 8; size -= 8, p += 8)
+  {
+    uint64_t word;
+    std::memcpy(&word, p, 8);
+    h = mix_bits(h ^ word);
+  }
+  uint64_t tail = 0;
+  std::memcpy(&tail, p, size);
+  return mix_bits(h ^ tail);
+}
 
-// Returns a random integer in [min,max].
-inline int random_int(int min, int max) { return int(random_double(min, max + 1)); }
+// The per-thread random numbers the renderer draws (random_double() and friends) are in
+// sampler.hpp.
@@ -3,6 +3,7 @@
 #include <cmath>
 #include <iostream>
 
+#include "./sampler.hpp"
 #include "utils.hpp"
 
 class vec3
@@ -82,15 +83,16 @@ inline vec3 cross(const vec3 &u, const vec3 &v)
 
 inline vec3 unit_vector(const vec3 &v) { return v / v.length(); }
 
+// Uniform on the unit sphere. Mapped from one random pair instead of rejection sampling, so that
+// it always takes the same two sample dimensions.
 inline vec3 random_unit_vector()
 {
-  while (true)
-  {
-    auto p = vec3::random(-1, 1);
-    auto len_sq = p.length_squared();
-    if (1e-160 < len_sq && len_sq <= 1)
-      return p / sqrt(len_sq);
-  }
+  double a, b;
+  random_pair(a, b);
+  auto z = 1 - 2 * a;
+  auto r = std::sqrt(std::fmax(0.0, 1 - z * z));
+  auto phi = 2 * pi * b;
+  return vec3(r * std::cos(phi), r * std::sin(phi), z);
 }
 
 inline vec3 random_on_hemisphere(const vec3 &normal)
@@ -112,12 +114,26 @@ inline vec3 refract(const vec3 &uv, const vec3 &n, double etai_over_etat)
   return r_out_perp + r_out_parallel;
 }
 
+// Uniform in the unit disk, by Shirley and Chiu's concentric mapping of a random pair.
 inline vec3 random_in_unit_disk()
 {
-  while (true)
+  double a, b;
+  random_pair(a, b);
+  a = 2 * a - 1;
+  b = 2 * b - 1;
+  if (a == 0 && b == 0)
+    return vec3(0, 0, 0);
+  const double quarter_pi = pi / 4;
+  double r, theta;
+  if (std::fabs(a) > std::fabs(b))
+  {
+    r = a;
+    theta = quarter_pi * (b / a);
+  }
+  else
   {
-    auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-    if (p.length_squared() < 1)
-      return p;
+    r = b;
+    theta = 2 * quarter_pi - quarter_pi * (a / b);
   }
+  return vec3(r * std::cos(theta), r * std::sin(theta), 0);
 }
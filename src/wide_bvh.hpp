@@ -0,0 +1,342 @@
+#pragma once
+
+#include <cfloat>
+#include <cstdint>
+#include <vector>
+
+#include "./interval.hpp"
+#include "./linear_bvh.hpp"
+#include "./ray.hpp"
+#include "./simd.hpp"
+#include "./stats.hpp"
+
+// Node of a multi-branching BVH. The bounds of all Width children sit in structure-of-arrays
+// order, bounds[0 = min / 1 = max][axis][child], so one SIMD slab test covers every child.
+// Unused child slots hold an empty box, which no ray can hit.
+template <int Width>
+struct alignas(Width * sizeof(float)) Wide_bvh_node
+{
+  float bounds[2][3][Width];
+  uint32_t child[Width];  // Interior child node index, or leaf_flag | index into the leaf table
+};
+
+// A ray converted once to what the SIMD slab test needs: float origin, inverse direction and
+// the direction sign per axis.
+struct Wide_ray
+{
+  float orig[3];
+  float inv_dir[3];
+  int dir_is_negative[3];
+
+  Wide_ray(const ray &r)
+  {
+    for (int axis = 0; axis < 3; axis++)
+    {
+      orig[axis] = float(r.origin()[axis]);
+      inv_dir[axis] = float(1.0 / r.direction()[axis]);
+      dir_is_negative[axis] = inv_dir[axis] < 0;
+    }
+  }
+};
+
+// A 4-wide (SSE / NEON) or 8-wide (AVX2) BVH, collapsed from a binary Linear_bvh. It keeps the
+// binary tree's primitive order, so leaves refer to the same packed primitive ranges.
+class Wide_bvh
+{
+public:
+  static const uint32_t leaf_flag = 0x80000000u;
+
+  Wide_bvh() {}
+
+  // A width of 0 picks 8 when the CPU supports AVX2 and 4 otherwise. 8 also falls back to 4
+  // without AVX2, and any other width builds 4.
+  Wide_bvh(const Linear_bvh &binary, int width = 0)
+  {
+    if (width == 0 || width == 8)
+      width = cpu_has_avx2() ? 8 : 4;
+    else
+      width = 4;
+#if !RT_AVX2_DISPATCH
+    width = 4;
+#endif
+    node_width = width;
+
+    const auto &source = binary.node_array();
+    if (source.empty())
+      return;
+    stats::Scoped_timer timer(stats::bvh_build);
+    if (node_width == 8)
+      collapse(source, nodes8, 0);
+    else
+      collapse(source, nodes4, 0);
+  }
+
+  int width() const { return node_width; }
+  bool empty() const { return nodes4.empty() && nodes8.empty(); }
+
+  // Same contract as Linear_bvh::traverse.
+  template <bool Counted = false, typename Leaf_hit>
+  bool traverse(const ray &r, Interval ray_t, Leaf_hit &&hit_leaf, stats::Traversal_cost *cost = nullptr) const
+  {
+#if RT_AVX2_DISPATCH
+    if (node_width == 8)
+      return traverse_nodes<Counted>(nodes8, r, ray_t, hit_leaf, hit_children_avx2, cost);
+#endif
+    return traverse_nodes<Counted>(nodes4, r, ray_t, hit_leaf, hit_children_4, cost);
+  }
+
+private:
+  struct Leaf
+  {
+    uint32_t first;
+    uint32_t count;
+  };
+
+  int node_width = 4;
+  std::vector<Wide_bvh_node<4>> nodes4;
+  std::vector<Wide_bvh_node<8>> nodes8;
+  std::vector<Leaf> leaves;
+
+  template <int Width>
+  uint32_t collapse(const std::vector<Linear_bvh_node> &source, std::vector<Wide_bvh_node<Width>> &nodes, uint32_t source_index)
+  {
+    // Pull grandchildren up into this node, always opening the largest interior child, until
+    // it has Width children or only leaves are left.
+    uint32_t children[Width];
+    int child_count = 0;
+    const auto &root = source[source_index];
+    if (root.is_leaf())
+    {
+      children[child_count++] = source_index;
+    }
+    else
+    {
+      children[child_count++] = source_index + 1;
+      children[child_count++] = root.offset;
+    }
+
+    while (child_count < Width)
+    {
+      int widest = -1;
+      double widest_area = -1;
+      for (int c = 0; c < child_count; c++)
+      {
+        const auto &node = source[children[c]];
+        if (node.is_leaf())
+          continue;
+        double area = box_of(node).surface_area();
+        if (area > widest_area)
+        {
+          widest_area = area;
+          widest = c;
+        }
+      }
+      if (widest < 0)
+        break;
+
+      uint32_t opened = children[widest];
+      children[widest] = opened + 1;
+      children[child_count++] = source[opened].offset;
+    }
+
+    uint32_t index = uint32_t(nodes.size());
+    nodes.emplace_back();
+    for (int axis = 0; axis < 3; axis++)
+    {
+      for (int c = 0; c < Width; c++)
+      {
+        nodes[index].bounds[0][axis][c] = +INFINITY;
+        nodes[index].bounds[1][axis][c] = -INFINITY;
+      }
+    }
+
+    for (int c = 0; c < child_count; c++)
+    {
+      const auto &node = source[children[c]];
+      for (int axis = 0; axis < 3; axis++)
+      {
+        nodes[index].bounds[0][axis][c] = node.bounds_min[axis];
+        nodes[index].bounds[1][axis][c] = node.bounds_max[axis];
+      }
+
+      uint32_t ref;
+      if (node.is_leaf())
+      {
+        ref = leaf_flag | uint32_t(leaves.size());
+        leaves.push_back({node.offset, node.primitive_count});
+      }
+      else
+      {
+        ref = collapse(source, nodes, children[c]);
+      }
+      nodes[index].child[c] = ref;  // Re-index: collapse() may have reallocated `nodes`
+    }
+    for (int c = child_count; c < Width; c++)
+      nodes[index].child[c] = leaf_flag;
+
+    return index;
+  }
+
+  static aabb box_of(const Linear_bvh_node &node)
+  {
+    return aabb(point3(node.bounds_min[0], node.bounds_min[1], node.bounds_min[2]),
+                point3(node.bounds_max[0], node.bounds_max[1], node.bounds_max[2]));
+  }
+
+  template <bool Counted, int Width, typename Leaf_hit, typename Hit_children>
+  bool traverse_nodes(const std::vector<Wide_bvh_node<Width>> &nodes, const ray &r, Interval ray_t, Leaf_hit &hit_leaf,
+                      Hit_children hit_children, stats::Traversal_cost *cost) const
+  {
+    if (nodes.empty())
+      return false;
+
+    struct Entry
+    {
+      uint32_t ref;
+      float t_near;
+    };
+
+    // Float slab results can be off by a few ulps; widen the far bound so edge hits survive.
+    const float far_scale = 1.0f + 2.0f * (3 * FLT_EPSILON / 2) / (1 - 3 * FLT_EPSILON / 2);
+
+    Wide_ray wide(r);
+    Entry stack[256];
+    int stack_size = 0;
+    stack[stack_size++] = {0, float(ray_t.min)};
+    bool hit_anything = false;
+    uint64_t leaves_visited = 0, nodes_visited = 0;
+
+    while (stack_size > 0)
+    {
+      Entry entry = stack[--stack_size];
+      if (entry.t_near > ray_t.max)
+        continue;
+
+      if (entry.ref & leaf_flag)
+      {
+        leaves_visited++;
+        const Leaf &leaf = leaves[entry.ref & ~leaf_flag];
+        if (hit_leaf(size_t(leaf.first), size_t(leaf.count), ray_t))
+          hit_anything = true;
+        continue;
+      }
+
+      nodes_visited++;
+      alignas(32) float t_near[Width];
+      float t_max = float(ray_t.max) * far_scale;
+      int mask = hit_children(nodes[entry.ref], wide, float(ray_t.min), t_max, t_near);
+
+      // Push hit children farthest first, so the nearest one is popped next.
+      Entry hits[Width];
+      int hit_count = 0;
+      for (int c = 0; c < Width; c++)
+      {
+        if (!(mask & (1 << c)))
+          continue;
+        Entry e = {nodes[entry.ref].child[c], t_near[c]};
+        int k = hit_count++;
+        while (k > 0 && hits[k - 1].t_near < e.t_near)
+        {
+          hits[k] = hits[k - 1];
+          k--;
+        }
+        hits[k] = e;
+      }
+      for (int k = 0; k < hit_count; k++)
+        stack[stack_size++] = hits[k];
+    }
+
+    stats::add(stats::bvh_nodes, nodes_visited + leaves_visited);
+    stats::add(stats::box_tests, nodes_visited * Width);
+    if constexpr (Counted)
+      cost->nodes += nodes_visited + leaves_visited;
+    return hit_anything;
+  }
+
+  // Slab test of a ray against all children of a node. Returns a bit mask of the children hit and
+  // stores each child's entry distance in t_near.
+  static int hit_children_4(const Wide_bvh_node<4> &node, const Wide_ray &r, float t_min, float t_max, float *t_near)
+  {
+#if defined(__SSE2__) || defined(_M_X64)
+    __m128 lo = _mm_set1_ps(t_min);
+    __m128 hi = _mm_set1_ps(t_max);
+    for (int axis = 0; axis < 3; axis++)
+    {
+      int neg = r.dir_is_negative[axis];
+      __m128 orig = _mm_set1_ps(r.orig[axis]);
+      __m128 inv = _mm_set1_ps(r.inv_dir[axis]);
+      __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[neg][axis]), orig), inv);
+      __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1 - neg][axis]), orig), inv);
+      // maxps/minps return the second operand when either is NaN (0 * inf), ignoring that axis.
+      lo = _mm_max_ps(t0, lo);
+      hi = _mm_min_ps(t1, hi);
+    }
+    _mm_store_ps(t_near, lo);
+    return _mm_movemask_ps(_mm_cmple_ps(lo, hi));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t lo = vdupq_n_f32(t_min);
+    float32x4_t hi = vdupq_n_f32(t_max);
+    for (int axis = 0; axis < 3; axis++)
+    {
+      int neg = r.dir_is_negative[axis];
+      float32x4_t orig = vdupq_n_f32(r.orig[axis]);
+      float32x4_t inv = vdupq_n_f32(r.inv_dir[axis]);
+      float32x4_t t0 = vmulq_f32(vsubq_f32(vld1q_f32(node.bounds[neg][axis]), orig), inv);
+      float32x4_t t1 = vmulq_f32(vsubq_f32(vld1q_f32(node.bounds[1 - neg][axis]), orig), inv);
+      // The "nm" variants return the number when one operand is NaN (0 * inf).
+      lo = vmaxnmq_f32(t0, lo);
+      hi = vminnmq_f32(t1, hi);
+    }
+    vst1q_f32(t_near, lo);
+    uint32x4_t hit = vcleq_f32(lo, hi);
+    return int((vgetq_lane_u32(hit, 0) & 1) | (vgetq_lane_u32(hit, 1) & 2) | (vgetq_lane_u32(hit, 2) & 4) |
+               (vgetq_lane_u32(hit, 3) & 8));
+#else
+    return hit_children_scalar(node, r, t_min, t_max, t_near);
+#endif
+  }
+
+#if RT_AVX2_DISPATCH
+  RT_TARGET_AVX2 static int hit_children_avx2(const Wide_bvh_node<8> &node, const Wide_ray &r, float t_min, float t_max,
+                                               float *t_near)
+  {
+    __m256 lo = _mm256_set1_ps(t_min);
+    __m256 hi = _mm256_set1_ps(t_max);
+    for (int axis = 0; axis < 3; axis++)
+    {
+      int neg = r.dir_is_negative[axis];
+      __m256 orig = _mm256_set1_ps(r.orig[axis]);
+      __m256 inv = _mm256_set1_ps(r.inv_dir[axis]);
+      __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[neg][axis]), orig), inv);
+      __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[1 - neg][axis]), orig), inv);
+      lo = _mm256_max_ps(t0, lo);
+      hi = _mm256_min_ps(t1, hi);
+    }
+    _mm256_store_ps(t_near, lo);
+    return _mm256_movemask_ps(_mm256_cmp_ps(lo, hi, _CMP_LE_OQ));
+  }
+#endif
+
+  template <int Width>
+  static int hit_children_scalar(const Wide_bvh_node<Width> &node, const Wide_ray &r, float t_min, float t_max, float *t_near)
+  {
+    int mask = 0;
+    for (int c = 0; c < Width; c++)
+    {
+      float lo = t_min;
+      float hi = t_max;
+      for (int axis = 0; axis < 3; axis++)
+      {
+        int neg = r.dir_is_negative[axis];
+        float t0 = (node.bounds[neg][axis][c] - r.orig[axis]) * r.inv_dir[axis];
+        float t1 = (node.bounds[1 - neg][axis][c] - r.orig[axis]) * r.inv_dir[axis];
+        lo = t0 > lo ? t0 : lo;
+        hi = t1 < hi ? t1 : hi;
+      }
+      t_near[c] = lo;
+      if (lo <= hi)
+        mask |= 1 << c;
+    }
+    return mask;
+  }
+};
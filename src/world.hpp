@@ -1,30 +1,27 @@
 #pragma once
 
-#include <memory>
 #include <vector>
 
 #include "./aabb.hpp"
 #include "./interval.hpp"
 #include "./shape.hpp"
 
-using std::make_shared;
-using std::shared_ptr;
-
+// A list of shapes owned elsewhere (normally by a Scene).
 class hittable_list : public Shape
 {
   aabb bbox;
 
 public:
-  std::vector<shared_ptr<Shape>> objects;
+  std::vector<const Shape *> objects;
 
   hittable_list() {}
-  hittable_list(shared_ptr<Shape> object) { add(object); }
+  hittable_list(const Shape *object) { add(object); }
 
   ~hittable_list() {}
 
   void clear() { objects.clear(); }
 
-  void add(shared_ptr<Shape> object)
+  void add(const Shape *object)
   {
     objects.push_back(object);
     bbox = aabb(bbox, object->bounding_box());
@@ -49,5 +46,32 @@ public:
     return hit_anything;
   }
 
+  bool hit_counted(const ray &r, Interval interval, hit_record &rec, stats::Traversal_cost &cost) const override
+  {
+    hit_record temp_rec;
+    bool hit_anything = false;
+    auto closest_so_far = interval.max;
+
+    for (const auto &object : objects)
+    {
+      if (object->hit_counted(r, Interval(interval.min, closest_so_far), temp_rec, cost))
+      {
+        hit_anything = true;
+        closest_so_far = temp_rec.t;
+        rec = temp_rec;
+      }
+    }
+
+    return hit_anything;
+  }
+
+  int hit8(RayPacket8 &packet, hit_record *records) const override
+  {
+    int hits = 0;
+    for (const auto &object : objects)
+      hits |= object->hit8(packet, records);
+    return hits;
+  }
+
   aabb bounding_box() const override { return bbox; }
 };